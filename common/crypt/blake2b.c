@@ -7,7 +7,6 @@
 #include <crypt/blake2b.h>
 #include <lib/libc.h>
 
-#define BLAKE2B_BLOCK_BYTES 128
 #define BLAKE2B_KEY_BYTES 64
 #define BLAKE2B_SALT_BYTES 16
 #define BLAKE2B_PERSONAL_BYTES 16
@@ -38,15 +37,6 @@ static const uint8_t blake2b_sigma[12][16] = {
     { 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
 };
 
-struct blake2b_state {
-    uint64_t h[8];
-    uint64_t t[2];
-    uint64_t f[2];
-    uint8_t buf[BLAKE2B_BLOCK_BYTES];
-    size_t buf_len;
-    uint8_t last_node;
-};
-
 struct blake2b_param {
     uint8_t digest_length;
     uint8_t key_length;
@@ -135,7 +125,7 @@ static void blake2b_compress(struct blake2b_state *state, const uint8_t block[st
 #undef G
 #undef ROUND
 
-static void blake2b_init(struct blake2b_state *state) {
+void blake2b_init(struct blake2b_state *state) {
     struct blake2b_param param = {0};
 
     param.digest_length = BLAKE2B_OUT_BYTES;
@@ -153,7 +143,7 @@ static void blake2b_init(struct blake2b_state *state) {
     }
 }
 
-static void blake2b_update(struct blake2b_state *state, const void *in, size_t in_len) {
+void blake2b_update(struct blake2b_state *state, const void *in, size_t in_len) {
     if (in_len == 0) {
         return;
     }
@@ -175,8 +165,8 @@ static void blake2b_update(struct blake2b_state *state, const void *in, size_t i
             blake2b_increment_counter(state, BLAKE2B_BLOCK_BYTES);
             blake2b_compress(state, in);
 
-            in += fill;
-            in_len -= fill;
+            in += BLAKE2B_BLOCK_BYTES;
+            in_len -= BLAKE2B_BLOCK_BYTES;
         }
     }
 
@@ -184,7 +174,7 @@ static void blake2b_update(struct blake2b_state *state, const void *in, size_t i
     state->buf_len += in_len;
 }
 
-static void blake2b_final(struct blake2b_state *state, void *out) {
+void blake2b_final(struct blake2b_state *state, void *out) {
     uint8_t buffer[BLAKE2B_OUT_BYTES] = {0};
 
     blake2b_increment_counter(state, state->buf_len);
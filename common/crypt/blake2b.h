@@ -1,10 +1,26 @@
 #ifndef CRYPT__BLAKE2B_H__
 #define CRYPT__BLAKE2B_H__
 
+#include <stdint.h>
 #include <stddef.h>
 
 #define BLAKE2B_OUT_BYTES 64
+#define BLAKE2B_BLOCK_BYTES 128
+
+struct blake2b_state {
+    uint64_t h[8];
+    uint64_t t[2];
+    uint64_t f[2];
+    uint8_t buf[BLAKE2B_BLOCK_BYTES];
+    size_t buf_len;
+    uint8_t last_node;
+};
 
 void blake2b(void *out, const void *in, size_t in_len);
 
+// For hashing data that is not all in memory at once
+void blake2b_init(struct blake2b_state *state);
+void blake2b_update(struct blake2b_state *state, const void *in, size_t in_len);
+void blake2b_final(struct blake2b_state *state, void *out);
+
 #endif
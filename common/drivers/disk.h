@@ -4,13 +4,15 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
-#include <lib/part.h>
+
+struct volume;
 
 #if defined (UEFI)
 
 #include <efi.h>
 
 struct volume *disk_volume_from_efi_handle(EFI_HANDLE efi_handle);
+EFI_HANDLE disk_efi_part_handle(struct volume *volume);
 
 #endif
 
@@ -20,7 +22,33 @@ enum {
     DISK_FAILURE
 };
 
+#define DISK_MAX_INFLIGHT 4
+
+// A read submitted with disk_read_sectors_async(). Drives without queued
+// reads complete the request on submission.
+struct disk_request {
+    struct volume *volume;
+    void *buf;
+    uint64_t block;
+    size_t count;
+    int status;
+    bool pending;
+#if defined (UEFI)
+    EFI_BLOCK_IO2_TOKEN token;
+#endif
+};
+
 void disk_create_index(void);
 int disk_read_sectors(struct volume *volume, void *buf, uint64_t block, size_t count);
+int disk_read_sectors_async(struct volume *volume, struct disk_request *req,
+                            void *buf, uint64_t block, size_t count);
+int disk_complete(struct disk_request *req);
+// Whether requests on this drive actually run in the background
+bool disk_can_queue(struct volume *volume);
+
+#if defined (BIOS)
+void disk_tune_xfer_size(struct volume *volume);
+void disk_set_xfer_size(size_t sectors);
+#endif
 
 #endif
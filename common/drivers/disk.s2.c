@@ -19,9 +19,11 @@
 #define DEFAULT_FASTEST_XFER_SIZE 64
 #define MAX_FASTEST_XFER_SIZE 512
 
-#if defined (BIOS)
+// Upper bound for a single disk_read_sectors() call when reading directly
+// into the destination buffer.
+#define MAX_DIRECT_XFER_BYTES 0x400000
 
-#define MAX_VOLUMES 64
+#if defined (BIOS)
 
 struct dpte {
     uint16_t io_port;
@@ -56,93 +58,179 @@ struct dap {
     uint16_t offset;
     uint16_t segment;
     uint64_t lba;
+    // EDD 3.0, only looked at if size is 0x18 and segment:offset is ffff:ffff
+    uint64_t flat_addr;
 };
 
+// EDD limits a single transfer to 127 blocks
+#define MAX_EDD_XFER_COUNT 127
+
 #define XFER_BUF_SIZE (xfer_sizes[SIZEOF_ARRAY(xfer_sizes) - 1] * 512)
+// The bounce buffer is larger than the biggest probed transfer size so that
+// a single int 13h call can fill as many sectors as EDD allows.
+#define BOUNCE_BUF_SIZE (MAX_EDD_XFER_COUNT * 512)
 static const size_t xfer_sizes[] = { 1, 2, 4, 8, 16, 24, 32, 48, 64 };
 static uint8_t *xfer_buf = NULL;
 
-static size_t fastest_xfer_size(struct volume *volume) {
-    struct dap dap = {0};
+// Number of timed reads taken at a transfer size before comparing it with
+// the next smaller one.
+#define XFER_TUNE_SAMPLES 4
 
-    if (xfer_buf == NULL)
-        xfer_buf = conv_mem_alloc(XFER_BUF_SIZE);
-
-    size_t fastest_size = 1;
-    uint64_t last_speed = (uint64_t)-1;
+static size_t largest_xfer_size(struct volume *volume) {
+    size_t ret = xfer_sizes[0];
 
     for (size_t i = 0; i < SIZEOF_ARRAY(xfer_sizes); i++) {
         if (xfer_sizes[i] * volume->sector_size > XFER_BUF_SIZE) {
             break;
         }
+        ret = xfer_sizes[i];
+    }
 
-        dap.size    = 16;
-        dap.count   = xfer_sizes[i];
-        dap.segment = rm_seg(xfer_buf);
-        dap.offset  = rm_off(xfer_buf);
-        dap.lba     = 0;
+    return ret;
+}
 
-        uint64_t start_timestamp = rdtsc();
-        for (size_t j = 0; j < XFER_BUF_SIZE / 512; j += xfer_sizes[i]) {
-            struct rm_regs r = {0};
-            r.eax = 0x4200;
-            r.edx = volume->drive;
-            r.esi = (uint32_t)rm_off(&dap);
-            r.ds  = rm_seg(&dap);
-            rm_int(0x13, &r, &r);
-            if (r.eflags & EFLAGS_CF) {
-                int ah = (r.eax >> 8) & 0xff;
-                print("Disk error %x. Drive %x", ah, volume->drive);
-                return 8;
+// Rather than benchmarking every drive at enumeration time, start from the
+// largest transfer size and step down through xfer_sizes[] using the timings
+// of the block cache reads which happen anyway, until a smaller size stops
+// being faster per sector.
+void disk_tune_xfer_size(struct volume *volume) {
+    if (volume->xfer_size_tuned || volume->xfer_tune_samples < XFER_TUNE_SAMPLES) {
+        return;
+    }
+
+    uint64_t cost = volume->xfer_tune_ticks
+                  / (volume->xfer_tune_samples * volume->fastest_xfer_size);
+
+    volume->xfer_tune_ticks = 0;
+    volume->xfer_tune_samples = 0;
+
+    if (volume->xfer_best_size == 0 || cost < volume->xfer_best_cost) {
+        volume->xfer_best_size = volume->fastest_xfer_size;
+        volume->xfer_best_cost = cost;
+
+        for (size_t i = SIZEOF_ARRAY(xfer_sizes); i-- > 0; ) {
+            if (xfer_sizes[i] < volume->fastest_xfer_size) {
+                volume->fastest_xfer_size = xfer_sizes[i];
+                return;
             }
-            dap.lba += xfer_sizes[i];
         }
-        uint64_t end_timestamp = rdtsc();
+    }
 
-        uint64_t speed = end_timestamp - start_timestamp;
+    volume->fastest_xfer_size = volume->xfer_best_size;
+    volume->xfer_size_tuned = true;
 
-        if (speed < last_speed) {
-            last_speed = speed;
-            fastest_size = xfer_sizes[i];
-        }
+    printv("disk: Drive %x: using transfer size of %u sectors\n",
+           volume->drive, (uint32_t)volume->fastest_xfer_size);
+}
+
+void disk_set_xfer_size(size_t sectors) {
+    if (sectors == 0) {
+        return;
     }
 
-    return fastest_size;
+    for (size_t i = 0; i < volume_index_i; i++) {
+        struct volume *volume = volume_index[i];
+
+        if (volume->backing_dev != NULL) {
+            continue;
+        }
+
+        size_t max = largest_xfer_size(volume);
+
+        volume->fastest_xfer_size = sectors > max ? max : sectors;
+        volume->xfer_size_tuned = true;
+    }
 }
 
 int disk_read_sectors(struct volume *volume, void *buf, uint64_t block, size_t count) {
-    struct dap dap = {0};
+    if (xfer_buf == NULL)
+        xfer_buf = conv_mem_alloc(BOUNCE_BUF_SIZE);
+
+    // Split the request into the largest transfers the BIOS accepts. If the
+    // drive supports EDD 3.0 flat addressing, sectors are read straight into
+    // the destination, else they go through the conventional memory bounce
+    // buffer.
+    while (count > 0) {
+        struct dap dap = {0};
+        bool flat = volume->edd_flat_addr && buf != NULL;
+
+        size_t xfer_count;
+        if (flat) {
+            xfer_count = MAX_EDD_XFER_COUNT;
+        } else {
+            xfer_count = BOUNCE_BUF_SIZE / volume->sector_size;
+        }
+        if (xfer_count > count) {
+            xfer_count = count;
+        }
 
-    if (count * volume->sector_size > XFER_BUF_SIZE)
-        panic(false, "XFER");
+        dap.count = xfer_count;
+        dap.lba   = block;
 
-    if (xfer_buf == NULL)
-        xfer_buf = conv_mem_alloc(XFER_BUF_SIZE);
+        if (flat) {
+            dap.size      = 0x18;
+            dap.segment   = 0xffff;
+            dap.offset    = 0xffff;
+            dap.flat_addr = (uintptr_t)buf;
+        } else {
+            dap.size    = 16;
+            dap.segment = rm_seg(xfer_buf);
+            dap.offset  = rm_off(xfer_buf);
+        }
 
-    dap.size    = 16;
-    dap.count   = count;
-    dap.segment = rm_seg(xfer_buf);
-    dap.offset  = rm_off(xfer_buf);
-    dap.lba     = block;
+        struct rm_regs r = {0};
+        r.eax = 0x4200;
+        r.edx = volume->drive;
+        r.esi = (uint32_t)rm_off(&dap);
+        r.ds  = rm_seg(&dap);
 
-    struct rm_regs r = {0};
-    r.eax = 0x4200;
-    r.edx = volume->drive;
-    r.esi = (uint32_t)rm_off(&dap);
-    r.ds  = rm_seg(&dap);
+        uint64_t start_timestamp = rdtsc();
+        rm_int(0x13, &r, &r);
+        uint64_t end_timestamp = rdtsc();
 
-    rm_int(0x13, &r, &r);
+        if (r.eflags & EFLAGS_CF) {
+            return DISK_FAILURE;
+        }
 
-    if (r.eflags & EFLAGS_CF) {
-        return DISK_FAILURE;
-    }
+        if (!volume->xfer_size_tuned && xfer_count == volume->fastest_xfer_size) {
+            volume->xfer_tune_ticks += end_timestamp - start_timestamp;
+            volume->xfer_tune_samples++;
+        }
 
-    if (buf != NULL)
-        memcpy(buf, xfer_buf, count * volume->sector_size);
+        if (buf != NULL) {
+            if (!flat)
+                memcpy(buf, xfer_buf, xfer_count * volume->sector_size);
+            buf += xfer_count * volume->sector_size;
+        }
+
+        block += xfer_count;
+        count -= xfer_count;
+    }
 
     return DISK_SUCCESS;
 }
 
+// The BIOS has no way of queueing reads, so requests complete on submission.
+int disk_read_sectors_async(struct volume *volume, struct disk_request *req,
+                            void *buf, uint64_t block, size_t count) {
+    req->volume = volume;
+    req->buf = buf;
+    req->block = block;
+    req->count = count;
+    req->pending = false;
+    req->status = disk_read_sectors(volume, buf, block, count);
+    return req->status;
+}
+
+int disk_complete(struct disk_request *req) {
+    return req->status;
+}
+
+bool disk_can_queue(struct volume *volume) {
+    (void)volume;
+    return false;
+}
+
 static int disk_write_sectors(struct volume *volume, void *buf, uint64_t block, size_t count) {
     struct dap dap = {0};
 
@@ -150,7 +238,7 @@ static int disk_write_sectors(struct volume *volume, void *buf, uint64_t block,
         panic(false, "XFER");
 
     if (xfer_buf == NULL)
-        xfer_buf = conv_mem_alloc(XFER_BUF_SIZE);
+        xfer_buf = conv_mem_alloc(BOUNCE_BUF_SIZE);
 
     dap.size    = 16;
     dap.count   = count;
@@ -176,11 +264,47 @@ static int disk_write_sectors(struct volume *volume, void *buf, uint64_t block,
     return DISK_SUCCESS;
 }
 
+static bool detect_edd_flat_addr(struct volume *volume) {
+    struct rm_regs r = {0};
+    r.eax = 0x4100;
+    r.ebx = 0x55aa;
+    r.edx = volume->drive;
+
+    rm_int(0x13, &r, &r);
+
+    if ((r.eflags & EFLAGS_CF) || (r.ebx & 0xffff) != 0xaa55) {
+        return false;
+    }
+
+    // Major version in AH, 0x30 is EDD 3.0
+    if (((r.eax >> 8) & 0xff) < 0x30) {
+        return false;
+    }
+
+    // Plenty of BIOSes claim EDD 3.0 but ignore the flat address, so read
+    // the first sector both ways and check that the results match.
+    if (disk_read_sectors(volume, xfer_buf, 0, 1) != DISK_SUCCESS) {
+        return false;
+    }
+
+    uint8_t *test_buf = ext_mem_alloc(volume->sector_size);
+    memset(test_buf, 0, volume->sector_size);
+
+    volume->edd_flat_addr = true;
+    bool ret = disk_read_sectors(volume, test_buf, 0, 1) == DISK_SUCCESS
+            && memcmp(test_buf, xfer_buf, volume->sector_size) == 0;
+    volume->edd_flat_addr = false;
+
+    pmm_free(test_buf, volume->sector_size);
+
+    return ret;
+}
+
 static bool detect_sector_size(struct volume *volume) {
     struct dap dap = {0};
 
     if (xfer_buf == NULL)
-        xfer_buf = conv_mem_alloc(XFER_BUF_SIZE);
+        xfer_buf = conv_mem_alloc(BOUNCE_BUF_SIZE);
 
     dap.size    = 16;
     dap.count   = 1;
@@ -242,8 +366,6 @@ static bool detect_sector_size(struct volume *volume) {
 }
 
 void disk_create_index(void) {
-    volume_index = ext_mem_alloc(sizeof(struct volume) * MAX_VOLUMES);
-
     // Disk count (only non-removable) at 0040:0075
     uint8_t bda_disk_count = mminb(rm_desegment(0x0040, 0x0075));
 
@@ -311,35 +433,13 @@ void disk_create_index(void) {
             block->index = hdd_indices++;
         }
 
-        block->fastest_xfer_size = fastest_xfer_size(block);
-
-        if (gpt_get_guid(&block->guid, block)) {
-            block->guid_valid = true;
-        }
-
-        if (volume_index_i == MAX_VOLUMES) {
-            print("WARNING: TOO MANY VOLUMES!");
-            return;
-        }
-        volume_index[volume_index_i++] = block;
+        block->edd_flat_addr = detect_edd_flat_addr(block);
 
-        for (int part = 0; ; part++) {
-            struct volume *p = ext_mem_alloc(sizeof(struct volume));
-            int ret = part_get(p, block, part);
+        block->fastest_xfer_size = largest_xfer_size(block);
+        block->max_xfer_size = MAX_DIRECT_XFER_BYTES / block->sector_size;
 
-            if (ret == END_OF_TABLE || ret == INVALID_TABLE)
-                break;
-            if (ret == NO_PARTITION)
-                continue;
-
-            if (volume_index_i == MAX_VOLUMES) {
-                print("WARNING: TOO MANY VOLUMES!");
-                return;
-            }
-            volume_index[volume_index_i++] = p;
-
-            block->max_partition++;
-        }
+        // Partitions and filesystem labels are looked up on demand
+        volume_index_add(block);
     }
 }
 
@@ -347,8 +447,6 @@ void disk_create_index(void) {
 
 #if defined (UEFI)
 
-#define MAX_VOLUMES 256
-
 int disk_read_sectors(struct volume *volume, void *buf, uint64_t block, size_t count) {
     EFI_STATUS status;
 
@@ -363,6 +461,78 @@ int disk_read_sectors(struct volume *volume, void *buf, uint64_t block, size_t c
     }
 }
 
+int disk_read_sectors_async(struct volume *volume, struct disk_request *req,
+                            void *buf, uint64_t block, size_t count) {
+    EFI_STATUS status;
+
+    req->volume = volume;
+    req->buf = buf;
+    req->block = block;
+    req->count = count;
+    req->pending = false;
+
+    if (volume->block_io2 != NULL) {
+        status = gBS->CreateEvent(0, 0, NULL, NULL, &req->token.Event);
+        if (status == EFI_SUCCESS) {
+            req->token.TransactionStatus = EFI_SUCCESS;
+
+            status = volume->block_io2->ReadBlocksEx(volume->block_io2,
+                               volume->block_io2->Media->MediaId,
+                               block, &req->token,
+                               count * volume->sector_size, buf);
+
+            if (status == EFI_SUCCESS) {
+                req->pending = true;
+                req->status = DISK_SUCCESS;
+                return DISK_SUCCESS;
+            }
+
+            gBS->CloseEvent(req->token.Event);
+        }
+
+        // Some firmware publishes BlockIo2 without implementing it, stop
+        // trying on this drive.
+        if (status == EFI_UNSUPPORTED || status == EFI_OUT_OF_RESOURCES) {
+            printv("disk: Queued reads unavailable on drive %u, using BlockIo\n",
+                   volume->index);
+            volume->block_io2 = NULL;
+        }
+    }
+
+    req->status = disk_read_sectors(volume, buf, block, count);
+    return req->status;
+}
+
+int disk_complete(struct disk_request *req) {
+    if (!req->pending) {
+        return req->status;
+    }
+
+    UINTN which;
+    gBS->WaitForEvent(1, &req->token.Event, &which);
+    gBS->CloseEvent(req->token.Event);
+    req->pending = false;
+
+    switch (req->token.TransactionStatus) {
+        case EFI_SUCCESS:
+            req->status = DISK_SUCCESS;
+            break;
+        case EFI_NO_MEDIA:
+            req->status = DISK_NO_MEDIA;
+            break;
+        default:
+            // Retry through the blocking protocol before giving up
+            req->status = disk_read_sectors(req->volume, req->buf, req->block, req->count);
+            break;
+    }
+
+    return req->status;
+}
+
+bool disk_can_queue(struct volume *volume) {
+    return volume->block_io2 != NULL;
+}
+
 static struct volume *pxe_from_efi_handle(EFI_HANDLE efi_handle) {
     static struct volume *vol = NULL;
 
@@ -412,6 +582,103 @@ static struct volume *volume_by_unique_sector(void *b2b) {
     return NULL;
 }
 
+static void find_unique_sectors(void);
+
+static size_t device_path_size(EFI_DEVICE_PATH *dp) {
+    size_t size = 0;
+
+    for (; !IsDevicePathEnd(dp); dp = NextDevicePathNode(dp)) {
+        size += DevicePathNodeLength(dp);
+    }
+
+    return size;
+}
+
+// The device path of a partition is the one of its drive followed by a hard
+// drive node saying where the partition starts. This lets most handles be
+// matched without reading anything, and without enumerating the partitions
+// of any drive other than the one the handle belongs to.
+static struct volume *volume_by_device_path(EFI_HANDLE efi_handle, EFI_BLOCK_IO *block_io) {
+    EFI_STATUS status;
+
+    EFI_GUID device_path_guid = DEVICE_PATH_PROTOCOL;
+    EFI_DEVICE_PATH *dp = NULL;
+
+    status = gBS->HandleProtocol(efi_handle, &device_path_guid, (void **)&dp);
+    if (status || dp == NULL) {
+        return NULL;
+    }
+
+    EFI_DEVICE_PATH *last = NULL;
+    size_t size = 0, drive_size = 0;
+    for (EFI_DEVICE_PATH *node = dp; !IsDevicePathEnd(node); node = NextDevicePathNode(node)) {
+        last = node;
+        drive_size = size;
+        size += DevicePathNodeLength(node);
+    }
+
+    if (last == NULL) {
+        return NULL;
+    }
+
+    HARDDRIVE_DEVICE_PATH *hd = NULL;
+    if (block_io->Media->LogicalPartition) {
+        if (DevicePathType(last) != MEDIA_DEVICE_PATH
+         || DevicePathSubType(last) != MEDIA_HARDDRIVE_DP) {
+            return NULL;
+        }
+        hd = (HARDDRIVE_DEVICE_PATH *)last;
+    } else {
+        drive_size = size;
+    }
+
+    struct volume *drive = NULL;
+    for (size_t i = 0; i < volume_index_i; i++) {
+        struct volume *vol = volume_index[i];
+
+        if (vol->backing_dev != NULL || vol->pxe) {
+            continue;
+        }
+
+        EFI_DEVICE_PATH *drive_dp = NULL;
+        status = gBS->HandleProtocol(vol->efi_handle, &device_path_guid, (void **)&drive_dp);
+        if (status || drive_dp == NULL) {
+            continue;
+        }
+
+        if (device_path_size(drive_dp) == drive_size && memcmp(drive_dp, dp, drive_size) == 0) {
+            drive = vol;
+            break;
+        }
+    }
+
+    if (drive == NULL || hd == NULL) {
+        return drive;
+    }
+
+    // Makes sure the partitions of this drive are in the index
+    volume_get_by_coord(drive->is_optical, drive->index, 0);
+
+    struct volume *ret = NULL;
+    for (size_t i = 0; i < volume_index_i; i++) {
+        struct volume *vol = volume_index[i];
+
+        if (vol->backing_dev != drive
+         || (vol->first_sect * 512) / vol->sector_size != hd->PartitionStart) {
+            continue;
+        }
+
+        // Leave anything ambiguous to the slower methods
+        if (ret != NULL) {
+            return NULL;
+        }
+
+        ret = vol;
+    }
+
+    return ret;
+}
+
 struct volume *disk_volume_from_efi_handle(EFI_HANDLE efi_handle) {
     struct volume *ret;
 
@@ -427,6 +694,20 @@ struct volume *disk_volume_from_efi_handle(EFI_HANDLE efi_handle) {
 
     block_io->Media->WriteCaching = false;
 
+    ret = volume_by_device_path(efi_handle, block_io);
+    if (ret != NULL) {
+        return ret;
+    }
+
+    // Matching by contents needs every partition and its unique sector hash,
+    // which are only computed the first time a handle gets this far.
+    static bool unique_sectors_found = false;
+    if (!unique_sectors_found) {
+        volume_index_scan_all();
+        find_unique_sectors();
+        unique_sectors_found = true;
+    }
+
     uint64_t bdev_size = ((uint64_t)block_io->Media->LastBlock + 1) * (uint64_t)block_io->Media->BlockSize;
     if (bdev_size < UNIQUE_SECTOR_POOL_SIZE) {
         goto fallback;
@@ -584,6 +865,40 @@ static void find_part_handles(EFI_HANDLE *handles, size_t handle_count) {
     }
 }
 
+EFI_HANDLE disk_efi_part_handle(struct volume *volume) {
+    static bool part_handles_found = false;
+
+    if (part_handles_found) {
+        return volume->efi_part_handle;
+    }
+
+    part_handles_found = true;
+
+    EFI_STATUS status;
+
+    EFI_HANDLE tmp_handles[1];
+
+    EFI_GUID block_io_guid = BLOCK_IO_PROTOCOL;
+    EFI_HANDLE *handles = tmp_handles;
+    UINTN handles_size = sizeof(tmp_handles);
+
+    status = gBS->LocateHandle(ByProtocol, &block_io_guid, NULL, &handles_size, handles);
+    if (status != EFI_BUFFER_TOO_SMALL && status != EFI_SUCCESS) {
+        return NULL;
+    }
+
+    handles = ext_mem_alloc(handles_size);
+
+    status = gBS->LocateHandle(ByProtocol, &block_io_guid, NULL, &handles_size, handles);
+    if (status == EFI_SUCCESS) {
+        find_part_handles(handles, handles_size / sizeof(EFI_HANDLE));
+    }
+
+    pmm_free(handles, handles_size);
+
+    return volume->efi_part_handle;
+}
+
 void disk_create_index(void) {
     EFI_STATUS status;
 
@@ -592,6 +907,7 @@ void disk_create_index(void) {
     EFI_HANDLE tmp_handles[1];
 
     EFI_GUID block_io_guid = BLOCK_IO_PROTOCOL;
+    EFI_GUID block_io2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
     EFI_HANDLE *handles = tmp_handles;
     UINTN handles_size = sizeof(tmp_handles);
 
@@ -618,8 +934,6 @@ fail:
         panic(false, "LocateHandle for BLOCK_IO_PROTOCOL failed. Machine not supported by Limine UEFI.");
     }
 
-    volume_index = ext_mem_alloc(sizeof(struct volume) * MAX_VOLUMES);
-
     int optical_indices = 1, hdd_indices = 1;
 
     size_t handle_count = handles_size / sizeof(EFI_HANDLE);
@@ -655,6 +969,13 @@ fail:
 
         block->efi_handle = handles[i];
         block->block_io = drive;
+
+        EFI_BLOCK_IO2_PROTOCOL *drive2 = NULL;
+        status = gBS->HandleProtocol(handles[i], &block_io2_guid, (void **)&drive2);
+        if (status == EFI_SUCCESS && drive2 != NULL
+         && drive2->Media->BlockSize == drive->Media->BlockSize) {
+            block->block_io2 = drive2;
+        }
         block->partition = 0;
         block->sector_size = drive->Media->BlockSize;
         block->first_sect = 0;
@@ -671,42 +992,12 @@ fail:
             block->fastest_xfer_size = MAX_FASTEST_XFER_SIZE;
         }
 
-        if (gpt_get_guid(&block->guid, block)) {
-            block->guid_valid = true;
-        }
+        block->max_xfer_size = MAX_DIRECT_XFER_BYTES / block->sector_size;
 
-        if (volume_index_i == MAX_VOLUMES) {
-            print("WARNING: TOO MANY VOLUMES!");
-            return;
-        }
-        volume_index[volume_index_i++] = block;
-
-        for (int part = 0; ; part++) {
-            struct volume _p = {0};
-
-            int ret = part_get(&_p, block, part);
-
-            if (ret == END_OF_TABLE || ret == INVALID_TABLE)
-                break;
-            if (ret == NO_PARTITION)
-                continue;
-
-            struct volume *p = ext_mem_alloc(sizeof(struct volume));
-            memcpy(p, &_p, sizeof(struct volume));
-
-            if (volume_index_i == MAX_VOLUMES) {
-                print("WARNING: TOO MANY VOLUMES!");
-                return;
-            }
-            volume_index[volume_index_i++] = p;
-
-            block->max_partition++;
-        }
+        // Partitions and filesystem labels are looked up on demand
+        volume_index_add(block);
     }
 
-    find_unique_sectors();
-    find_part_handles(handles, handle_count);
-
     pmm_free(handles, handles_size);
 }
 
@@ -96,6 +96,8 @@ could_not_match:
             print("WARNING: Could not meaningfully match the boot device handle with a volume.\n");
             print("         Using the first volume containing a Limine configuration!\n");
 
+            volume_index_scan_all();
+
             for (size_t i = 0; i < volume_index_i; i++) {
                 struct file_handle *f;
 
@@ -5,9 +5,15 @@
 #include <lib/part.h>
 #include <fs/file.h>
 
-bool ext2_get_guid(struct guid *guid, struct volume *part);
-char *ext2_get_label(struct volume *part);
+struct ext2_context;
 
-struct file_handle *ext2_open(struct volume *part, const char *path);
+struct ext2_context *ext2_mount(struct volume *part);
+bool ext2_is_supported(struct ext2_context *context);
+void ext2_unmount(struct ext2_context *context);
+
+bool ext2_get_guid(struct guid *guid, struct ext2_context *context);
+char *ext2_get_label(struct ext2_context *context);
+
+struct file_handle *ext2_open(struct ext2_context *context, const char *path);
 
 #endif
@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <fs/ext2.h>
+#include <fs/file.h>
 #include <drivers/disk.h>
 #include <lib/libc.h>
 #include <lib/misc.h>
@@ -71,6 +72,13 @@ struct ext2_superblock {
     uint32_t first_meta_bg;
     uint32_t mkfs_time;
     uint32_t jnl_blocks[17];
+
+    uint32_t s_blocks_count_hi;
+    uint32_t s_r_blocks_count_hi;
+    uint32_t s_free_blocks_count_hi;
+    uint16_t s_min_extra_isize;
+    uint16_t s_want_extra_isize;
+    uint32_t s_flags;
 } __attribute__((packed));
 
 struct ext2_linux {
@@ -113,14 +121,65 @@ struct ext2_inode {
     struct ext2_linux i_osd2;
 } __attribute__((packed));
 
-struct ext2_file_handle {
+// A run of consecutive file blocks stored in consecutive disk blocks
+struct ext2_run {
+    uint64_t block;
+    uint64_t start;
+    uint64_t len;
+    bool zero; // uninitialised extent, reads back as zeroes
+};
+
+// Sorted by file block, blocks not covered by any run are holes
+struct ext2_block_map {
+    struct ext2_run *runs;
+    size_t run_count;
+    size_t run_max;
+};
+
+#define EXT2_INODE_CACHE_SIZE 16
+
+struct ext2_inode_cache_entry {
+    uint64_t ino;
+    uint64_t last_used;
+    struct ext2_inode inode;
+};
+
+// Everything about a filesystem that does not change between opens. Built
+// when the volume is first probed and kept for the lifetime of the
+// bootloader.
+struct ext2_context {
     struct volume *part;
+
+    // Cleared for filesystems with features we cannot read, which can
+    // still provide their label and UUID
+    bool supported;
+    // Set once the group descriptors and root inode have been read
+    bool loaded;
+
     struct ext2_superblock sb;
-    int size;
+    uint64_t block_size;
+    uint64_t inode_size;
+
+    // Group descriptor table, read whole
+    uint8_t *gdt;
+    size_t gdt_size;
+    size_t desc_size;
+    uint64_t group_count;
+    bool bit64;
+
     struct ext2_inode root_inode;
+
+    struct ext2_inode_cache_entry inode_cache[EXT2_INODE_CACHE_SIZE];
+    uint64_t inode_cache_ticks;
+};
+
+struct ext2_file_handle {
+    struct volume *part;
+    struct ext2_context *context;
+    int size;
     struct ext2_inode inode;
     uint64_t block_size;
-    uint32_t *alloc_map;
+    struct ext2_block_map map;
 };
 
 /* Inode types */
@@ -134,9 +193,15 @@ struct ext2_file_handle {
 
 #define FMT_MASK 0xf000
 
+/* Inode number of the root directory */
+#define EXT2_ROOT_INO 2
+
 /* EXT2 Filesystem States */
 #define EXT2_FS_UNRECOVERABLE_ERRORS 3
 
+/* Ext2 compatible features */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x20
+
 /* Ext2 incompatible features */
 #define EXT2_IF_COMPRESSION 0x01
 #define EXT2_IF_EXTENTS 0x40
@@ -146,8 +211,12 @@ struct ext2_file_handle {
 #define EXT2_FEATURE_INCOMPAT_META_BG 0x0010
 
 /* Ext4 flags */
+#define EXT2_INDEX_FL 0x1000
 #define EXT4_EXTENTS_FLAG 0x80000
 
+/* Superblock flags */
+#define EXT2_FLAGS_UNSIGNED_HASH 0x0002
+
 #define EXT2_S_MAGIC    0xEF53
 
 /* EXT2 Block Group Descriptor */
@@ -217,129 +286,625 @@ struct ext4_extent_idx {
     uint16_t empty;
 } __attribute__((packed));
 
+/* Hashed directory index */
+struct ext2_dx_root_info {
+    uint32_t reserved_zero;
+    uint8_t  hash_version;
+    uint8_t  info_length;
+    uint8_t  indirect_levels;
+    uint8_t  unused_flags;
+} __attribute__((packed));
+
+struct ext2_dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+} __attribute__((packed));
+
+struct ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;
+} __attribute__((packed));
+
+// The root block starts with the "." and ".." entries, interior nodes with
+// an empty entry spanning the whole block.
+#define EXT2_DX_ROOT_INFO_OFFSET 24
+#define EXT2_DX_NODE_OFFSET 8
+#define EXT2_DX_BLOCK_MASK 0x0fffffff
+#define EXT2_HTREE_MAX_LEVELS 3
+#define EXT2_HTREE_EOF 0x7fffffffU
+
+#define DX_HASH_LEGACY 0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA 2
+#define DX_HASH_LEGACY_UNSIGNED 3
+#define DX_HASH_HALF_MD4_UNSIGNED 4
+#define DX_HASH_TEA_UNSIGNED 5
+
+#define EXT4_EXT_MAGIC 0xf30a
+#define EXT4_EXT_MAX_DEPTH 5
+#define EXT4_EXT_INIT_MAX_LEN 32768
+
 static int inode_read(void *buf, uint64_t loc, uint64_t count,
-                      struct ext2_inode *inode, struct ext2_file_handle *fd,
-                      uint32_t *alloc_map);
+                      struct ext2_file_handle *fd, struct ext2_block_map *map);
+static void inode_read_queued(struct volume_read_queue *queue, void *buf, uint64_t loc, uint64_t count,
+                              struct ext2_file_handle *fd, struct ext2_block_map *map);
 static bool ext2_parse_dirent(struct ext2_dir_entry *dir, struct ext2_file_handle *fd, const char *path);
 
+static uint64_t ext2_inode_table(struct ext2_context *context, uint64_t group) {
+    uint8_t *desc = context->gdt + group * context->desc_size;
+
+    if (!context->bit64) {
+        return ((struct ext2_bgd *)desc)->bg_inode_table;
+    }
+
+    struct ext4_bgd *bgd = (struct ext4_bgd *)desc;
+    return bgd->bg_inode_table | ((uint64_t)bgd->inode_table_id_hi << 32);
+}
+
 // parse an inode given the partition base and inode number
 static bool ext2_get_inode(struct ext2_inode *ret,
                           struct ext2_file_handle *fd, uint64_t inode) {
     if (inode == 0)
         return false;
 
-    struct ext2_superblock *sb = &fd->sb;
+    struct ext2_context *context = fd->context;
+    struct ext2_inode_cache_entry *victim = &context->inode_cache[0];
 
-    //determine if we need to use 64 bit inode ids
-    bool bit64 = false;
-    if (sb->s_rev_level != 0
-        && (sb->s_feature_incompat & (EXT2_IF_64BIT))
-        && sb->group_desc_size != 0
-        && ((sb->group_desc_size & (sb->group_desc_size - 1)) == 0)) {
-                if(sb->group_desc_size > 32) {
-                    bit64 = true;
-                }
-            }
+    for (size_t i = 0; i < EXT2_INODE_CACHE_SIZE; i++) {
+        struct ext2_inode_cache_entry *entry = &context->inode_cache[i];
+
+        if (entry->last_used != 0 && entry->ino == inode) {
+            entry->last_used = ++context->inode_cache_ticks;
+            *ret = entry->inode;
+            return true;
+        }
+
+        if (entry->last_used < victim->last_used) {
+            victim = entry;
+        }
+    }
+
+    struct ext2_superblock *sb = &context->sb;
 
     const uint64_t ino_blk_grp = (inode - 1) / sb->s_inodes_per_group;
     const uint64_t ino_tbl_idx = (inode - 1) % sb->s_inodes_per_group;
 
-    const uint64_t block_size = ((uint64_t)1024 << sb->s_log_block_size);
-    uint64_t ino_offset;
-    const uint64_t bgd_start_offset = block_size >= 2048 ? block_size : block_size * 2;
-    const uint64_t ino_size = sb->s_rev_level == 0 ? sizeof(struct ext2_inode) : sb->s_inode_size;
+    if (ino_blk_grp >= context->group_count)
+        return false;
+
+    const uint64_t ino_offset = ext2_inode_table(context, ino_blk_grp) * context->block_size +
+                                context->inode_size * ino_tbl_idx;
 
-    if (!bit64) {
-        struct ext2_bgd target_descriptor;
-        const uint64_t bgd_offset = bgd_start_offset + (sizeof(struct ext2_bgd) * ino_blk_grp);
+    volume_read(fd->part, ret, ino_offset, sizeof(struct ext2_inode));
 
-        volume_read(fd->part, &target_descriptor, bgd_offset, sizeof(struct ext2_bgd));
+    victim->ino = inode;
+    victim->last_used = ++context->inode_cache_ticks;
+    victim->inode = *ret;
 
-        ino_offset = ((target_descriptor.bg_inode_table) * block_size) +
-                                    (ino_size * ino_tbl_idx);
-    } else {
-        struct ext4_bgd target_descriptor;
-        const uint64_t bgd_offset = bgd_start_offset + (sizeof(struct ext4_bgd) * ino_blk_grp);
+    return true;
+}
 
-        volume_read(fd->part, &target_descriptor, bgd_offset, sizeof(struct ext4_bgd));
+static void block_map_add_run(struct ext2_block_map *map, uint64_t block,
+                              uint64_t start, uint64_t len, bool zero) {
+    if (map->run_count > 0) {
+        struct ext2_run *last = &map->runs[map->run_count - 1];
 
-        ino_offset = ((target_descriptor.bg_inode_table | (bit64 ? ((uint64_t)target_descriptor.inode_id_hi << 32) : 0)) * block_size) +
-                                    (ino_size * ino_tbl_idx);
+        if (last->zero == zero && last->block + last->len == block
+         && (zero || last->start + last->len == start)) {
+            last->len += len;
+            return;
+        }
     }
 
-    volume_read(fd->part, ret, ino_offset, sizeof(struct ext2_inode));
+    if (map->run_count == map->run_max) {
+        size_t new_max = map->run_max == 0 ? 16 : map->run_max * 2;
+        struct ext2_run *new_runs = ext_mem_alloc(new_max * sizeof(struct ext2_run));
 
-    return true;
+        if (map->runs != NULL) {
+            memcpy(new_runs, map->runs, map->run_count * sizeof(struct ext2_run));
+            pmm_free(map->runs, map->run_max * sizeof(struct ext2_run));
+        }
+
+        map->runs = new_runs;
+        map->run_max = new_max;
+    }
+
+    struct ext2_run *run = &map->runs[map->run_count++];
+    run->block = block;
+    run->start = start;
+    run->len = len;
+    run->zero = zero;
 }
 
-static uint32_t *create_alloc_map(struct ext2_file_handle *fd,
-                                  struct ext2_inode *inode) {
-    if (inode->i_flags & EXT4_EXTENTS_FLAG)
-        return NULL;
+// Walk the whole extent tree once and flatten its leaves into runs,
+// merging extents that happen to be physically contiguous.
+static void ext4_flatten_extents(struct ext2_block_map *map, struct ext2_file_handle *fd,
+                                 struct ext4_extent_header *ext_block, int depth_limit) {
+    if (ext_block->magic != EXT4_EXT_MAGIC)
+        panic(false, "invalid extent magic");
 
-    size_t entries_per_block = fd->block_size / sizeof(uint32_t);
+    if (ext_block->depth == 0) {
+        struct ext4_extent *ext = (struct ext4_extent *)((size_t)ext_block + 12);
 
-    // Cache the map of blocks
-    uint32_t *alloc_map = ext_mem_alloc(inode->i_blocks_count * sizeof(uint32_t));
-    for (uint32_t i = 0; i < inode->i_blocks_count; i++) {
-        uint32_t block = i;
-        if (block < 12) {
-            // Direct block
-            alloc_map[i] = inode->i_blocks[block];
-        } else {
-            // Indirect block
-            block -= 12;
-            if (block >= entries_per_block) {
-                // Double indirect block
-                block -= entries_per_block;
-                uint32_t index = block / entries_per_block;
-                uint32_t indirect_block;
-                if (index >= entries_per_block) {
-                    uint32_t first_index = index / entries_per_block;
-                    uint32_t first_indirect_block;
-                    volume_read(
-                        fd->part, &first_indirect_block,
-                        inode->i_blocks[14] * fd->block_size + first_index * sizeof(uint32_t),
-                        sizeof(uint32_t)
-                    );
-                    uint32_t second_index = index % entries_per_block;
-                    volume_read(
-                        fd->part, &indirect_block,
-                        first_indirect_block * fd->block_size + second_index * sizeof(uint32_t),
-                        sizeof(uint32_t)
-                    );
-                } else {
-                    volume_read(
-                        fd->part, &indirect_block,
-                        inode->i_blocks[13] * fd->block_size + index * sizeof(uint32_t),
-                        sizeof(uint32_t)
-                    );
-                }
-                for (uint32_t j = 0; j < entries_per_block; j++) {
-                    if (i + j >= inode->i_blocks_count)
-                        return alloc_map;
-                    volume_read(
-                        fd->part, &alloc_map[i + j],
-                        indirect_block * fd->block_size + j * sizeof(uint32_t),
-                        sizeof(uint32_t)
-                    );
+        for (int i = 0; i < ext_block->entries; i++) {
+            uint64_t len = ext[i].len;
+            bool zero = false;
+
+            if (len > EXT4_EXT_INIT_MAX_LEN) {
+                len -= EXT4_EXT_INIT_MAX_LEN;
+                zero = true;
+            }
+
+            uint64_t start = ((uint64_t)ext[i].start_hi << 32) | ext[i].start;
+            block_map_add_run(map, ext[i].block, start, len, zero);
+        }
+
+        return;
+    }
+
+    if (depth_limit == 0)
+        panic(false, "ext2: extent tree too deep");
+
+    struct ext4_extent_idx *index = (struct ext4_extent_idx *)((size_t)ext_block + 12);
+    void *buf = ext_mem_alloc(fd->block_size);
+
+    for (int i = 0; i < ext_block->entries; i++) {
+        uint64_t block = ((uint64_t)index[i].leaf_hi << 32) | index[i].leaf;
+
+        volume_read(fd->part, buf, block * fd->block_size, fd->block_size);
+        ext4_flatten_extents(map, fd, buf, depth_limit - 1);
+    }
+
+    pmm_free(buf, fd->block_size);
+}
+
+// Add the blocks mapped by an indirect block of the given level, reading
+// each indirect block in one go. Returns false once the end of the file
+// has been reached.
+static bool block_map_add_indirect(struct ext2_block_map *map, struct ext2_file_handle *fd,
+                                   uint32_t *bufs, uint32_t block, int level,
+                                   uint64_t *file_block, uint64_t file_blocks) {
+    uint64_t entries_per_block = fd->block_size / sizeof(uint32_t);
+
+    if (block == 0) {
+        // Sparse, skip everything this block would have mapped
+        uint64_t span = 1;
+        for (int i = 0; i < level; i++)
+            span *= entries_per_block;
+        *file_block += span;
+        return *file_block < file_blocks;
+    }
+
+    uint32_t *entries = bufs + (level - 1) * entries_per_block;
+    volume_read(fd->part, entries, block * fd->block_size, fd->block_size);
+
+    for (uint64_t i = 0; i < entries_per_block; i++) {
+        if (*file_block >= file_blocks)
+            return false;
+
+        if (level == 1) {
+            if (entries[i] != 0)
+                block_map_add_run(map, *file_block, entries[i], 1, false);
+            (*file_block)++;
+        } else if (!block_map_add_indirect(map, fd, bufs, entries[i], level - 1,
+                                           file_block, file_blocks)) {
+            return false;
+        }
+    }
+
+    return *file_block < file_blocks;
+}
+
+static void create_block_map(struct ext2_block_map *map, struct ext2_file_handle *fd,
+                             struct ext2_inode *inode) {
+    memset(map, 0, sizeof(struct ext2_block_map));
+
+    if (inode->i_flags & EXT4_EXTENTS_FLAG) {
+        ext4_flatten_extents(map, fd, (struct ext4_extent_header *)inode->i_blocks,
+                             EXT4_EXT_MAX_DEPTH);
+        return;
+    }
+
+    uint64_t file_blocks = DIV_ROUNDUP((uint64_t)inode->i_size, fd->block_size);
+    uint64_t file_block = 0;
+
+    for (; file_block < 12 && file_block < file_blocks; file_block++) {
+        if (inode->i_blocks[file_block] != 0)
+            block_map_add_run(map, file_block, inode->i_blocks[file_block], 1, false);
+    }
+
+    if (file_block >= file_blocks)
+        return;
+
+    // One buffer per level of indirection
+    uint32_t *bufs = ext_mem_alloc(3 * fd->block_size);
+
+    for (int level = 1; level <= 3; level++) {
+        if (!block_map_add_indirect(map, fd, bufs, inode->i_blocks[11 + level], level,
+                                    &file_block, file_blocks))
+            break;
+    }
+
+    pmm_free(bufs, 3 * fd->block_size);
+}
+
+static void free_block_map(struct ext2_block_map *map) {
+    if (map->runs != NULL) {
+        pmm_free(map->runs, map->run_max * sizeof(struct ext2_run));
+    }
+    memset(map, 0, sizeof(struct ext2_block_map));
+}
+
+static void ext2_htree_tea(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += 0x9e3779b9;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+    }
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+#define HMD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define HMD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define HMD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define HMD4_ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+#define HMD4_K2 013240474631U
+#define HMD4_K3 015666365641U
+
+static void ext2_htree_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    HMD4_ROUND(HMD4_F, a, b, c, d, in[0],  3);
+    HMD4_ROUND(HMD4_F, d, a, b, c, in[1],  7);
+    HMD4_ROUND(HMD4_F, c, d, a, b, in[2], 11);
+    HMD4_ROUND(HMD4_F, b, c, d, a, in[3], 19);
+    HMD4_ROUND(HMD4_F, a, b, c, d, in[4],  3);
+    HMD4_ROUND(HMD4_F, d, a, b, c, in[5],  7);
+    HMD4_ROUND(HMD4_F, c, d, a, b, in[6], 11);
+    HMD4_ROUND(HMD4_F, b, c, d, a, in[7], 19);
+
+    HMD4_ROUND(HMD4_G, a, b, c, d, in[1] + HMD4_K2,  3);
+    HMD4_ROUND(HMD4_G, d, a, b, c, in[3] + HMD4_K2,  5);
+    HMD4_ROUND(HMD4_G, c, d, a, b, in[5] + HMD4_K2,  9);
+    HMD4_ROUND(HMD4_G, b, c, d, a, in[7] + HMD4_K2, 13);
+    HMD4_ROUND(HMD4_G, a, b, c, d, in[0] + HMD4_K2,  3);
+    HMD4_ROUND(HMD4_G, d, a, b, c, in[2] + HMD4_K2,  5);
+    HMD4_ROUND(HMD4_G, c, d, a, b, in[4] + HMD4_K2,  9);
+    HMD4_ROUND(HMD4_G, b, c, d, a, in[6] + HMD4_K2, 13);
+
+    HMD4_ROUND(HMD4_H, a, b, c, d, in[3] + HMD4_K3,  3);
+    HMD4_ROUND(HMD4_H, d, a, b, c, in[7] + HMD4_K3,  9);
+    HMD4_ROUND(HMD4_H, c, d, a, b, in[2] + HMD4_K3, 11);
+    HMD4_ROUND(HMD4_H, b, c, d, a, in[6] + HMD4_K3, 15);
+    HMD4_ROUND(HMD4_H, a, b, c, d, in[1] + HMD4_K3,  3);
+    HMD4_ROUND(HMD4_H, d, a, b, c, in[5] + HMD4_K3,  9);
+    HMD4_ROUND(HMD4_H, c, d, a, b, in[0] + HMD4_K3, 11);
+    HMD4_ROUND(HMD4_H, b, c, d, a, in[4] + HMD4_K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// Pack a name into hash input words the way the kernel does, the signed
+// variants sign extend every character.
+static void ext2_htree_str2hashbuf(const char *msg, int len, uint32_t *buf, int num, bool is_unsigned) {
+    uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4)
+        len = num * 4;
+
+    for (int i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(uint8_t)msg[i] : (int)(int8_t)msg[i];
+        val = (uint32_t)c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+static uint32_t ext2_htree_legacy(const char *name, int len, bool is_unsigned) {
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+    for (int i = 0; i < len; i++) {
+        int c = is_unsigned ? (int)(uint8_t)name[i] : (int)(int8_t)name[i];
+        hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+
+    return hash0 << 1;
+}
+
+static uint32_t ext2_htree_hash(const char *name, int len, int version, const uint32_t seed[4]) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    uint32_t hash;
+
+    if (seed[0] != 0 || seed[1] != 0 || seed[2] != 0 || seed[3] != 0) {
+        memcpy(buf, seed, sizeof(buf));
+    }
+
+    bool is_unsigned = version >= DX_HASH_LEGACY_UNSIGNED;
+
+    switch (version) {
+        case DX_HASH_LEGACY:
+        case DX_HASH_LEGACY_UNSIGNED:
+            hash = ext2_htree_legacy(name, len, is_unsigned);
+            break;
+        case DX_HASH_HALF_MD4:
+        case DX_HASH_HALF_MD4_UNSIGNED:
+            for (const char *p = name; len > 0; len -= 32, p += 32) {
+                ext2_htree_str2hashbuf(p, len, in, 8, is_unsigned);
+                ext2_htree_half_md4(buf, in);
+            }
+            hash = buf[1];
+            break;
+        default:
+            for (const char *p = name; len > 0; len -= 16, p += 16) {
+                ext2_htree_str2hashbuf(p, len, in, 4, is_unsigned);
+                ext2_htree_tea(buf, in);
+            }
+            hash = buf[0];
+            break;
+    }
+
+    hash &= ~1;
+    if (hash == (EXT2_HTREE_EOF << 1))
+        hash = (EXT2_HTREE_EOF - 1) << 1;
+
+    return hash;
+}
+
+// Look for name in one directory block
+// Names are unique within a directory, so while matching exactly every other
+// entry read here is also the answer to a later lookup of that name and goes
+// into the dentry cache, up to *prefill of them.
+static bool ext2_dir_block_find(struct ext2_file_handle *fd, uint64_t dir_ino, uint8_t *block,
+                                const char *name, size_t name_len,
+                                struct ext2_dir_entry *dir, size_t *prefill) {
+    uint64_t block_size = fd->block_size;
+    bool found = false;
+
+    for (uint64_t off = 0; off + sizeof(struct ext2_dir_entry) <= block_size; ) {
+        struct ext2_dir_entry *entry = (struct ext2_dir_entry *)(block + off);
+
+        if (entry->rec_len < sizeof(struct ext2_dir_entry) || off + entry->rec_len > block_size)
+            return found;
+
+        if (entry->inode != 0
+         && off + sizeof(struct ext2_dir_entry) + entry->name_len <= block_size) {
+            const char *entry_name = (const char *)(entry + 1);
+
+            if (!found && entry->name_len == name_len) {
+                int test = case_insensitive_fopen ? strncasecmp(entry_name, name, name_len)
+                                                  : memcmp(entry_name, name, name_len);
+
+                if (test == 0) {
+                    *dir = *entry;
+                    found = true;
                 }
-                i += entries_per_block - 1;
-            } else {
-                // Single indirect block
-                volume_read(
-                    fd->part, &alloc_map[i],
-                    inode->i_blocks[12] * fd->block_size + block * sizeof(uint32_t),
-                    sizeof(uint32_t)
-                );
+            }
+
+            if (!case_insensitive_fopen && *prefill > 0) {
+                dentry_insert(fd->part, dir_ino, entry_name, entry->name_len,
+                              entry, sizeof(struct ext2_dir_entry));
+                (*prefill)--;
             }
         }
+
+        if (found && (case_insensitive_fopen || *prefill == 0))
+            break;
+
+        off += entry->rec_len;
     }
 
-    return alloc_map;
+    return found;
 }
 
-static bool symlink_to_inode(struct ext2_inode *inode, struct ext2_file_handle *fd,
+static bool ext2_dir_linear_find(struct ext2_file_handle *fd, uint64_t dir_ino,
+                                 struct ext2_inode *inode,
+                                 struct ext2_block_map *map, uint8_t *buf,
+                                 const char *name, size_t name_len,
+                                 struct ext2_dir_entry *dir, size_t *prefill) {
+    for (uint64_t off = 0; off < inode->i_size; off += fd->block_size) {
+        inode_read(buf, off, fd->block_size, fd, map);
+
+        if (ext2_dir_block_find(fd, dir_ino, buf, name, name_len, dir, prefill))
+            return true;
+    }
+
+    return false;
+}
+
+struct ext2_dx_frame {
+    struct ext2_dx_entry *entries;
+    size_t count;
+    size_t at;
+};
+
+static bool ext2_dx_load(struct ext2_dx_frame *frame, uint8_t *block, size_t offset,
+                         uint64_t block_size) {
+    struct ext2_dx_countlimit *cl = (struct ext2_dx_countlimit *)(block + offset);
+
+    if (cl->count == 0 || cl->count > cl->limit
+     || offset + cl->limit * sizeof(struct ext2_dx_entry) > block_size)
+        return false;
+
+    frame->entries = (struct ext2_dx_entry *)(block + offset);
+    frame->count = cl->count;
+    frame->at = 0;
+
+    return true;
+}
+
+// Last entry whose hash is not above the one looked for, the first entry
+// covers everything below the second one.
+static void ext2_dx_search(struct ext2_dx_frame *frame, uint32_t hash) {
+    size_t lo = 1, hi = frame->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (frame->entries[mid].hash > hash) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    frame->at = lo - 1;
+}
+
+// Returns false if the index cannot be used and the directory has to be
+// scanned linearly instead, else *found tells whether the name exists.
+static bool ext2_dir_htree_find(struct ext2_file_handle *fd, uint64_t dir_ino,
+                                struct ext2_block_map *map,
+                                uint8_t *buf, const char *name, size_t name_len,
+                                struct ext2_dir_entry *dir, size_t *prefill, bool *found) {
+    struct ext2_superblock *sb = &fd->context->sb;
+
+    *found = false;
+
+    inode_read(buf, 0, fd->block_size, fd, map);
+
+    struct ext2_dx_root_info *info = (struct ext2_dx_root_info *)(buf + EXT2_DX_ROOT_INFO_OFFSET);
+    if (info->reserved_zero != 0 || info->info_length < sizeof(struct ext2_dx_root_info)
+     || info->indirect_levels >= EXT2_HTREE_MAX_LEVELS)
+        return false;
+
+    int version = info->hash_version;
+    if (version <= DX_HASH_TEA && (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH))
+        version += DX_HASH_LEGACY_UNSIGNED;
+    if (version > DX_HASH_TEA_UNSIGNED)
+        return false;
+
+    uint32_t seed[4];
+    memcpy(seed, sb->hash_seed, sizeof(seed));
+    uint32_t hash = ext2_htree_hash(name, name_len, version, seed);
+
+    size_t levels = info->indirect_levels + 1;
+    size_t entries_offset = EXT2_DX_ROOT_INFO_OFFSET + info->info_length;
+
+    struct ext2_dx_frame frames[EXT2_HTREE_MAX_LEVELS];
+    uint8_t *nodes = ext_mem_alloc(levels * fd->block_size);
+    memcpy(nodes, buf, fd->block_size);
+
+    bool ret = false;
+
+    // Walk down to the leaf that should hold the name
+    for (size_t l = 0; l < levels; l++) {
+        uint8_t *node = nodes + l * fd->block_size;
+
+        if (l > 0) {
+            uint32_t block = frames[l - 1].entries[frames[l - 1].at].block & EXT2_DX_BLOCK_MASK;
+            inode_read(node, block * fd->block_size, fd->block_size, fd, map);
+        }
+
+        if (!ext2_dx_load(&frames[l], node, l == 0 ? entries_offset : EXT2_DX_NODE_OFFSET,
+                          fd->block_size))
+            goto out;
+
+        ext2_dx_search(&frames[l], hash);
+    }
+
+    for (;;) {
+        struct ext2_dx_frame *leaf = &frames[levels - 1];
+        uint32_t block = leaf->entries[leaf->at].block & EXT2_DX_BLOCK_MASK;
+
+        inode_read(buf, block * fd->block_size, fd->block_size, fd, map);
+
+        if (ext2_dir_block_find(fd, dir_ino, buf, name, name_len, dir, prefill)) {
+            *found = true;
+            break;
+        }
+
+        // Names sharing a hash may spill over into the next leaf, in which
+        // case the next index entry has its low bit set.
+        size_t l = levels;
+        while (l > 0 && ++frames[l - 1].at >= frames[l - 1].count)
+            l--;
+        if (l == 0)
+            break;
+        if ((frames[l - 1].entries[frames[l - 1].at].hash & ~1) != hash)
+            break;
+
+        for (; l < levels; l++) {
+            uint8_t *node = nodes + l * fd->block_size;
+            uint32_t next = frames[l - 1].entries[frames[l - 1].at].block & EXT2_DX_BLOCK_MASK;
+
+            inode_read(node, next * fd->block_size, fd->block_size, fd, map);
+
+            if (!ext2_dx_load(&frames[l], node, EXT2_DX_NODE_OFFSET, fd->block_size))
+                goto out;
+        }
+    }
+
+    ret = true;
+
+out:
+    pmm_free(nodes, levels * fd->block_size);
+    return ret;
+}
+
+// Looks name up in the directory with inode number dir_ino. Answers come from
+// the volume's dentry cache when possible, the directory's block map is only
+// built when it actually has to be read.
+static bool ext2_dir_lookup(struct ext2_file_handle *fd, uint64_t dir_ino,
+                            struct ext2_inode *inode, const char *name,
+                            struct ext2_dir_entry *dir) {
+    size_t name_len = strlen(name);
+    bool found = false;
+
+    if (dentry_lookup(fd->part, dir_ino, name, name_len, dir, sizeof(struct ext2_dir_entry), &found))
+        return found;
+
+    struct ext2_block_map map;
+    create_block_map(&map, fd, inode);
+
+    uint8_t *buf = ext_mem_alloc(fd->block_size);
+    size_t prefill = DENTRY_PREFILL_MAX;
+
+    // Hashes are computed over the exact name, so case insensitive lookups
+    // cannot use the index.
+    bool indexed = !case_insensitive_fopen
+                && fd->context->sb.s_rev_level != 0
+                && (fd->context->sb.s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+                && (inode->i_flags & EXT2_INDEX_FL)
+                && ext2_dir_htree_find(fd, dir_ino, &map, buf, name, name_len, dir, &prefill, &found);
+
+    if (!indexed) {
+        found = ext2_dir_linear_find(fd, dir_ino, inode, &map, buf, name, name_len, dir, &prefill);
+    }
+
+    pmm_free(buf, fd->block_size);
+    free_block_map(&map);
+
+    dentry_insert(fd->part, dir_ino, name, name_len, found ? dir : NULL, sizeof(struct ext2_dir_entry));
+    return found;
+}
+
+static bool symlink_to_inode(struct ext2_inode *inode, uint64_t *ino,
+                             struct ext2_file_handle *fd,
                              const char *cwd, size_t cwd_len) {
     // I cannot find whether this is 0-terminated or not, so I'm gonna take the
     // safe route here and assume it is not.
@@ -361,6 +926,7 @@ static bool symlink_to_inode(struct ext2_inode *inode, struct ext2_file_handle *
         }
         pmm_free(abs, 4096);
 
+        *ino = dir.inode;
         ext2_get_inode(inode, fd, dir.inode);
         return true;
     } else {
@@ -376,13 +942,12 @@ static bool ext2_parse_dirent(struct ext2_dir_entry *dir, struct ext2_file_handl
 
     path++;
 
-    struct ext2_inode current_inode = fd->root_inode;
+    struct ext2_inode current_inode = fd->context->root_inode;
+    uint64_t current_ino = EXT2_ROOT_INO;
 
     bool escape = false;
     static char token[256];
 
-    bool ret;
-
     const char *cwd = path - 1; // because /
     size_t cwd_len = 1;
     size_t next_cwd_len = cwd_len;
@@ -398,84 +963,57 @@ next:
     else
         path++, next_cwd_len++;
 
-    uint32_t *alloc_map = create_alloc_map(fd, &current_inode);
-
-    for (uint32_t i = 0; i < current_inode.i_size; ) {
-        // preliminary read
-        inode_read(dir, i, sizeof(struct ext2_dir_entry),
-                   &current_inode, fd, alloc_map);
-
-        // name read
-        char *name = ext_mem_alloc(dir->name_len + 1);
-
-        memset(name, 0, dir->name_len + 1);
-        inode_read(name, i + sizeof(struct ext2_dir_entry), dir->name_len,
-                   &current_inode, fd, alloc_map);
-
-        int (*strcmpfn)(const char *, const char *) = case_insensitive_fopen ? strcasecmp : strcmp;
-
-        int test = strcmpfn(token, name);
-        pmm_free(name, dir->name_len + 1);
-
-        if (test == 0) {
-            if (escape) {
-                ret = true;
-                goto out;
-            } else {
-                // update the current inode
-                ext2_get_inode(&current_inode, fd, dir->inode);
-                while ((current_inode.i_mode & FMT_MASK) != S_IFDIR) {
-                    if ((current_inode.i_mode & FMT_MASK) == S_IFLNK) {
-                        if (!symlink_to_inode(&current_inode, fd, cwd, cwd_len)) {
-                            ret = false;
-                            goto out;
-                        }
-                    } else {
-                        print("ext2: Part of path is not directory nor symlink\n");
-                        ret = false;
-                        goto out;
+    if (ext2_dir_lookup(fd, current_ino, &current_inode, token, dir)) {
+        if (escape) {
+            return true;
+        } else {
+            // update the current inode
+            current_ino = dir->inode;
+            ext2_get_inode(&current_inode, fd, dir->inode);
+            while ((current_inode.i_mode & FMT_MASK) != S_IFDIR) {
+                if ((current_inode.i_mode & FMT_MASK) == S_IFLNK) {
+                    if (!symlink_to_inode(&current_inode, &current_ino, fd, cwd, cwd_len)) {
+                        return false;
                     }
+                } else {
+                    print("ext2: Part of path is not directory nor symlink\n");
+                    return false;
                 }
-                pmm_free(alloc_map, current_inode.i_blocks_count * sizeof(uint32_t));
-                cwd_len = next_cwd_len;
-                goto next;
             }
+            cwd_len = next_cwd_len;
+            goto next;
         }
-
-        i += dir->rec_len;
     }
 
-    ret = false;
-
-out:
-    pmm_free(alloc_map, current_inode.i_blocks_count * sizeof(uint32_t));
-    return ret;
+    return false;
 }
 
 static void ext2_read(struct file_handle *handle, void *buf, uint64_t loc, uint64_t count);
+static void ext2_read_queued(struct file_handle *handle, struct volume_read_queue *queue,
+                             void *buf, uint64_t loc, uint64_t count);
 static void ext2_close(struct file_handle *file);
 
-struct file_handle *ext2_open(struct volume *part, const char *path) {
-    struct ext2_file_handle *ret = ext_mem_alloc(sizeof(struct ext2_file_handle));
+struct ext2_context *ext2_mount(struct volume *part) {
+    struct ext2_superblock sb_probe;
+    volume_read(part, &sb_probe, 1024, sizeof(struct ext2_superblock));
 
-    ret->part = part;
+    if (sb_probe.s_magic != EXT2_S_MAGIC) {
+        return NULL;
+    }
 
-    volume_read(ret->part, &ret->sb, 1024, sizeof(struct ext2_superblock));
+    struct ext2_context *context = ext_mem_alloc(sizeof(struct ext2_context));
 
-    struct ext2_superblock *sb = &ret->sb;
+    context->part = part;
+    context->sb = sb_probe;
 
-    if (sb->s_magic != EXT2_S_MAGIC) {
-        pmm_free(ret, sizeof(struct ext2_file_handle));
-        return NULL;
-    }
+    struct ext2_superblock *sb = &context->sb;
 
     if (sb->s_rev_level != 0 &&
         (sb->s_feature_incompat & EXT2_IF_COMPRESSION ||
          sb->s_feature_incompat & EXT2_IF_INLINE_DATA ||
          sb->s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG)) {
         print("ext2: filesystem has unsupported features %x\n", sb->s_feature_incompat);
-        pmm_free(ret, sizeof(struct ext2_file_handle));
-        return NULL;
+        return context;
     }
 
     if (sb->s_rev_level != 0 && sb->s_feature_incompat & EXT2_IF_ENCRYPT) {
@@ -484,13 +1022,84 @@ struct file_handle *ext2_open(struct volume *part, const char *path) {
 
     if (sb->s_state == EXT2_FS_UNRECOVERABLE_ERRORS) {
         print("ext2: unrecoverable errors found\n");
-        pmm_free(ret, sizeof(struct ext2_file_handle));
+        return context;
+    }
+
+    if (sb->s_inodes_per_group == 0) {
+        return context;
+    }
+
+    context->block_size = ((uint64_t)1024 << sb->s_log_block_size);
+    context->inode_size = sb->s_rev_level == 0 ? sizeof(struct ext2_inode) : sb->s_inode_size;
+
+    //determine if we need to use 64 bit inode ids
+    context->desc_size = sizeof(struct ext2_bgd);
+    if (sb->s_rev_level != 0
+        && (sb->s_feature_incompat & (EXT2_IF_64BIT))
+        && sb->group_desc_size != 0
+        && ((sb->group_desc_size & (sb->group_desc_size - 1)) == 0)) {
+                if(sb->group_desc_size > 32) {
+                    context->bit64 = true;
+                    context->desc_size = sb->group_desc_size;
+                }
+            }
+
+    context->group_count = DIV_ROUNDUP((uint64_t)sb->s_inodes_count, sb->s_inodes_per_group);
+
+    context->supported = true;
+
+    return context;
+}
+
+bool ext2_is_supported(struct ext2_context *context) {
+    return context->supported;
+}
+
+void ext2_unmount(struct ext2_context *context) {
+    if (context->gdt != NULL) {
+        pmm_free(context->gdt, context->gdt_size);
+    }
+    pmm_free(context, sizeof(struct ext2_context));
+}
+
+// The group descriptor table and root inode are only needed to open files,
+// so they are not read until the first ext2_open().
+static bool ext2_load(struct ext2_context *context) {
+    if (context->loaded) {
+        return context->supported;
+    }
+
+    context->loaded = true;
+
+    // The table starts in the block following the superblock, it is never
+    // split up since meta_bg is not supported
+    const uint64_t bgd_start_offset = context->block_size >= 2048 ? context->block_size : context->block_size * 2;
+
+    context->gdt_size = context->group_count * context->desc_size;
+    context->gdt = ext_mem_alloc(context->gdt_size);
+
+    volume_read(context->part, context->gdt, bgd_start_offset, context->gdt_size);
+
+    struct ext2_file_handle fd = { .part = context->part, .context = context, .block_size = context->block_size };
+    if (!ext2_get_inode(&context->root_inode, &fd, EXT2_ROOT_INO)) {
+        context->supported = false;
+    }
+
+    return context->supported;
+}
+
+struct file_handle *ext2_open(struct ext2_context *context, const char *path) {
+    struct volume *part = context->part;
+
+    if (!ext2_load(context)) {
         return NULL;
     }
 
-    ret->block_size = ((uint64_t)1024 << ret->sb.s_log_block_size);
+    struct ext2_file_handle *ret = ext_mem_alloc(sizeof(struct ext2_file_handle));
 
-    ext2_get_inode(&ret->root_inode, ret, 2);
+    ret->part = part;
+    ret->context = context;
+    ret->block_size = context->block_size;
 
     struct ext2_dir_entry entry;
 
@@ -510,11 +1119,12 @@ struct file_handle *ext2_open(struct volume *part, const char *path) {
         return NULL;
     }
 
-    ext2_get_inode(&ret->inode, ret, entry.inode);
+    uint64_t ino = entry.inode;
+    ext2_get_inode(&ret->inode, ret, ino);
 
     while ((ret->inode.i_mode & FMT_MASK) != S_IFREG) {
         if ((ret->inode.i_mode & FMT_MASK) == S_IFLNK) {
-            if (!symlink_to_inode(&ret->inode, ret, cwd, cwd_len)) {
+            if (!symlink_to_inode(&ret->inode, &ino, ret, cwd, cwd_len)) {
                 pmm_free(cwd, 4096);
                 pmm_free(ret, sizeof(struct ext2_file_handle));
                 return NULL;
@@ -531,155 +1141,127 @@ struct file_handle *ext2_open(struct volume *part, const char *path) {
 
     ret->size = ret->inode.i_size;
 
-    ret->alloc_map = create_alloc_map(ret, &ret->inode);
+    create_block_map(&ret->map, ret, &ret->inode);
 
     struct file_handle *handle = ext_mem_alloc(sizeof(struct file_handle));
 
     handle->fd = ret;
     handle->read = (void *)ext2_read;
+    handle->read_queued = (void *)ext2_read_queued;
     handle->close = (void *)ext2_close;
     handle->size = ret->size;
     handle->vol = part;
-#if defined (UEFI)
-    handle->efi_part_handle = part->efi_part_handle;
-#endif
 
     return handle;
 }
 
 static void ext2_close(struct file_handle *file) {
     struct ext2_file_handle *f = file->fd;
-    if (f->alloc_map != NULL) {
-        pmm_free(f->alloc_map, f->inode.i_blocks_count * sizeof(uint32_t));
-    }
+    free_block_map(&f->map);
     pmm_free(f, sizeof(struct ext2_file_handle));
 }
 
 static void ext2_read(struct file_handle *file, void *buf, uint64_t loc, uint64_t count) {
     struct ext2_file_handle *f = file->fd;
-    inode_read(buf, loc, count, &f->inode, f, f->alloc_map);
+    inode_read(buf, loc, count, f, &f->map);
 }
 
-static struct ext4_extent_header *ext4_find_leaf(struct ext4_extent_header *ext_block, uint32_t read_block, uint64_t block_size, struct volume *part) {
-    struct ext4_extent_idx *index;
-
-    void *buf = ext_mem_alloc(block_size);
-    memcpy(buf, ext_block, block_size);
-    ext_block = buf;
-
-    for (;;) {
-        index = (struct ext4_extent_idx *)((size_t)ext_block + 12);
+static void ext2_read_queued(struct file_handle *file, struct volume_read_queue *queue,
+                             void *buf, uint64_t loc, uint64_t count) {
+    struct ext2_file_handle *f = file->fd;
+    inode_read_queued(queue, buf, loc, count, f, &f->map);
+}
 
-        #define EXT4_EXT_MAGIC 0xf30a
-        if (ext_block->magic != EXT4_EXT_MAGIC)
-            panic(false, "invalid extent magic");
+// Number of runs starting at or before block, the last of them is the only
+// one that can contain it
+static size_t block_map_find_run(struct ext2_block_map *map, uint64_t block) {
+    size_t lo = 0, hi = map->run_count;
 
-        if (ext_block->depth == 0) {
-            return ext_block;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (map->runs[mid].block <= block) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
+    }
 
-        int i;
-        for (i = 0; i < ext_block->entries; i++) {
-            if (read_block < index[i].block)
-                break;
-        }
+    return lo;
+}
 
-        if (--i < 0)
-            panic(false, "extent not found");
+static int inode_read(void *buf, uint64_t loc, uint64_t count,
+                      struct ext2_file_handle *fd, struct ext2_block_map *map) {
+    // Keep the reads of consecutive runs in flight together
+    struct volume_read_queue queue;
+    volume_queue_init(&queue);
 
-        uint64_t block = ((uint64_t)index[i].leaf_hi << 32) | index[i].leaf;
+    inode_read_queued(&queue, buf, loc, count, fd, map);
 
-        volume_read(part, buf, (block * block_size), block_size);
-        ext_block = buf;
-    }
+    volume_queue_wait(&queue);
+
+    return 0;
 }
 
-static int inode_read(void *buf, uint64_t loc, uint64_t count,
-                      struct ext2_inode *inode, struct ext2_file_handle *fd,
-                      uint32_t *alloc_map) {
+static void inode_read_queued(struct volume_read_queue *queue, void *buf, uint64_t loc, uint64_t count,
+                              struct ext2_file_handle *fd, struct ext2_block_map *map) {
     for (uint64_t progress = 0; progress < count;) {
         uint64_t block = (loc + progress) / fd->block_size;
 
         uint64_t chunk = count - progress;
         uint64_t offset = (loc + progress) % fd->block_size;
-        if (chunk > fd->block_size - offset)
-            chunk = fd->block_size - offset;
-
-        uint32_t block_index;
 
-        if (inode->i_flags & EXT4_EXTENTS_FLAG) {
-            struct ext4_extent_header *leaf;
-            struct ext4_extent *ext;
-            int i;
+        // Read as much of the containing run as the request covers in one go
+        size_t i = block_map_find_run(map, block);
 
-            leaf = ext4_find_leaf((struct ext4_extent_header *)inode->i_blocks, block, fd->block_size, fd->part);
+        if (i > 0 && block < map->runs[i - 1].block + map->runs[i - 1].len) {
+            struct ext2_run *run = &map->runs[i - 1];
 
-            if (!leaf)
-                panic(false, "invalid extent");
-            ext = (struct ext4_extent*)((size_t)leaf + 12);
+            uint64_t avail = (run->block + run->len - block) * fd->block_size - offset;
+            if (chunk > avail)
+                chunk = avail;
 
-            for (i = 0; i < leaf->entries; i++) {
-                if (block < ext[i].block) {
-                    break;
-                }
-            }
-
-            if (--i >= 0) {
-                block -= ext[i].block;
-                if (block >= ext[i].len) {
-                    panic(false, "block longer than extent");
-                } else {
-                    uint64_t start = ((uint64_t)ext[i].start_hi << 32) + ext[i].start;
-                    block_index = start + block;
-                }
+            if (run->zero) {
+                memset(buf + progress, 0, chunk);
             } else {
-                panic(false, "extent for block not found");
+                volume_queue_read(queue, fd->part, buf + progress,
+                                  (run->start + (block - run->block)) * fd->block_size + offset,
+                                  chunk);
             }
-
-            pmm_free(leaf, fd->block_size);
         } else {
-            block_index = alloc_map[block];
-        }
+            // Sparse hole, up to the next run
+            if (i < map->run_count) {
+                uint64_t avail = (map->runs[i].block - block) * fd->block_size - offset;
+                if (chunk > avail)
+                    chunk = avail;
+            }
 
-        volume_read(fd->part, buf + progress, (block_index * fd->block_size) + offset, chunk);
+            memset(buf + progress, 0, chunk);
+        }
 
         progress += chunk;
     }
-
-    return 0;
 }
 
-bool ext2_get_guid(struct guid *guid, struct volume *part) {
-    struct ext2_superblock sb;
-    volume_read(part, &sb, 1024, sizeof(struct ext2_superblock));
-
-    if (sb.s_magic != EXT2_S_MAGIC)
-        return false;
-
-    ((uint64_t *)guid)[0] = sb.s_uuid[0];
-    ((uint64_t *)guid)[1] = sb.s_uuid[1];
+bool ext2_get_guid(struct guid *guid, struct ext2_context *context) {
+    ((uint64_t *)guid)[0] = context->sb.s_uuid[0];
+    ((uint64_t *)guid)[1] = context->sb.s_uuid[1];
 
     return true;
 }
 
-char *ext2_get_label(struct volume *part) {
-    struct ext2_superblock sb;
-    volume_read(part, &sb, 1024, sizeof(struct ext2_superblock));
-
-    if (sb.s_magic != EXT2_S_MAGIC) {
-        return NULL;
-    }
+char *ext2_get_label(struct ext2_context *context) {
+    struct ext2_superblock *sb = &context->sb;
 
-    if (sb.s_rev_level < 1) {
+    if (sb->s_rev_level < 1) {
         return NULL;
     }
 
-    size_t label_len = strlen((char *)sb.s_volume_name);
+    size_t label_len = strnlen((char *)sb->s_volume_name, sizeof(sb->s_volume_name));
     if (label_len == 0) {
         return NULL;
     }
     char *ret = ext_mem_alloc(label_len + 1);
-    strcpy(ret, (char *)sb.s_volume_name);
+    memcpy(ret, sb->s_volume_name, label_len);
 
     return ret;
 }
@@ -4,8 +4,12 @@
 #include <lib/part.h>
 #include <fs/file.h>
 
-char *fat32_get_label(struct volume *part);
+struct fat32_context;
 
-struct file_handle *fat32_open(struct volume *part, const char *path);
+struct fat32_context *fat32_mount(struct volume *part);
+
+char *fat32_get_label(struct fat32_context *context);
+
+struct file_handle *fat32_open(struct fat32_context *context, const char *path);
 
 #endif
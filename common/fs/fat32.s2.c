@@ -1,4 +1,5 @@
 #include <fs/fat32.h>
+#include <fs/file.h>
 #include <lib/misc.h>
 #include <drivers/disk.h>
 #include <lib/libc.h>
@@ -13,6 +14,16 @@
 #define FAT32_LFN_ATTRIBUTE 0x0F
 #define FAT32_ATTRIBUTE_VOLLABEL 0x08
 
+#define FAT32_FAT_WINDOW_SIZE 0x10000
+
+// A window over the file allocation table, refilled with one large read
+// whenever a lookup falls outside of it.
+struct fat32_fat_window {
+    uint8_t *buf;
+    uint64_t start;
+    size_t len;
+};
+
 struct fat32_context {
     struct volume *part;
     int type;
@@ -29,15 +40,29 @@ struct fat32_context {
     uint16_t root_entries;
     uint32_t root_start;
     uint32_t root_size;
+    struct fat32_fat_window fat_window;
+};
+
+// A run of consecutive clusters of a file that are also consecutive on disk
+struct fat32_run {
+    uint32_t index;
+    uint32_t start;
+    uint32_t count;
+};
+
+struct fat32_chain {
+    struct fat32_run *runs;
+    size_t run_count;
+    size_t run_max;
+    size_t cluster_count;
 };
 
 struct fat32_file_handle {
-    struct fat32_context context;
+    struct fat32_context *context;
     uint32_t first_cluster;
     uint32_t size_bytes;
     uint32_t size_clusters;
-    uint32_t *cluster_chain;
-    size_t chain_len;
+    struct fat32_chain chain;
 };
 
 struct fat32_bpb {
@@ -214,12 +239,46 @@ bytes_per_sector_valid:;
     return 0;
 }
 
-static int read_cluster_from_map(struct fat32_context *context, uint32_t cluster, uint32_t *out) {
+static void *fat_window_get(struct fat32_context *context, struct fat32_fat_window *window,
+                            uint64_t offset, size_t size) {
+    if (window->buf != NULL && offset >= window->start
+     && offset + size <= window->start + window->len) {
+        return window->buf + (offset - window->start);
+    }
+
+    uint64_t fat_size = (uint64_t)context->sectors_per_fat * context->bytes_per_sector;
+    if (offset + size > fat_size) {
+        return NULL;
+    }
+
+    if (window->buf == NULL) {
+        window->buf = ext_mem_alloc(FAT32_FAT_WINDOW_SIZE);
+    }
+
+    window->start = ALIGN_DOWN(offset, context->bytes_per_sector);
+    window->len = FAT32_FAT_WINDOW_SIZE;
+    if (window->len > fat_size - window->start) {
+        window->len = fat_size - window->start;
+    }
+
+    volume_read(context->part, window->buf,
+                (uint64_t)context->fat_start_lba * context->bytes_per_sector + window->start,
+                window->len);
+
+    return window->buf + (offset - window->start);
+}
+
+static int read_cluster_from_map(struct fat32_context *context, struct fat32_fat_window *window,
+                                 uint32_t cluster, uint32_t *out) {
+    uint8_t *entry;
+
     switch (context->type) {
         case 12: {
-            *out = 0;
-            uint16_t tmp = 0;
-            volume_read(context->part, &tmp, context->fat_start_lba * context->bytes_per_sector + (cluster + cluster / 2), sizeof(uint16_t));
+            // Entries are 12 bits wide, two of them share 3 bytes
+            entry = fat_window_get(context, window, cluster + cluster / 2, sizeof(uint16_t));
+            if (entry == NULL)
+                return -1;
+            uint16_t tmp = entry[0] | ((uint16_t)entry[1] << 8);
             if (cluster % 2 == 0) {
                 *out = tmp & 0xfff;
             } else {
@@ -228,12 +287,17 @@ static int read_cluster_from_map(struct fat32_context *context, uint32_t cluster
             break;
         }
         case 16:
-            *out = 0;
-            volume_read(context->part, out, context->fat_start_lba * context->bytes_per_sector + cluster * sizeof(uint16_t), sizeof(uint16_t));
+            entry = fat_window_get(context, window, (uint64_t)cluster * sizeof(uint16_t), sizeof(uint16_t));
+            if (entry == NULL)
+                return -1;
+            *out = entry[0] | ((uint32_t)entry[1] << 8);
             break;
         case 32:
-            volume_read(context->part, out, context->fat_start_lba * context->bytes_per_sector + cluster * sizeof(uint32_t), sizeof(uint32_t));
-            *out &= 0x0fffffff;
+            entry = fat_window_get(context, window, (uint64_t)cluster * sizeof(uint32_t), sizeof(uint32_t));
+            if (entry == NULL)
+                return -1;
+            *out = (entry[0] | ((uint32_t)entry[1] << 8) | ((uint32_t)entry[2] << 16)
+                 | ((uint32_t)entry[3] << 24)) & 0x0fffffff;
             break;
         default:
             __builtin_unreachable();
@@ -242,45 +306,117 @@ static int read_cluster_from_map(struct fat32_context *context, uint32_t cluster
     return 0;
 }
 
-static uint32_t *cache_cluster_chain(struct fat32_context *context,
-                                     uint32_t initial_cluster,
-                                     size_t *_chain_length) {
+static void chain_add_cluster(struct fat32_chain *chain, uint32_t cluster) {
+    if (chain->run_count > 0) {
+        struct fat32_run *last = &chain->runs[chain->run_count - 1];
+
+        if (last->start + last->count == cluster) {
+            last->count++;
+            chain->cluster_count++;
+            return;
+        }
+    }
+
+    if (chain->run_count == chain->run_max) {
+        size_t new_max = chain->run_max == 0 ? 16 : chain->run_max * 2;
+        struct fat32_run *new_runs = ext_mem_alloc(new_max * sizeof(struct fat32_run));
+
+        if (chain->runs != NULL) {
+            memcpy(new_runs, chain->runs, chain->run_count * sizeof(struct fat32_run));
+            pmm_free(chain->runs, chain->run_max * sizeof(struct fat32_run));
+        }
+
+        chain->runs = new_runs;
+        chain->run_max = new_max;
+    }
+
+    struct fat32_run *run = &chain->runs[chain->run_count++];
+    run->index = chain->cluster_count;
+    run->start = cluster;
+    run->count = 1;
+
+    chain->cluster_count++;
+}
+
+static void free_cluster_chain(struct fat32_chain *chain) {
+    if (chain->runs != NULL) {
+        pmm_free(chain->runs, chain->run_max * sizeof(struct fat32_run));
+    }
+    memset(chain, 0, sizeof(struct fat32_chain));
+}
+
+// Walk a cluster chain and store it as runs of disk-contiguous clusters
+static bool cache_cluster_chain(struct fat32_context *context,
+                                uint32_t initial_cluster,
+                                struct fat32_chain *chain) {
+    memset(chain, 0, sizeof(struct fat32_chain));
+
     uint32_t cluster_limit = (context->type == 12 ? 0xfef     : 0)
                            | (context->type == 16 ? 0xffef    : 0)
                            | (context->type == 32 ? 0xfffffef : 0);
     if (initial_cluster < 0x2 || initial_cluster > cluster_limit)
-        return NULL;
+        return false;
+
+    // A chain cannot be longer than the table has entries, this stops
+    // loops in corrupted tables from hanging us
+    uint64_t max_length = (uint64_t)context->sectors_per_fat * context->bytes_per_sector * 8 / context->type;
+
     uint32_t cluster = initial_cluster;
-    size_t chain_length;
-    for (chain_length = 1; ; chain_length++) {
-        read_cluster_from_map(context, cluster, &cluster);
+    for (;;) {
+        chain_add_cluster(chain, cluster);
+
+        if (chain->cluster_count >= max_length)
+            break;
+        if (read_cluster_from_map(context, &context->fat_window, cluster, &cluster) != 0)
+            break;
         if (cluster < 0x2 || cluster > cluster_limit)
             break;
     }
-    uint32_t *cluster_chain = ext_mem_alloc(chain_length * sizeof(uint32_t));
-    cluster = initial_cluster;
-    for (size_t i = 0; i < chain_length; i++) {
-        cluster_chain[i] = cluster;
-        read_cluster_from_map(context, cluster, &cluster);
+
+    return true;
+}
+
+// Number of runs starting at or before the given cluster of the file, the
+// last of them is the one containing it
+static size_t chain_find_run(struct fat32_chain *chain, uint64_t index) {
+    size_t lo = 0, hi = chain->run_count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (chain->runs[mid].index <= index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
-    *_chain_length = chain_length;
-    return cluster_chain;
+
+    return lo;
 }
 
-static bool read_cluster_chain(struct fat32_context *context,
-                               uint32_t *cluster_chain,
-                               void *buf, uint64_t loc, uint64_t count) {
+static bool read_cluster_chain_queued(struct fat32_context *context,
+                                      struct volume_read_queue *queue,
+                                      struct fat32_chain *chain,
+                                      void *buf, uint64_t loc, uint64_t count) {
     size_t block_size = context->sectors_per_cluster * context->bytes_per_sector;
     for (uint64_t progress = 0; progress < count;) {
         uint64_t block = (loc + progress) / block_size;
+        uint64_t offset = (loc + progress) % block_size;
+
+        size_t i = chain_find_run(chain, block);
+        if (i == 0 || block >= (uint64_t)chain->runs[i - 1].index + chain->runs[i - 1].count)
+            return false;
+
+        struct fat32_run *run = &chain->runs[i - 1];
 
+        // Read as much of the run as was asked for in one go
         uint64_t chunk = count - progress;
-        uint64_t offset = (loc + progress) % block_size;
-        if (chunk > block_size - offset)
-            chunk = block_size - offset;
+        uint64_t avail = ((uint64_t)run->index + run->count - block) * block_size - offset;
+        if (chunk > avail)
+            chunk = avail;
 
-        uint64_t base = ((uint64_t)context->data_start_lba + (cluster_chain[block] - 2) * context->sectors_per_cluster) * context->bytes_per_sector;
-        volume_read(context->part, buf + progress, base + offset, chunk);
+        uint32_t cluster = run->start + (block - run->index);
+        uint64_t base = ((uint64_t)context->data_start_lba + (uint64_t)(cluster - 2) * context->sectors_per_cluster) * context->bytes_per_sector;
+        volume_queue_read(queue, context->part, buf + progress, base + offset, chunk);
 
         progress += chunk;
     }
@@ -288,6 +424,29 @@ static bool read_cluster_chain(struct fat32_context *context,
     return true;
 }
 
+static bool read_cluster_chain(struct fat32_context *context,
+                               struct fat32_chain *chain,
+                               void *buf, uint64_t loc, uint64_t count) {
+    // Keep the reads of consecutive runs in flight together
+    struct volume_read_queue queue;
+    volume_queue_init(&queue);
+
+    bool ret = read_cluster_chain_queued(context, &queue, chain, buf, loc, count);
+
+    return volume_queue_wait(&queue) && ret;
+}
+
+// Checksum of an 8.3 name, stored in each of the LFN entries preceding it
+static uint8_t fat32_sfn_checksum(const char *sfn) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 8+3; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)sfn[i];
+    }
+
+    return sum;
+}
+
 // Copy ucs-2 characters to char*
 static void fat32_lfncpy(char* destination, const void* source, unsigned int size) {
     for (unsigned int i = 0; i < size; i++) {
@@ -324,6 +483,32 @@ static bool fat32_filename_to_8_3(char *dest, const char *src) {
     return true;
 }
 
+// Short names only go into the dentry cache under the spelling that converts
+// back to exactly this entry, which is what a lookup would have to ask for.
+static void fat32_dentry_add_sfn(struct fat32_context *context, uint64_t parent,
+                                 struct fat32_directory_entry *entry) {
+    char name[8 + 1 + 3 + 1];
+    size_t len = 0;
+
+    for (size_t i = 0; i < 8 && entry->file_name_and_ext[i] != ' '; i++)
+        name[len++] = entry->file_name_and_ext[i];
+
+    if (entry->file_name_and_ext[8] != ' ') {
+        name[len++] = '.';
+        for (size_t i = 8; i < 8 + 3 && entry->file_name_and_ext[i] != ' '; i++)
+            name[len++] = entry->file_name_and_ext[i];
+    }
+
+    name[len] = 0;
+
+    char fn[8 + 3];
+    if (len == 0 || !fat32_filename_to_8_3(fn, name)
+     || memcmp(fn, entry->file_name_and_ext, 8 + 3) != 0)
+        return;
+
+    dentry_insert(context->part, parent, name, len, entry, sizeof(struct fat32_directory_entry));
+}
+
 static int fat32_open_in(struct fat32_context* context, struct fat32_directory_entry* directory, struct fat32_directory_entry* file, const char* name) {
     size_t block_size = context->sectors_per_cluster * context->bytes_per_sector;
     char current_lfn[FAT32_LFN_MAX_FILENAME_LENGTH] = {0};
@@ -331,21 +516,33 @@ static int fat32_open_in(struct fat32_context* context, struct fat32_directory_e
     size_t dir_chain_len;
     struct fat32_directory_entry *directory_entries;
 
+    // Directories are told apart by their first cluster, the FAT12/16 root
+    // directory has none and uses 0.
+    uint32_t current_cluster_number = 0;
     if (directory != NULL) {
-        uint32_t current_cluster_number = directory->cluster_num_low;
+        current_cluster_number = directory->cluster_num_low;
         if (context->type == 32)
             current_cluster_number |= (uint32_t)directory->cluster_num_high << 16;
+    }
 
-        uint32_t *directory_cluster_chain = cache_cluster_chain(context, current_cluster_number, &dir_chain_len);
+    bool found;
+    if (name != NULL && dentry_lookup(context->part, current_cluster_number, name, strlen(name),
+                                      file, sizeof(struct fat32_directory_entry), &found)) {
+        return found ? 0 : -1;
+    }
 
-        if (directory_cluster_chain == NULL)
+    if (directory != NULL) {
+        struct fat32_chain directory_chain;
+
+        if (!cache_cluster_chain(context, current_cluster_number, &directory_chain))
             return -1;
 
+        dir_chain_len = directory_chain.cluster_count;
         directory_entries = ext_mem_alloc(dir_chain_len * block_size);
 
-        read_cluster_chain(context, directory_cluster_chain, directory_entries, 0, dir_chain_len * block_size);
+        read_cluster_chain(context, &directory_chain, directory_entries, 0, dir_chain_len * block_size);
 
-        pmm_free(directory_cluster_chain, dir_chain_len * sizeof(uint32_t));
+        free_cluster_chain(&directory_chain);
     } else {
         dir_chain_len = DIV_ROUNDUP(context->root_entries * sizeof(struct fat32_directory_entry), block_size);
 
@@ -354,14 +551,33 @@ static int fat32_open_in(struct fat32_context* context, struct fat32_directory_e
         volume_read(context->part, directory_entries, context->root_start * context->bytes_per_sector, context->root_entries * sizeof(struct fat32_directory_entry));
     }
 
-    int ret;
+    int ret = -1;
+
+    // The whole directory is in memory already, so keep going after a match
+    // and let the dentry cache learn the remaining names too. Names in a FAT
+    // directory are unique, only case insensitive lookups depend on the order
+    // entries are found in and those are left alone.
+    size_t entry_count = (dir_chain_len * block_size) / sizeof(struct fat32_directory_entry);
+    size_t prefill = case_insensitive_fopen ? 0 : DENTRY_PREFILL_MAX;
+
+    char fn[8+3];
+    bool name_is_8_3 = name != NULL && fat32_filename_to_8_3(fn, name);
+
+    for (size_t i = 0; i < entry_count; i++) {
+        if (ret == 0 && prefill == 0) {
+            break;
+        }
 
-    for (size_t i = 0; i < (dir_chain_len * block_size) / sizeof(struct fat32_directory_entry); i++) {
         if (directory_entries[i].file_name_and_ext[0] == 0x00) {
             // no more entries here
             break;
         }
 
+        if ((uint8_t)directory_entries[i].file_name_and_ext[0] == 0xe5) {
+            // deleted entry, this includes the LFN entries of deleted files
+            continue;
+        }
+
         if (name == NULL) {
             if (directory_entries[i].attribute != FAT32_ATTRIBUTE_VOLLABEL) {
                 continue;
@@ -409,12 +625,20 @@ static int fat32_open_in(struct fat32_context* context, struct fat32_directory_e
                 }
             }
 
+            // Only cache names that really belong to the entry after them,
+            // orphaned LFN entries are left to the lookup below as before
+            if (prefill > 0 && i + 1 < entry_count
+             && lfn->dos_checksum == fat32_sfn_checksum(directory_entries[i+1].file_name_and_ext)) {
+                dentry_insert(context->part, current_cluster_number, current_lfn, strlen(current_lfn),
+                              &directory_entries[i+1], sizeof(struct fat32_directory_entry));
+                prefill--;
+            }
+
             int (*strcmpfn)(const char *, const char *) = case_insensitive_fopen ? strcasecmp : strcmp;
 
-            if (strcmpfn(current_lfn, name) == 0) {
+            if (ret != 0 && strcmpfn(current_lfn, name) == 0) {
                 *file = directory_entries[i+1];
                 ret = 0;
-                goto out;
             }
         }
 
@@ -422,45 +646,51 @@ static int fat32_open_in(struct fat32_context* context, struct fat32_directory_e
             // It is a volume label, skip
             continue;
         }
-        // SFN
-        char fn[8+3];
-        if (!fat32_filename_to_8_3(fn, name)) {
-            continue;
+
+        if (prefill > 0) {
+            fat32_dentry_add_sfn(context, current_cluster_number, &directory_entries[i]);
+            prefill--;
         }
-        if (!strncmp(directory_entries[i].file_name_and_ext, fn, 8+3)) {
+
+        // SFN
+        if (ret != 0 && name_is_8_3 && !strncmp(directory_entries[i].file_name_and_ext, fn, 8+3)) {
             *file = directory_entries[i];
             ret = 0;
-            goto out;
         }
     }
 
-    // file not found
-    ret = -1;
+    if (name != NULL) {
+        dentry_insert(context->part, current_cluster_number, name, strlen(name),
+                      ret == 0 ? file : NULL, sizeof(struct fat32_directory_entry));
+    }
 
 out:
     pmm_free(directory_entries, dir_chain_len * block_size);
     return ret;
 }
 
-char *fat32_get_label(struct volume *part) {
-    struct fat32_context context;
-    if (fat32_init_context(&context, part) != 0) {
+struct fat32_context *fat32_mount(struct volume *part) {
+    struct fat32_context *context = ext_mem_alloc(sizeof(struct fat32_context));
+
+    if (fat32_init_context(context, part) != 0) {
+        pmm_free(context, sizeof(struct fat32_context));
         return NULL;
     }
 
-    return context.label;
+    return context;
+}
+
+char *fat32_get_label(struct fat32_context *context) {
+    return context->label;
 }
 
 static void fat32_read(struct file_handle *handle, void *buf, uint64_t loc, uint64_t count);
+static void fat32_read_queued(struct file_handle *handle, struct volume_read_queue *queue,
+                              void *buf, uint64_t loc, uint64_t count);
 static void fat32_close(struct file_handle *file);
 
-struct file_handle *fat32_open(struct volume *part, const char *path) {
-    struct fat32_context context;
-    int r = fat32_init_context(&context, part);
-
-    if (r) {
-        return NULL;
-    }
+struct file_handle *fat32_open(struct fat32_context *context, const char *path) {
+    int r;
 
     struct fat32_directory_entry _current_directory;
     struct fat32_directory_entry *current_directory;
@@ -474,14 +704,14 @@ struct file_handle *fat32_open(struct volume *part, const char *path) {
     }
 
     // walk down the directory tree
-    switch (context.type) {
+    switch (context->type) {
         case 12:
         case 16:
             current_directory = NULL;
             break;
         case 32:
-            _current_directory.cluster_num_low = context.root_directory_cluster & 0xFFFF;
-            _current_directory.cluster_num_high = context.root_directory_cluster >> 16;
+            _current_directory.cluster_num_low = context->root_directory_cluster & 0xFFFF;
+            _current_directory.cluster_num_high = context->root_directory_cluster >> 16;
             current_directory = &_current_directory;
             break;
         default:
@@ -508,7 +738,7 @@ struct file_handle *fat32_open(struct volume *part, const char *path) {
             }
         }
 
-        if ((r = fat32_open_in(&context, current_directory, &current_file, current_part)) != 0) {
+        if ((r = fat32_open_in(context, current_directory, &current_file, current_part)) != 0) {
             return NULL;
         }
 
@@ -521,20 +751,18 @@ struct file_handle *fat32_open(struct volume *part, const char *path) {
 
             ret->context = context;
             ret->first_cluster = current_file.cluster_num_low;
-            if (context.type == 32)
+            if (context->type == 32)
                 ret->first_cluster |= (uint64_t)current_file.cluster_num_high << 16;
-            ret->size_clusters = DIV_ROUNDUP(current_file.file_size_bytes, context.bytes_per_sector);
+            ret->size_clusters = DIV_ROUNDUP(current_file.file_size_bytes, context->bytes_per_sector);
             ret->size_bytes = current_file.file_size_bytes;
-            ret->cluster_chain = cache_cluster_chain(&context, ret->first_cluster, &ret->chain_len);
+            cache_cluster_chain(context, ret->first_cluster, &ret->chain);
 
             handle->fd = (void *)ret;
             handle->read = (void *)fat32_read;
+            handle->read_queued = (void *)fat32_read_queued;
             handle->close = (void *)fat32_close;
             handle->size = ret->size_bytes;
-            handle->vol = part;
-#if defined (UEFI)
-            handle->efi_part_handle = part->efi_part_handle;
-#endif
+            handle->vol = context->part;
 
             return handle;
         }
@@ -543,11 +771,17 @@ struct file_handle *fat32_open(struct volume *part, const char *path) {
 
 static void fat32_read(struct file_handle *file, void *buf, uint64_t loc, uint64_t count) {
     struct fat32_file_handle *f = file->fd;
-    read_cluster_chain(&f->context, f->cluster_chain, buf, loc, count);
+    read_cluster_chain(f->context, &f->chain, buf, loc, count);
+}
+
+static void fat32_read_queued(struct file_handle *file, struct volume_read_queue *queue,
+                              void *buf, uint64_t loc, uint64_t count) {
+    struct fat32_file_handle *f = file->fd;
+    read_cluster_chain_queued(f->context, queue, &f->chain, buf, loc, count);
 }
 
 static void fat32_close(struct file_handle *file) {
     struct fat32_file_handle *f = file->fd;
-    pmm_free(f->cluster_chain, f->chain_len * sizeof(uint32_t));
+    free_cluster_chain(&f->chain);
     pmm_free(f, sizeof(struct fat32_file_handle));
 }
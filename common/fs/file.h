@@ -11,6 +11,30 @@
 
 extern bool case_insensitive_fopen;
 
+enum {
+    FS_NONE,
+    FS_EXT2,
+    FS_ISO9660,
+    FS_FAT32
+};
+
+// Per-volume cache of directory lookups. Drivers key entries on whatever
+// identifies a directory for them (inode, first cluster, extent) and store up
+// to DENTRY_DATA_SIZE bytes describing the child. Lookups that failed are
+// kept as negative entries. Names are matched case-insensitively while
+// case_insensitive_fopen is set, entries made in the other mode never match.
+#define DENTRY_DATA_SIZE 32
+#define DENTRY_NAME_MAX 64
+
+// How many siblings a driver may add while scanning a directory for one name,
+// so that a large directory cannot flush the whole cache.
+#define DENTRY_PREFILL_MAX 128
+
+bool dentry_lookup(struct volume *part, uint64_t parent, const char *name, size_t name_len,
+                   void *data, size_t data_size, bool *found);
+void dentry_insert(struct volume *part, uint64_t parent, const char *name, size_t name_len,
+                   const void *data, size_t data_size);
+
 bool fs_get_guid(struct guid *guid, struct volume *part);
 char *fs_get_label(struct volume *part);
 
@@ -22,11 +46,11 @@ struct file_handle {
     size_t     path_len;
     void      *fd;
     void     (*read)(void *fd, void *buf, uint64_t loc, uint64_t count);
+    // Optional, starts the reads on queue without waiting for them
+    void     (*read_queued)(void *fd, struct volume_read_queue *queue,
+                            void *buf, uint64_t loc, uint64_t count);
     void     (*close)(void *fd);
     uint64_t   size;
-#if defined (UEFI)
-    EFI_HANDLE efi_part_handle;
-#endif
     bool pxe;
     uint32_t pxe_ip;
     uint16_t pxe_port;
@@ -36,6 +60,7 @@ struct file_handle *fopen(struct volume *part, const char *filename);
 void fread(struct file_handle *fd, void *buf, uint64_t loc, uint64_t count);
 void fclose(struct file_handle *fd);
 void *freadall(struct file_handle *fd, uint32_t type);
+void *freadall_blake2b(struct file_handle *fd, uint32_t type, void *hash);
 void *freadall_mode(struct file_handle *fd, uint32_t type, bool allow_high_allocs
 #if defined (__i386__)
     , void (*memcpy_to_64)(uint64_t dst, void *src, size_t count)
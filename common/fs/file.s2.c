@@ -10,29 +10,195 @@
 #include <lib/part.h>
 #include <lib/libc.h>
 #include <pxe/tftp.h>
+#include <crypt/blake2b.h>
+
+// Filesystems are only detected once per volume, every later lookup goes
+// straight to the driver that claimed it.
+static void fs_probe(struct volume *part) {
+    if (part->fs_probed) {
+        return;
+    }
+
+    part->fs_probed = true;
+    part->fs_type = FS_NONE;
+
+    if (part->pxe) {
+        return;
+    }
+
+    // An ext2 superblock with features we cannot read does not stop the
+    // other drivers from claiming the volume. If none does, it is kept for
+    // its label and UUID.
+    struct ext2_context *ext2_ctx = ext2_mount(part);
+
+    if (ext2_ctx != NULL && ext2_is_supported(ext2_ctx)) {
+        part->fs_ctx = ext2_ctx;
+        part->fs_type = FS_EXT2;
+    } else if ((part->fs_ctx = iso9660_mount(part)) != NULL) {
+        part->fs_type = FS_ISO9660;
+    } else if ((part->fs_ctx = fat32_mount(part)) != NULL) {
+        part->fs_type = FS_FAT32;
+    } else if (ext2_ctx != NULL) {
+        part->fs_ctx = ext2_ctx;
+        part->fs_type = FS_EXT2;
+    }
+
+    if (ext2_ctx != NULL && part->fs_ctx != ext2_ctx) {
+        ext2_unmount(ext2_ctx);
+    }
+}
 
 char *fs_get_label(struct volume *part) {
-    char *ret;
+    fs_probe(part);
 
-    if ((ret = fat32_get_label(part)) != NULL) {
-        return ret;
+    switch (part->fs_type) {
+        case FS_FAT32:
+            return fat32_get_label(part->fs_ctx);
+        case FS_EXT2:
+            return ext2_get_label(part->fs_ctx);
+        default:
+            return NULL;
     }
-    if ((ret = ext2_get_label(part)) != NULL) {
-        return ret;
+}
+
+bool fs_get_guid(struct guid *guid, struct volume *part) {
+    fs_probe(part);
+
+    switch (part->fs_type) {
+        case FS_EXT2:
+            return ext2_get_guid(guid, part->fs_ctx);
+        default:
+            return false;
+    }
+}
+
+bool case_insensitive_fopen = false;
+
+#define DENTRY_CACHE_SETS 64
+#define DENTRY_CACHE_WAYS 4
+
+struct dentry {
+    bool valid;
+    bool negative;
+    bool case_insensitive;
+    uint8_t name_len;
+    uint64_t parent;
+    uint64_t last_used;
+    char name[DENTRY_NAME_MAX];
+    uint8_t data[DENTRY_DATA_SIZE];
+};
+
+struct dentry_cache {
+    uint64_t ticks;
+    struct dentry sets[DENTRY_CACHE_SETS][DENTRY_CACHE_WAYS];
+};
+
+static struct dentry *dentry_set(struct dentry_cache *cache, uint64_t parent,
+                                 const char *name, size_t name_len) {
+    uint32_t hash = 2166136261;
+
+    for (size_t i = 0; i < sizeof(parent); i++) {
+        hash ^= (uint8_t)(parent >> (i * 8));
+        hash *= 16777619;
+    }
+
+    for (size_t i = 0; i < name_len; i++) {
+        uint8_t c = case_insensitive_fopen ? tolower(name[i]) : name[i];
+        hash ^= c;
+        hash *= 16777619;
+    }
+
+    return cache->sets[hash % DENTRY_CACHE_SETS];
+}
+
+static struct dentry *dentry_find(struct dentry *set, uint64_t parent,
+                                  const char *name, size_t name_len) {
+    for (size_t i = 0; i < DENTRY_CACHE_WAYS; i++) {
+        struct dentry *d = &set[i];
+
+        if (!d->valid || d->parent != parent || d->name_len != name_len
+         || d->case_insensitive != case_insensitive_fopen) {
+            continue;
+        }
+
+        if (case_insensitive_fopen) {
+            if (strncasecmp(d->name, name, name_len) == 0) {
+                return d;
+            }
+        } else if (memcmp(d->name, name, name_len) == 0) {
+            return d;
+        }
     }
 
     return NULL;
 }
 
-bool fs_get_guid(struct guid *guid, struct volume *part) {
-    if (ext2_get_guid(guid, part) == true) {
-        return true;
+bool dentry_lookup(struct volume *part, uint64_t parent, const char *name, size_t name_len,
+                   void *data, size_t data_size, bool *found) {
+    struct dentry_cache *cache = part->dentry_cache;
+
+    if (cache == NULL || name_len > DENTRY_NAME_MAX || data_size > DENTRY_DATA_SIZE) {
+        return false;
+    }
+
+    struct dentry *d = dentry_find(dentry_set(cache, parent, name, name_len),
+                                   parent, name, name_len);
+    if (d == NULL) {
+        return false;
     }
 
-    return false;
+    d->last_used = ++cache->ticks;
+
+    *found = !d->negative;
+    if (*found) {
+        memcpy(data, d->data, data_size);
+    }
+
+    return true;
 }
 
-bool case_insensitive_fopen = false;
+// A NULL data records the name as missing from the directory. Existing entries
+// are kept as they are: the volume is read-only, so whatever was found first
+// is still what a scan of the directory would find.
+void dentry_insert(struct volume *part, uint64_t parent, const char *name, size_t name_len,
+                   const void *data, size_t data_size) {
+    if (name_len > DENTRY_NAME_MAX || data_size > DENTRY_DATA_SIZE) {
+        return;
+    }
+
+    if (part->dentry_cache == NULL) {
+        part->dentry_cache = ext_mem_alloc(sizeof(struct dentry_cache));
+    }
+
+    struct dentry_cache *cache = part->dentry_cache;
+    struct dentry *set = dentry_set(cache, parent, name, name_len);
+
+    if (dentry_find(set, parent, name, name_len) != NULL) {
+        return;
+    }
+
+    struct dentry *victim = &set[0];
+    for (size_t i = 0; i < DENTRY_CACHE_WAYS; i++) {
+        if (!set[i].valid) {
+            victim = &set[i];
+            break;
+        }
+        if (set[i].last_used < victim->last_used) {
+            victim = &set[i];
+        }
+    }
+
+    victim->valid = true;
+    victim->negative = data == NULL;
+    victim->case_insensitive = case_insensitive_fopen;
+    victim->name_len = name_len;
+    victim->parent = parent;
+    victim->last_used = ++cache->ticks;
+    memcpy(victim->name, name, name_len);
+    if (data != NULL) {
+        memcpy(victim->data, data, data_size);
+    }
+}
 
 struct file_handle *fopen(struct volume *part, const char *filename) {
     size_t filename_new_len = strlen(filename) + 2;
@@ -56,16 +222,28 @@ struct file_handle *fopen(struct volume *part, const char *filename) {
         return ret;
     }
 
-    if ((ret = ext2_open(part, filename)) != NULL) {
-        goto success;
-    }
-    if ((ret = iso9660_open(part, filename)) != NULL) {
-        goto success;
+    fs_probe(part);
+
+    switch (part->fs_type) {
+        case FS_EXT2:
+            ret = ext2_open(part->fs_ctx, filename);
+            break;
+        case FS_ISO9660:
+            ret = iso9660_open(part->fs_ctx, filename);
+            break;
+        case FS_FAT32:
+            ret = fat32_open(part->fs_ctx, filename);
+            break;
+        default:
+            ret = NULL;
+            break;
     }
-    if ((ret = fat32_open(part, filename)) != NULL) {
+
+    if (ret != NULL) {
         goto success;
     }
 
+    pmm_free(filename_new, filename_new_len);
     return NULL;
 
 success:
@@ -103,6 +281,62 @@ void *freadall(struct file_handle *fd, uint32_t type) {
     );
 }
 
+#define FREADALL_HASH_CHUNK 0x100000
+
+// Like freadall(), also putting the Blake2b hash of the contents in hash.
+// When the driver can queue its reads, each chunk of the file is hashed while
+// the next one is still being read.
+void *freadall_blake2b(struct file_handle *fd, uint32_t type, void *hash) {
+    if (fd->is_memfile || fd->read_queued == NULL) {
+        void *ret = freadall(fd, type);
+        blake2b(hash, ret, fd->size);
+        return ret;
+    }
+
+    uint8_t *ret = ext_mem_alloc_type_aligned(fd->size, type, 4096);
+
+    struct blake2b_state state;
+    blake2b_init(&state);
+
+    struct volume_read_queue queues[2];
+    size_t cur = 0;
+
+    uint64_t loc = 0;
+    uint64_t count = fd->size < FREADALL_HASH_CHUNK ? fd->size : FREADALL_HASH_CHUNK;
+
+    volume_queue_init(&queues[cur]);
+    fd->read_queued(fd, &queues[cur], ret, loc, count);
+
+    while (count != 0) {
+        uint64_t next_loc = loc + count;
+        uint64_t next_count = fd->size - next_loc;
+        if (next_count > FREADALL_HASH_CHUNK)
+            next_count = FREADALL_HASH_CHUNK;
+
+        volume_queue_init(&queues[!cur]);
+        if (next_count != 0) {
+            fd->read_queued(fd, &queues[!cur], ret + next_loc, next_loc, next_count);
+        }
+
+        // Read errors show up as a hash mismatch
+        volume_queue_wait(&queues[cur]);
+        blake2b_update(&state, ret + loc, count);
+
+        loc = next_loc;
+        count = next_count;
+        cur = !cur;
+    }
+
+    blake2b_final(&state, hash);
+
+    fd->close(fd);
+    fd->fd = ret;
+    fd->readall = true;
+    fd->is_memfile = true;
+
+    return ret;
+}
+
 void *freadall_mode(struct file_handle *fd, uint32_t type, bool allow_high_allocs
 #if defined (__i386__)
     , void (*memcpy_to_64)(uint64_t dst, void *src, size_t count)
@@ -5,6 +5,10 @@
 #include <lib/part.h>
 #include <fs/file.h>
 
-struct file_handle *iso9660_open(struct volume *vol, const char *path);
+struct iso9660_context;
+
+struct iso9660_context *iso9660_mount(struct volume *vol);
+
+struct file_handle *iso9660_open(struct iso9660_context *context, const char *path);
 
 #endif
@@ -1,20 +1,69 @@
 #include <fs/iso9660.h>
+#include <fs/file.h>
 #include <lib/misc.h>
 #include <lib/libc.h>
 #include <mm/pmm.h>
 
 #define ISO9660_SECTOR_SIZE (2 << 10)
 
+#define ISO9660_DIR_CACHE_BUCKETS 64
+#define ISO9660_NO_ENTRY ((uint32_t)-1)
+
+#define ISO9660_FLAG_MULTI_EXTENT 0x80
+
+struct iso9660_extent {
+    uint32_t LBA;
+    uint32_t size;
+};
+
+// A directory record with its name already decoded. Files made of several
+// extents are recorded once, with all of their extents.
+struct iso9660_dir_entry {
+    const char *name;
+    uint32_t hash;
+    uint32_t next;      // next entry in the same bucket, in directory order
+    bool rr;
+    uint64_t size;
+    uint32_t extent;    // first extent in the directory's extent table
+    uint32_t extent_count;
+};
+
+// A directory read and decoded once, looked up by name through a hash table
+// of case folded names.
+struct iso9660_dir {
+    struct iso9660_dir *next;
+    uint32_t LBA;
+    uint32_t count;
+    struct iso9660_dir_entry *entries;
+    size_t entries_size;
+    struct iso9660_extent *extents;
+    size_t extents_size;
+    uint32_t *buckets;
+    uint32_t bucket_count;
+    char *names;
+    size_t names_size;
+};
+
 struct iso9660_context {
     struct volume *vol;
-    void *root;
+    uint32_t root_lba;
     uint32_t root_size;
+    // Every directory visited so far, hashed by LBA
+    struct iso9660_dir *dirs[ISO9660_DIR_CACHE_BUCKETS];
+};
+
+// A stretch of the file that is contiguous on disk
+struct iso9660_run {
+    uint64_t offset;
+    uint64_t size;
 };
 
 struct iso9660_file_handle {
     struct iso9660_context *context;
-    uint32_t LBA;
-    uint32_t size;
+    uint64_t size;
+    size_t run_count;
+    struct iso9660_run *runs;
+    size_t runs_size;
 };
 
 #define ISO9660_FIRST_VOLUME_DESCRIPTOR 0x10
@@ -86,13 +135,6 @@ struct iso9660_primary_volume {
 
 
 // --- Implementation ---
-struct iso9660_contexts_node {
-    struct iso9660_context context;
-    struct iso9660_contexts_node *next;
-};
-
-static struct iso9660_contexts_node *contexts = NULL;
-
 static void iso9660_find_PVD(struct iso9660_primary_volume *desc, struct volume *vol) {
     uint32_t lba = ISO9660_FIRST_VOLUME_DESCRIPTOR;
     while (true) {
@@ -110,33 +152,31 @@ static void iso9660_find_PVD(struct iso9660_primary_volume *desc, struct volume
     }
 }
 
-static void iso9660_cache_root(struct volume *vol,
-                               void **root,
-                               uint32_t *root_size) {
+static struct iso9660_dir *iso9660_get_dir(struct iso9660_context *context, uint32_t lba, uint32_t size);
+
+static void iso9660_cache_root(struct iso9660_context *context) {
     struct iso9660_primary_volume pv;
-    iso9660_find_PVD(&pv, vol);
+    iso9660_find_PVD(&pv, context->vol);
 
-    *root_size = pv.root.extent_size.little;
-    *root = ext_mem_alloc(*root_size);
-    volume_read(vol, *root, pv.root.extent.little * ISO9660_SECTOR_SIZE, *root_size);
+    context->root_lba = pv.root.extent.little;
+    context->root_size = pv.root.extent_size.little;
+    iso9660_get_dir(context, context->root_lba, context->root_size);
 }
 
-static struct iso9660_context *iso9660_get_context(struct volume *vol) {
-    struct iso9660_contexts_node *current = contexts;
-    while (current) {
-        if (current->context.vol == vol)
-            return &current->context;
-        current = current->next;
+struct iso9660_context *iso9660_mount(struct volume *vol) {
+    char buf[6];
+    const uint64_t signature = ISO9660_FIRST_VOLUME_DESCRIPTOR * ISO9660_SECTOR_SIZE + 1;
+    volume_read(vol, buf, signature, 5);
+    buf[5] = '\0';
+    if (strcmp(buf, "CD001") != 0) {
+        return NULL;
     }
 
-    // The context is not cached at this point
-    struct iso9660_contexts_node *node = ext_mem_alloc(sizeof(struct iso9660_contexts_node));
-    node->context.vol = vol;
-    iso9660_cache_root(vol, &node->context.root, &node->context.root_size);
+    struct iso9660_context *context = ext_mem_alloc(sizeof(struct iso9660_context));
+    context->vol = vol;
+    iso9660_cache_root(context);
 
-    node->next = contexts;
-    contexts = node;
-    return &node->context;
+    return context;
 }
 
 static bool load_name(char *buf, size_t limit, struct iso9660_directory_entry *entry) {
@@ -185,65 +225,200 @@ static bool load_name(char *buf, size_t limit, struct iso9660_directory_entry *e
     }
 }
 
-static struct iso9660_directory_entry *iso9660_find(void *buffer, uint32_t size, const char *filename) {
-    while (size) {
-        struct iso9660_directory_entry *entry = buffer;
+static uint32_t iso9660_name_hash(const char *name) {
+    uint32_t hash = 2166136261;
 
-        if (entry->length == 0) {
-            if (size <= ISO9660_SECTOR_SIZE)
-                return NULL;
-            size_t prev_size = size;
-            size = ALIGN_DOWN(size, ISO9660_SECTOR_SIZE);
-            buffer += prev_size - size;
+    for (; *name; name++) {
+        hash ^= (uint8_t)tolower(*name);
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+static struct iso9660_dir *iso9660_load_dir(struct iso9660_context *context, uint32_t lba, uint32_t size) {
+    uint8_t *raw = ext_mem_alloc(size);
+    volume_read(context->vol, raw, (uint64_t)lba * ISO9660_SECTOR_SIZE, size);
+
+    struct iso9660_dir *dir = ext_mem_alloc(sizeof(struct iso9660_dir));
+    dir->LBA = lba;
+
+    // Every record is at least 34 bytes long and holds its own name, so
+    // neither the entries nor the names can outgrow the raw directory.
+    size_t max_entries = size / (sizeof(struct iso9660_directory_entry) + 1) + 1;
+    dir->entries_size = max_entries * sizeof(struct iso9660_dir_entry);
+    dir->entries = ext_mem_alloc(dir->entries_size);
+    dir->extents_size = max_entries * sizeof(struct iso9660_extent);
+    dir->extents = ext_mem_alloc(dir->extents_size);
+    dir->names_size = size + 1;
+    dir->names = ext_mem_alloc(dir->names_size);
+
+    size_t names_used = 0;
+    uint32_t extent_count = 0;
+    uint8_t *buffer = raw;
+    uint32_t left = size;
+
+    // Set while the last record said the file goes on in the next one
+    bool more_extents = false;
+
+    while (left && dir->count < max_entries) {
+        struct iso9660_directory_entry *record = (void *)buffer;
+
+        if (record->length == 0) {
+            if (left <= ISO9660_SECTOR_SIZE)
+                break;
+            size_t prev_left = left;
+            left = ALIGN_DOWN(left, ISO9660_SECTOR_SIZE);
+            buffer += prev_left - left;
             continue;
         }
 
-        char entry_filename[256];
-        bool rr = load_name(entry_filename, 256, entry);
+        if (record->length < sizeof(struct iso9660_directory_entry) || record->length > left)
+            break;
+
+        struct iso9660_extent *extent = &dir->extents[extent_count++];
+        extent->LBA = record->extent.little;
+        extent->size = record->extent_size.little;
+
+        if (more_extents) {
+            struct iso9660_dir_entry *entry = &dir->entries[dir->count - 1];
+            entry->size += extent->size;
+            entry->extent_count++;
+
+            more_extents = (record->flags & ISO9660_FLAG_MULTI_EXTENT) != 0;
+            left -= record->length;
+            buffer += record->length;
+            continue;
+        }
 
-        if (rr && !case_insensitive_fopen) {
-            if (strcmp(filename, entry_filename) == 0) {
-                return buffer;
+        size_t limit = dir->names_size - names_used;
+        if (limit > ROCK_RIDGE_MAX_FILENAME + 1)
+            limit = ROCK_RIDGE_MAX_FILENAME + 1;
+
+        struct iso9660_dir_entry *entry = &dir->entries[dir->count++];
+        char *name = dir->names + names_used;
+
+        entry->rr = load_name(name, limit, record);
+        entry->name = name;
+        entry->hash = iso9660_name_hash(name);
+        entry->size = extent->size;
+        entry->extent = extent_count - 1;
+        entry->extent_count = 1;
+
+        more_extents = (record->flags & ISO9660_FLAG_MULTI_EXTENT) != 0;
+
+        names_used += strlen(name) + 1;
+
+        left -= record->length;
+        buffer += record->length;
+    }
+
+    pmm_free(raw, size);
+
+    dir->bucket_count = 8;
+    while (dir->bucket_count < dir->count)
+        dir->bucket_count *= 2;
+
+    dir->buckets = ext_mem_alloc(dir->bucket_count * sizeof(uint32_t));
+    memset(dir->buckets, 0xff, dir->bucket_count * sizeof(uint32_t));
+
+    // Chains are built back to front so that they keep directory order and
+    // the first record that matches wins, like it would in a linear scan.
+    for (uint32_t i = dir->count; i-- > 0; ) {
+        uint32_t *bucket = &dir->buckets[dir->entries[i].hash & (dir->bucket_count - 1)];
+        dir->entries[i].next = *bucket;
+        *bucket = i;
+    }
+
+    return dir;
+}
+
+static struct iso9660_dir *iso9660_get_dir(struct iso9660_context *context, uint32_t lba, uint32_t size) {
+    struct iso9660_dir **bucket = &context->dirs[lba % ISO9660_DIR_CACHE_BUCKETS];
+
+    for (struct iso9660_dir *dir = *bucket; dir != NULL; dir = dir->next) {
+        if (dir->LBA == lba)
+            return dir;
+    }
+
+    struct iso9660_dir *dir = iso9660_load_dir(context, lba, size);
+    dir->next = *bucket;
+    *bucket = dir;
+
+    return dir;
+}
+
+static struct iso9660_dir_entry *iso9660_find(struct iso9660_dir *dir, const char *filename) {
+    uint32_t hash = iso9660_name_hash(filename);
+
+    for (uint32_t i = dir->buckets[hash & (dir->bucket_count - 1)]; i != ISO9660_NO_ENTRY;
+         i = dir->entries[i].next) {
+        struct iso9660_dir_entry *entry = &dir->entries[i];
+
+        if (entry->hash != hash)
+            continue;
+
+        if (entry->rr && !case_insensitive_fopen) {
+            if (strcmp(filename, entry->name) == 0) {
+                return entry;
             }
         } else {
-            if (strcasecmp(filename, entry_filename) == 0) {
-                return buffer;
+            if (strcasecmp(filename, entry->name) == 0) {
+                return entry;
             }
         }
-
-        size -= entry->length;
-        buffer += entry->length;
     }
 
     return NULL;
 }
 
 static void iso9660_read(struct file_handle *handle, void *buf, uint64_t loc, uint64_t count);
+static void iso9660_read_queued(struct file_handle *handle, struct volume_read_queue *queue,
+                                void *buf, uint64_t loc, uint64_t count);
 static void iso9660_close(struct file_handle *file);
 
-struct file_handle *iso9660_open(struct volume *vol, const char *path) {
-    char buf[6];
-    const uint64_t signature = ISO9660_FIRST_VOLUME_DESCRIPTOR * ISO9660_SECTOR_SIZE + 1;
-    volume_read(vol, buf, signature, 5);
-    buf[5] = '\0';
-    if (strcmp(buf, "CD001") != 0) {
-        return NULL;
-    }
+// What the dentry cache keeps for a name, decoded directories live as long as
+// their context so pointing into them is fine.
+struct iso9660_dentry {
+    struct iso9660_dir *dir;
+    struct iso9660_dir_entry *entry;
+};
 
-    struct iso9660_file_handle *ret = ext_mem_alloc(sizeof(struct iso9660_file_handle));
+// Joins the extents of a file into runs, extents that follow each other on
+// disk become one run so they can be read with a single volume_read().
+static void iso9660_build_runs(struct iso9660_file_handle *f, struct iso9660_dentry *d) {
+    struct iso9660_extent *extents = &d->dir->extents[d->entry->extent];
+
+    f->runs_size = d->entry->extent_count * sizeof(struct iso9660_run);
+    f->runs = ext_mem_alloc(f->runs_size);
+
+    for (uint32_t i = 0; i < d->entry->extent_count; i++) {
+        uint64_t offset = (uint64_t)extents[i].LBA * ISO9660_SECTOR_SIZE;
+
+        if (f->run_count > 0) {
+            struct iso9660_run *last = &f->runs[f->run_count - 1];
+            if (last->offset + last->size == offset && last->size % ISO9660_SECTOR_SIZE == 0) {
+                last->size += extents[i].size;
+                continue;
+            }
+        }
+
+        f->runs[f->run_count].offset = offset;
+        f->runs[f->run_count].size = extents[i].size;
+        f->run_count++;
+    }
+}
 
-    ret->context = iso9660_get_context(vol);
+struct file_handle *iso9660_open(struct iso9660_context *context, const char *path) {
+    struct volume *vol = context->vol;
 
     while (*path == '/')
         ++path;
 
-    struct iso9660_directory_entry *current = ret->context->root;
-    uint32_t current_size = ret->context->root_size;
+    uint32_t current_lba = context->root_lba;
+    uint32_t current_size = context->root_size;
 
-    bool first = true;
-
-    uint32_t next_sector = 0;
-    uint32_t next_size = 0;
+    struct iso9660_dentry next;
 
     char filename[ROCK_RIDGE_MAX_FILENAME];
     while (true) {
@@ -252,52 +427,82 @@ struct file_handle *iso9660_open(struct volume *vol, const char *path) {
             *aux++ = *path++;
         *aux = '\0';
 
-        struct iso9660_directory_entry *entry = iso9660_find(current, current_size, filename);
-        if (!entry) {
-            pmm_free(ret, sizeof(struct iso9660_file_handle));
-            return NULL;    // Not found :(
-        }
+        size_t filename_len = strlen(filename);
+        bool found;
 
-        next_sector = entry->extent.little;
-        next_size = entry->extent_size.little;
+        if (!dentry_lookup(vol, current_lba, filename, filename_len, &next, sizeof(next), &found)) {
+            next.dir = iso9660_get_dir(context, current_lba, current_size);
+            next.entry = iso9660_find(next.dir, filename);
 
-        if (*path++ == '\0')
-            break;    // Found :)
+            found = next.entry != NULL;
 
-        if (!first) {
-            pmm_free(current, current_size);
+            dentry_insert(vol, current_lba, filename, filename_len, found ? &next : NULL, sizeof(next));
         }
 
-        current_size = next_size;
-        current = ext_mem_alloc(current_size);
+        if (!found)
+            return NULL;    // Not found :(
 
-        first = false;
+        if (*path++ == '\0')
+            break;    // Found :)
 
-        volume_read(vol, current, next_sector * ISO9660_SECTOR_SIZE, current_size);
+        current_lba = next.dir->extents[next.entry->extent].LBA;
+        current_size = next.entry->size;
     }
 
-    ret->LBA = next_sector;
-    ret->size = next_size;
+    struct iso9660_file_handle *ret = ext_mem_alloc(sizeof(struct iso9660_file_handle));
+
+    ret->context = context;
+    ret->size = next.entry->size;
+    iso9660_build_runs(ret, &next);
 
     struct file_handle *handle = ext_mem_alloc(sizeof(struct file_handle));
 
     handle->fd = ret;
     handle->read = (void *)iso9660_read;
+    handle->read_queued = (void *)iso9660_read_queued;
     handle->close = (void *)iso9660_close;
     handle->size = ret->size;
     handle->vol = vol;
-#if defined (UEFI)
-    handle->efi_part_handle = vol->efi_part_handle;
-#endif
 
     return handle;
 }
 
-static void iso9660_read(struct file_handle *file, void *buf, uint64_t loc, uint64_t count) {
+static void iso9660_read_queued(struct file_handle *file, struct volume_read_queue *queue,
+                                void *buf, uint64_t loc, uint64_t count) {
     struct iso9660_file_handle *f = file->fd;
-    volume_read(f->context->vol, buf, f->LBA * ISO9660_SECTOR_SIZE + loc, count);
+
+    for (size_t i = 0; i < f->run_count && count > 0; i++) {
+        struct iso9660_run *run = &f->runs[i];
+
+        if (loc >= run->size) {
+            loc -= run->size;
+            continue;
+        }
+
+        uint64_t chunk = run->size - loc;
+        if (chunk > count)
+            chunk = count;
+
+        volume_queue_read(queue, f->context->vol, buf, run->offset + loc, chunk);
+
+        buf += chunk;
+        count -= chunk;
+        loc = 0;
+    }
+}
+
+static void iso9660_read(struct file_handle *file, void *buf, uint64_t loc, uint64_t count) {
+    // Keep the reads of consecutive extents in flight together
+    struct volume_read_queue queue;
+    volume_queue_init(&queue);
+
+    iso9660_read_queued(file, &queue, buf, loc, count);
+
+    volume_queue_wait(&queue);
 }
 
 static void iso9660_close(struct file_handle *file) {
-    pmm_free(file->fd, sizeof(struct iso9660_file_handle));
+    struct iso9660_file_handle *f = file->fd;
+    pmm_free(f->runs, f->runs_size);
+    pmm_free(f, sizeof(struct iso9660_file_handle));
 }
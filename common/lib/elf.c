@@ -67,8 +67,6 @@
 #define R_LARCH_64         0x00000002
 #define R_AARCH64_ABS64    0x00000101
 
-#define R_INTERNAL_RELR    0xfffffff0
-
 /* Indices into identification array */
 #define EI_CLASS    4
 #define EI_DATA     5
@@ -231,7 +229,7 @@ struct elf_section_hdr_info elf32_section_hdr_info(uint8_t *elf) {
     return info;
 }
 
-static bool elf64_is_relocatable(uint8_t *elf, struct elf64_hdr *hdr) {
+static bool elf64_is_relocatable(struct elf64_hdr *hdr, uint8_t *phdrs) {
     if (hdr->phdr_size < sizeof(struct elf64_phdr)) {
         panic(true, "elf: phdr_size < sizeof(struct elf64_phdr)");
     }
@@ -242,7 +240,7 @@ static bool elf64_is_relocatable(uint8_t *elf, struct elf64_hdr *hdr) {
 
     // Find PT_DYNAMIC segment
     for (size_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_DYNAMIC) {
             continue;
@@ -258,11 +256,73 @@ static bool elf64_is_relocatable(uint8_t *elf, struct elf64_hdr *hdr) {
     panic(true, "elf: ELF file type is ET_DYN, but PT_DYNAMIC segment missing");
 }
 
-static bool elf64_apply_relocations(uint8_t *elf, struct elf64_hdr *hdr, void *buffer, uint64_t vaddr, size_t size, uint64_t slide) {
+static uint8_t *elf64_read_phdrs(struct file_handle *fd, struct elf64_hdr *hdr) {
     if (hdr->phdr_size < sizeof(struct elf64_phdr)) {
         panic(true, "elf: phdr_size < sizeof(struct elf64_phdr)");
     }
 
+    size_t size = (size_t)hdr->ph_num * hdr->phdr_size;
+
+    if (hdr->phoff + size > fd->size) {
+        panic(true, "elf: Program headers lie outside of the file");
+    }
+
+    uint8_t *phdrs = ext_mem_alloc(size);
+    fread(fd, phdrs, hdr->phoff, size);
+
+    return phdrs;
+}
+
+static uint64_t elf64_vaddr_to_offset(struct elf64_hdr *hdr, uint8_t *phdrs, uint64_t vaddr) {
+    for (uint16_t i = 0; i < hdr->ph_num; i++) {
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
+
+        if (phdr->p_vaddr <= vaddr && phdr->p_vaddr + phdr->p_filesz > vaddr) {
+            return vaddr - phdr->p_vaddr + phdr->p_offset;
+        }
+    }
+
+    return vaddr;
+}
+
+// Reads size bytes at offset into a scratch buffer, or returns NULL if there
+// is nothing to read. what names the table in the error message.
+static void *elf64_read_table(struct file_handle *fd, uint64_t offset, uint64_t size,
+                              const char *what) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (offset + size < offset || offset + size > fd->size) {
+        panic(true, "elf: %s lies outside of the file", what);
+    }
+
+    void *ret = ext_mem_alloc(size);
+    fread(fd, ret, offset, size);
+
+    return ret;
+}
+
+// The parts of the image relocations are applied from. They are pulled out
+// of the file once so that the image itself can be read straight into place.
+struct elf64_relocs {
+    uint8_t *symtab;
+    uint64_t symtab_size;
+    uint64_t symtab_ent;
+    uint64_t symtab_count;
+
+    uint8_t *relr;
+    uint64_t relr_size;
+
+    uint8_t *rela;
+    uint64_t rela_size;
+    uint64_t rela_ent;
+
+    uint8_t *jmprel;
+    uint64_t jmprel_size;
+};
+
+static void elf64_read_relocs(struct file_handle *fd, struct elf64_hdr *hdr, uint8_t *phdrs, struct elf64_relocs *r) {
     uint64_t symtab_offset = 0;
     uint64_t symtab_ent = 0;
 
@@ -278,15 +338,20 @@ static bool elf64_apply_relocations(uint8_t *elf, struct elf64_hdr *hdr, void *b
     uint64_t rela_size = 0;
     uint64_t rela_ent = 0;
 
+    memset(r, 0, sizeof(struct elf64_relocs));
+
     // Find DYN segment
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_DYNAMIC)
             continue;
 
-        for (uint16_t j = 0; j < phdr->p_filesz / sizeof(struct elf64_dyn); j++) {
-            struct elf64_dyn *dyn = (void *)elf + (phdr->p_offset + j * sizeof(struct elf64_dyn));
+        size_t dynamic_size = ALIGN_DOWN(phdr->p_filesz, sizeof(struct elf64_dyn));
+        struct elf64_dyn *dynamic = elf64_read_table(fd, phdr->p_offset, dynamic_size, "Dynamic table");
+
+        for (size_t j = 0; j < dynamic_size / sizeof(struct elf64_dyn); j++) {
+            struct elf64_dyn *dyn = &dynamic[j];
 
             switch (dyn->d_tag) {
                 case DT_RELA:
@@ -332,283 +397,338 @@ static bool elf64_apply_relocations(uint8_t *elf, struct elf64_hdr *hdr, void *b
             }
         }
 
-        break;
-    }
 end_of_pt_segment:
-
-    if (rela_offset != 0) {
-        for (uint16_t i = 0; i < hdr->ph_num; i++) {
-            struct elf64_phdr *_phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
-
-            if (_phdr->p_vaddr <= rela_offset && _phdr->p_vaddr + _phdr->p_filesz > rela_offset) {
-                rela_offset -= _phdr->p_vaddr;
-                rela_offset += _phdr->p_offset;
-                break;
-            }
-        }
-    }
-
-    if (relr_offset != 0) {
-        for (uint16_t i = 0; i < hdr->ph_num; i++) {
-            struct elf64_phdr *_phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
-
-            if (_phdr->p_vaddr <= relr_offset && _phdr->p_vaddr + _phdr->p_filesz > relr_offset) {
-                relr_offset -= _phdr->p_vaddr;
-                relr_offset += _phdr->p_offset;
-                break;
-            }
-        }
-    }
-
-    if (symtab_offset != 0) {
-        for (uint16_t i = 0; i < hdr->ph_num; i++) {
-            struct elf64_phdr *_phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
-
-            if (_phdr->p_vaddr <= symtab_offset && _phdr->p_vaddr + _phdr->p_filesz > symtab_offset) {
-                symtab_offset -= _phdr->p_vaddr;
-                symtab_offset += _phdr->p_offset;
-                break;
-            }
-        }
-    }
-
-    if (dt_jmprel != 0) {
-        for (uint16_t i = 0; i < hdr->ph_num; i++) {
-            struct elf64_phdr *_phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
-
-            if (_phdr->p_vaddr <= dt_jmprel && _phdr->p_vaddr + _phdr->p_filesz > dt_jmprel) {
-                dt_jmprel -= _phdr->p_vaddr;
-                dt_jmprel += _phdr->p_offset;
-                break;
-            }
+        if (dynamic != NULL) {
+            pmm_free(dynamic, dynamic_size);
         }
+        break;
     }
 
-    size_t relocs_i = 0;
     if (relr_size != 0) {
         if (relr_ent != 8) {
             panic(true, "elf: relr_ent != 8");
         }
-        for (size_t i = 0; i < relr_size / relr_ent; i++) {
-            uint64_t entry = *((uint64_t *)(elf + relr_offset + i * relr_ent));
-
-            if ((entry & 1) == 0) {
-                relocs_i++;
-            } else {
-                relocs_i += __builtin_popcountll(entry) - 1;
-            }
-        }
+        r->relr_size = relr_size;
+        r->relr = elf64_read_table(fd, elf64_vaddr_to_offset(hdr, phdrs, relr_offset), relr_size, "Relocation table");
     }
-    size_t relr_count = relocs_i;
+
     if (rela_size != 0) {
         if (rela_ent < sizeof(struct elf64_rela)) {
             panic(true, "elf: rela_ent < sizeof(struct elf64_rela)");
         }
-        relocs_i += rela_size / rela_ent;
+        r->rela_size = rela_size;
+        r->rela = elf64_read_table(fd, elf64_vaddr_to_offset(hdr, phdrs, rela_offset), rela_size, "Relocation table");
     }
+
     if (dt_pltrelsz != 0) {
         if (dt_pltrel != DT_RELA) {
             panic(true, "elf: dt_pltrel != DT_RELA");
         }
-        relocs_i += dt_pltrelsz / rela_ent;
+        // Images with only PLT relocations need not have DT_RELAENT
+        if (rela_ent == 0) {
+            rela_ent = sizeof(struct elf64_rela);
+        } else if (rela_ent < sizeof(struct elf64_rela)) {
+            panic(true, "elf: rela_ent < sizeof(struct elf64_rela)");
+        }
+        r->jmprel_size = dt_pltrelsz;
+        r->jmprel = elf64_read_table(fd, elf64_vaddr_to_offset(hdr, phdrs, dt_jmprel), dt_pltrelsz, "Relocation table");
     }
-    struct elf64_rela **relocs = ext_mem_alloc(relocs_i * sizeof(struct elf64_rela *));
 
-    if (relr_size != 0) {
-        size_t relr_i;
-        for (relr_i = 0; relr_i < relr_count; relr_i++) {
-            relocs[relr_i] = ext_mem_alloc(sizeof(struct elf64_rela));
-            relocs[relr_i]->r_info = R_INTERNAL_RELR;
-        }
-
-        // This logic is partially lifted from https://maskray.me/blog/2021-10-31-relative-relocations-and-relr
-        uint64_t where = 0;
-        relr_i = 0;
-        for (size_t i = 0; i < relr_size / relr_ent; i++) {
-            uint64_t entry = *((uint64_t *)(elf + relr_offset + i * relr_ent));
-
-            if ((entry & 1) == 0) {
-                where = entry;
-                relocs[relr_i++]->r_addr = where;
-                where += 8;
-            } else {
-                for (size_t j = 0; (entry >>= 1) != 0; j++) {
-                    if ((entry & 1) != 0) {
-                        relocs[relr_i++]->r_addr = where + j * 8;
-                    }
-                }
-                where += 63 * 8;
-            }
-        }
+    r->rela_ent = rela_ent;
+
+    // The dynamic section does not give the size of the symbol table, so
+    // read as much of it as the relocations refer to.
+    uint64_t symbols = 0;
+    for (uint64_t offset = 0; offset + sizeof(struct elf64_rela) <= r->rela_size; offset += rela_ent) {
+        struct elf64_rela *relocation = (void *)r->rela + offset;
+        if (relocation->r_symbol >= symbols)
+            symbols = (uint64_t)relocation->r_symbol + 1;
+    }
+    for (uint64_t offset = 0; offset + sizeof(struct elf64_rela) <= r->jmprel_size; offset += rela_ent) {
+        struct elf64_rela *relocation = (void *)r->jmprel + offset;
+        if (relocation->r_symbol >= symbols)
+            symbols = (uint64_t)relocation->r_symbol + 1;
     }
 
-    if (rela_size != 0) {
-        for (uint64_t i = relr_count, offset = 0; offset < rela_size; offset += rela_ent) {
-            relocs[i++] = (void *)elf + (rela_offset + offset);
+    if (symtab_offset != 0 && symtab_ent != 0 && symbols != 0) {
+        if (symbols > UINT64_MAX / symtab_ent) {
+            panic(true, "elf: Symbol table lies outside of the file");
         }
+        r->symtab_ent = symtab_ent;
+        r->symtab_count = symbols;
+        r->symtab_size = symbols * symtab_ent;
+        r->symtab = elf64_read_table(fd, elf64_vaddr_to_offset(hdr, phdrs, symtab_offset), r->symtab_size, "Symbol table");
     }
+}
 
-    if (dt_pltrelsz != 0) {
-        for (uint64_t i = relr_count + rela_size / rela_ent, offset = 0; offset < dt_pltrelsz; offset += rela_ent) {
-            relocs[i++] = (void *)elf + (dt_jmprel + offset);
-        }
+static void elf64_free_relocs(struct elf64_relocs *r) {
+    if (r->symtab != NULL) {
+        pmm_free(r->symtab, r->symtab_size);
+    }
+    if (r->relr != NULL) {
+        pmm_free(r->relr, r->relr_size);
+    }
+    if (r->rela != NULL) {
+        pmm_free(r->rela, r->rela_size);
+    }
+    if (r->jmprel != NULL) {
+        pmm_free(r->jmprel, r->jmprel_size);
+    }
+}
+
+static void elf64_read_sym(struct elf64_relocs *r, uint32_t index, struct elf64_sym *sym) {
+    if (index >= r->symtab_count) {
+        panic(true, "elf: Relocation refers to a symbol outside of the symbol table");
+    }
+
+    memcpy(sym, r->symtab + r->symtab_ent * index, sizeof(struct elf64_sym));
+}
+
+// Where relocations get applied: either the PT_LOAD segments of an image
+// loaded at buffer, or, with no program headers, a single range of size bytes
+// starting at vaddr.
+struct elf64_reloc_target {
+    uint8_t *buffer;
+    uint64_t vaddr;
+    uint64_t size;
+
+    struct elf64_hdr *hdr;
+    uint8_t *phdrs;
+    uint16_t last;
+};
+
+static uint64_t *elf64_reloc_ptr(struct elf64_reloc_target *t, uint64_t addr) {
+    if (t->phdrs == NULL) {
+        if (addr < t->vaddr || t->vaddr + t->size < addr + 8)
+            return NULL;
+        return (uint64_t *)(t->buffer + (addr - t->vaddr));
     }
 
-    for (size_t i = 0; i < relocs_i; i++) {
-        struct elf64_rela *relocation = relocs[i];
+    // Relocations come mostly sorted, so start with the last segment hit
+    for (uint16_t n = 0, i = t->last; n < t->hdr->ph_num; n++, i = (i + 1) % t->hdr->ph_num) {
+        struct elf64_phdr *phdr = (void *)t->phdrs + i * t->hdr->phdr_size;
 
-        // Relocation is before buffer
-        if (relocation->r_addr < vaddr)
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0)
             continue;
 
-        // Relocation is after buffer
-        if (vaddr + size < relocation->r_addr + 8)
+        if (addr < phdr->p_vaddr || phdr->p_vaddr + phdr->p_memsz < addr + 8)
             continue;
 
-        // It's inside it, calculate where it is
-        uint64_t *ptr = (uint64_t *)((buffer - vaddr) + relocation->r_addr);
+        t->last = i;
+        return (uint64_t *)(t->buffer + (addr - t->vaddr));
+    }
+
+    return NULL;
+}
 
-        switch (relocation->r_info) {
+static void elf64_apply_rela(struct elf64_relocs *r, struct elf64_rela *relocation, uint64_t *ptr, uint64_t slide) {
+    switch (relocation->r_info) {
 #if defined (__x86_64__) || defined (__i386__)
-            case R_X86_64_NONE:
+        case R_X86_64_NONE:
 #elif defined (__aarch64__)
-            case R_AARCH64_NONE:
+        case R_AARCH64_NONE:
 #elif defined (__riscv)
-            case R_RISCV_NONE:
+        case R_RISCV_NONE:
 #elif defined (__loongarch64)
-            case R_LARCH_NONE:
+        case R_LARCH_NONE:
 #endif
-            {
-                break;
-            }
+        {
+            break;
+        }
 #if defined (__x86_64__) || defined (__i386__)
-            case R_X86_64_RELATIVE:
+        case R_X86_64_RELATIVE:
 #elif defined (__aarch64__)
-            case R_AARCH64_RELATIVE:
+        case R_AARCH64_RELATIVE:
 #elif defined (__riscv)
-            case R_RISCV_RELATIVE:
+        case R_RISCV_RELATIVE:
 #elif defined (__loongarch64)
-            case R_LARCH_RELATIVE:
+        case R_LARCH_RELATIVE:
 #endif
-            {
-                *ptr = slide + relocation->r_addend;
-                break;
-            }
-            case R_INTERNAL_RELR:
-            {
-                *ptr += slide;
-                break;
-            }
+        {
+            *ptr = slide + relocation->r_addend;
+            break;
+        }
 #if defined (__x86_64__) || defined (__i386__)
-            case R_X86_64_GLOB_DAT:
-            case R_X86_64_JUMP_SLOT:
+        case R_X86_64_GLOB_DAT:
+        case R_X86_64_JUMP_SLOT:
 #elif defined (__aarch64__)
-            case R_AARCH64_GLOB_DAT:
-            case R_AARCH64_JUMP_SLOT:
+        case R_AARCH64_GLOB_DAT:
+        case R_AARCH64_JUMP_SLOT:
 #elif defined (__riscv)
-            case R_RISCV_JUMP_SLOT:
+        case R_RISCV_JUMP_SLOT:
 #elif defined (__loongarch64)
-            case R_LARCH_JUMP_SLOT:
+        case R_LARCH_JUMP_SLOT:
 #endif
-            {
-                struct elf64_sym *s = (void *)elf + symtab_offset + symtab_ent * relocation->r_symbol;
-                if (s->st_shndx == SHN_UNDEF) {
-                    if ((s->st_info >> 4) == STB_WEAK) {
-                        *ptr = 0;
-                        break;
-                    }
-                    panic(true, "elf: Unresolved symbol");
+        {
+            struct elf64_sym s;
+            elf64_read_sym(r, relocation->r_symbol, &s);
+            if (s.st_shndx == SHN_UNDEF) {
+                if ((s.st_info >> 4) == STB_WEAK) {
+                    *ptr = 0;
+                    break;
                 }
-                *ptr = slide + s->st_value
+                panic(true, "elf: Unresolved symbol");
+            }
+            *ptr = slide + s.st_value
 #if defined (__aarch64__)
-                       + relocation->r_addend
+                   + relocation->r_addend
 #endif
-                ;
-                break;
-            }
+            ;
+            break;
+        }
 #if defined (__x86_64__) || defined (__i386__)
-            case R_X86_64_64:
+        case R_X86_64_64:
 #elif defined (__aarch64__)
-            case R_AARCH64_ABS64:
+        case R_AARCH64_ABS64:
 #elif defined (__riscv)
-            case R_RISCV_64:
+        case R_RISCV_64:
 #elif defined (__loongarch64)
-            case R_LARCH_64:
+        case R_LARCH_64:
 #endif
-            {
-                struct elf64_sym *s = (void *)elf + symtab_offset + symtab_ent * relocation->r_symbol;
-                if (s->st_shndx == SHN_UNDEF) {
-                    if ((s->st_info >> 4) == STB_WEAK) {
-                        *ptr = 0;
-                        break;
-                    }
-                    panic(true, "elf: Unresolved symbol");
+        {
+            struct elf64_sym s;
+            elf64_read_sym(r, relocation->r_symbol, &s);
+            if (s.st_shndx == SHN_UNDEF) {
+                if ((s.st_info >> 4) == STB_WEAK) {
+                    *ptr = 0;
+                    break;
                 }
-                *ptr = slide + s->st_value + relocation->r_addend;
-                break;
+                panic(true, "elf: Unresolved symbol");
             }
-            default: {
-                panic(true, "elf: Unknown relocation type: %x", relocation->r_info);
+            *ptr = slide + s.st_value + relocation->r_addend;
+            break;
+        }
+        default: {
+            panic(true, "elf: Unknown relocation type: %x", relocation->r_info);
+        }
+    }
+}
+
+static void elf64_apply_rela_table(struct elf64_relocs *r, struct elf64_reloc_target *t, uint8_t *table, uint64_t size, uint64_t slide) {
+    for (uint64_t offset = 0; offset + sizeof(struct elf64_rela) <= size; offset += r->rela_ent) {
+        struct elf64_rela *relocation = (void *)table + offset;
+
+        uint64_t *ptr = elf64_reloc_ptr(t, relocation->r_addr);
+        if (ptr == NULL)
+            continue;
+
+        elf64_apply_rela(r, relocation, ptr, slide);
+    }
+}
+
+// Applies every relocation in one go as it is decoded, RELR first, then RELA,
+// then the PLT ones, without building a list of them first.
+static void elf64_apply_relocations(struct elf64_relocs *r, struct elf64_reloc_target *t, uint64_t slide) {
+    // This logic is partially lifted from https://maskray.me/blog/2021-10-31-relative-relocations-and-relr
+    uint64_t where = 0;
+    for (uint64_t i = 0; i < r->relr_size / 8; i++) {
+        uint64_t entry = *((uint64_t *)(r->relr + i * 8));
+        uint64_t *ptr;
+
+        if ((entry & 1) == 0) {
+            where = entry;
+            if ((ptr = elf64_reloc_ptr(t, where)) != NULL) {
+                *ptr += slide;
             }
+            where += 8;
+        } else {
+            for (size_t j = 0; (entry >>= 1) != 0; j++) {
+                if ((entry & 1) != 0 && (ptr = elf64_reloc_ptr(t, where + j * 8)) != NULL) {
+                    *ptr += slide;
+                }
+            }
+            where += 63 * 8;
         }
     }
 
-    for (size_t i = 0; i < relr_count; i++) {
-        pmm_free(relocs[i], sizeof(struct elf64_rela));
+    if (r->rela_size != 0) {
+        elf64_apply_rela_table(r, t, r->rela, r->rela_size, slide);
     }
-    pmm_free(relocs, relocs_i * sizeof(struct elf64_rela *));
 
-    return true;
+    if (r->jmprel_size != 0) {
+        elf64_apply_rela_table(r, t, r->jmprel, r->jmprel_size, slide);
+    }
 }
 
-bool elf64_load_section(uint8_t *elf, void *buffer, const char *name, size_t limit, uint64_t slide) {
-    struct elf64_hdr *hdr = (void *)elf;
+bool elf64_load_section(struct file_handle *fd, void *buffer, const char *name, size_t limit, uint64_t slide) {
+    struct elf64_hdr hdr;
+    fread(fd, &hdr, 0, sizeof(struct elf64_hdr));
 
-    elf64_validate(hdr);
+    elf64_validate(&hdr);
 
-    if (hdr->sh_num == 0) {
+    if (hdr.sh_num == 0) {
         return false;
     }
 
-    if (hdr->shdr_size < sizeof(struct elf64_shdr)) {
+    if (hdr.shdr_size < sizeof(struct elf64_shdr)) {
         panic(true, "elf: shdr_size < sizeof(struct elf64_shdr)");
     }
 
-    struct elf64_shdr *shstrtab = (void *)elf + (hdr->shoff + hdr->shstrndx * hdr->shdr_size);
+    size_t shdrs_size = (size_t)hdr.sh_num * hdr.shdr_size;
+    uint8_t *shdrs = elf64_read_table(fd, hdr.shoff, shdrs_size, "Section header table");
 
-    char *names = (void *)elf + shstrtab->sh_offset;
+    if (hdr.shstrndx >= hdr.sh_num) {
+        panic(true, "elf: Section name table index out of range");
+    }
 
-    for (uint16_t i = 0; i < hdr->sh_num; i++) {
-        struct elf64_shdr *section = (void *)elf + (hdr->shoff + i * hdr->shdr_size);
+    struct elf64_shdr *shstrtab = (void *)shdrs + hdr.shstrndx * hdr.shdr_size;
 
-        if (strcmp(&names[section->sh_name], name) == 0) {
-            if (limit == 0) {
-                *(void **)buffer = ext_mem_alloc(section->sh_size);
-                buffer = *(void **)buffer;
-                limit = section->sh_size;
-            }
-            if (section->sh_size > limit) {
-                return false;
-            }
-            memcpy(buffer, elf + section->sh_offset, section->sh_size);
-            return elf64_apply_relocations(elf, hdr, buffer, section->sh_addr, section->sh_size, slide);
-        }
+    if (shstrtab->sh_offset + shstrtab->sh_size < shstrtab->sh_offset
+     || shstrtab->sh_offset + shstrtab->sh_size > fd->size) {
+        panic(true, "elf: Section name table lies outside of the file");
     }
 
-    return false;
-}
+    // One spare byte so that the last name is always terminated
+    size_t names_size = shstrtab->sh_size + 1;
+    char *names = ext_mem_alloc(names_size);
+    fread(fd, names, shstrtab->sh_offset, shstrtab->sh_size);
 
-static uint64_t elf64_max_align(uint8_t *elf) {
-    uint64_t ret = 0;
+    bool ret = false;
 
-    struct elf64_hdr *hdr = (void *)elf;
+    for (uint16_t i = 0; i < hdr.sh_num; i++) {
+        struct elf64_shdr *section = (void *)shdrs + i * hdr.shdr_size;
 
-    if (hdr->phdr_size < sizeof(struct elf64_phdr)) {
-        panic(true, "elf: phdr_size < sizeof(struct elf64_phdr)");
+        if (section->sh_name >= shstrtab->sh_size
+         || strcmp(&names[section->sh_name], name) != 0) {
+            continue;
+        }
+
+        if (limit == 0) {
+            *(void **)buffer = ext_mem_alloc(section->sh_size);
+            buffer = *(void **)buffer;
+            limit = section->sh_size;
+        }
+        if (section->sh_size > limit) {
+            break;
+        }
+        fread(fd, buffer, section->sh_offset, section->sh_size);
+
+        uint8_t *phdrs = elf64_read_phdrs(fd, &hdr);
+        struct elf64_relocs relocs;
+        elf64_read_relocs(fd, &hdr, phdrs, &relocs);
+        struct elf64_reloc_target target = {
+            .buffer = buffer,
+            .vaddr = section->sh_addr,
+            .size = section->sh_size
+        };
+        elf64_apply_relocations(&relocs, &target, slide);
+        ret = true;
+        elf64_free_relocs(&relocs);
+        pmm_free(phdrs, (size_t)hdr.ph_num * hdr.phdr_size);
+        break;
     }
 
+    pmm_free(names, names_size);
+    pmm_free(shdrs, shdrs_size);
+
+    return ret;
+}
+
+static uint64_t elf64_max_align(struct elf64_hdr *hdr, uint8_t *phdrs) {
+    uint64_t ret = 0;
+
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
@@ -626,19 +746,13 @@ static uint64_t elf64_max_align(uint8_t *elf) {
     return ret;
 }
 
-static void elf64_get_ranges(uint8_t *elf, uint64_t slide, struct elf_range **_ranges, uint64_t *_ranges_count) {
-    struct elf64_hdr *hdr = (void *)elf;
-
+static void elf64_get_ranges(struct elf64_hdr *hdr, uint8_t *phdrs, uint64_t slide, struct elf_range **_ranges, uint64_t *_ranges_count) {
     uint64_t ranges_count = 0;
 
-    if (hdr->phdr_size < sizeof(struct elf64_phdr)) {
-        panic(true, "elf: phdr_size < sizeof(struct elf64_phdr)");
-    }
-
-    bool is_reloc = elf64_is_relocatable(elf, hdr);
+    bool is_reloc = elf64_is_relocatable(hdr, phdrs);
 
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
@@ -661,7 +775,7 @@ static void elf64_get_ranges(uint8_t *elf, uint64_t slide, struct elf_range **_r
 
     size_t r = 0;
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
@@ -687,8 +801,15 @@ static void elf64_get_ranges(uint8_t *elf, uint64_t slide, struct elf_range **_r
     *_ranges = ranges;
 }
 
-bool elf64_load(uint8_t *elf, uint64_t *entry_point, uint64_t *_slide, uint32_t alloc_type, bool kaslr, struct elf_range **ranges, uint64_t *ranges_count, uint64_t *physical_base, uint64_t *virtual_base, uint64_t *_image_size, uint64_t *_image_size_before_bss, bool *is_reloc) {
-    struct elf64_hdr *hdr = (void *)elf;
+bool elf64_load(struct file_handle *fd, uint64_t *entry_point, uint64_t *_slide, uint32_t alloc_type, bool kaslr, struct elf_range **ranges, uint64_t *ranges_count, uint64_t *physical_base, uint64_t *virtual_base, uint64_t *_image_size, uint64_t *_image_size_before_bss, bool *is_reloc) {
+    struct elf64_hdr hdr_buf;
+    struct elf64_hdr *hdr = &hdr_buf;
+
+    if (fd->size < sizeof(struct elf64_hdr)) {
+        panic(true, "elf: File too small to be an ELF file");
+    }
+
+    fread(fd, hdr, 0, sizeof(struct elf64_hdr));
 
     elf64_validate(hdr);
 
@@ -696,10 +817,14 @@ bool elf64_load(uint8_t *elf, uint64_t *entry_point, uint64_t *_slide, uint32_t
         panic(true, "elf: ELF file not of type ET_EXEC nor ET_DYN");
     }
 
+    // Only the headers and dynamic tables are kept around, segment contents
+    // are read from the file straight into the loaded image.
+    uint8_t *phdrs = elf64_read_phdrs(fd, hdr);
+
     if (is_reloc) {
         *is_reloc = false;
     }
-    if (elf64_is_relocatable(elf, hdr)) {
+    if (elf64_is_relocatable(hdr, phdrs)) {
         if (is_reloc) {
             *is_reloc = true;
         }
@@ -711,20 +836,16 @@ bool elf64_load(uint8_t *elf, uint64_t *entry_point, uint64_t *_slide, uint32_t
 
     uint64_t entry = hdr->entry;
 
-    uint64_t max_align = elf64_max_align(elf);
+    uint64_t max_align = elf64_max_align(hdr, phdrs);
 
     uint64_t image_size = 0;
 
-    if (hdr->phdr_size < sizeof(struct elf64_phdr)) {
-        panic(true, "elf: phdr_size < sizeof(struct elf64_phdr)");
-    }
-
     bool lower_to_higher = false;
 
     uint64_t min_vaddr = (uint64_t)-1;
     uint64_t max_vaddr = 0;
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
@@ -743,7 +864,7 @@ bool elf64_load(uint8_t *elf, uint64_t *entry_point, uint64_t *_slide, uint32_t
 
         // check for overlapping phdrs
         for (uint16_t j = 0; j < hdr->ph_num; j++) {
-            struct elf64_phdr *phdr_in = (void *)elf + (hdr->phoff + j * hdr->phdr_size);
+            struct elf64_phdr *phdr_in = (void *)phdrs + j * hdr->phdr_size;
 
             if (phdr_in->p_type != PT_LOAD || phdr_in->p_memsz == 0) {
                 continue;
@@ -826,7 +947,7 @@ again:
     uint64_t bss_size = 0;
 
     for (uint16_t i = 0; i < hdr->ph_num; i++) {
-        struct elf64_phdr *phdr = (void *)elf + (hdr->phoff + i * hdr->phdr_size);
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
 
         if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
             continue;
@@ -837,30 +958,51 @@ again:
             panic(true, "elf: p_filesz > p_memsz");
         }
 
+        if (phdr->p_offset + phdr->p_filesz > fd->size) {
+            panic(true, "elf: Segment lies outside of the file");
+        }
+
         uint64_t load_addr = *physical_base + (phdr->p_vaddr - *virtual_base);
 
+        fread(fd, (void *)(uintptr_t)load_addr, phdr->p_offset, phdr->p_filesz);
+
+        bss_size = phdr->p_memsz - phdr->p_filesz;
+    }
+
+    // All segments are in place, relocate the whole image in one pass
+    struct elf64_relocs relocs;
+    elf64_read_relocs(fd, hdr, phdrs, &relocs);
+
+    struct elf64_reloc_target target = {
+        .buffer = (void *)(uintptr_t)*physical_base,
+        .vaddr = *virtual_base,
+        .hdr = hdr,
+        .phdrs = phdrs
+    };
+    elf64_apply_relocations(&relocs, &target, slide);
+
+    elf64_free_relocs(&relocs);
+
 #if defined (__aarch64__)
+    for (uint16_t i = 0; i < hdr->ph_num; i++) {
+        struct elf64_phdr *phdr = (void *)phdrs + i * hdr->phdr_size;
+
+        if (phdr->p_type != PT_LOAD || phdr->p_memsz == 0) {
+            continue;
+        }
+
+        uint64_t load_addr = *physical_base + (phdr->p_vaddr - *virtual_base);
         uint64_t this_top = load_addr + phdr->p_memsz;
 
         uint64_t mem_base, mem_size;
 
         mem_base = load_addr & ~(phdr->p_align - 1);
         mem_size = this_top - mem_base;
-#endif
-
-        memcpy((void *)(uintptr_t)load_addr, elf + (phdr->p_offset), phdr->p_filesz);
 
-        bss_size = phdr->p_memsz - phdr->p_filesz;
-
-        if (!elf64_apply_relocations(elf, hdr, (void *)(uintptr_t)load_addr, phdr->p_vaddr, phdr->p_memsz, slide)) {
-            panic(true, "elf: Failed to apply relocations");
-        }
-
-#if defined (__aarch64__)
         clean_dcache_poc(mem_base, mem_base + mem_size);
         inval_icache_pou(mem_base, mem_base + mem_size);
-#endif
     }
+#endif
 
     if (_image_size_before_bss != NULL) {
         *_image_size_before_bss = image_size - bss_size;
@@ -873,9 +1015,11 @@ again:
     }
 
     if (ranges_count != NULL && ranges != NULL) {
-        elf64_get_ranges(elf, slide, ranges, ranges_count);
+        elf64_get_ranges(hdr, phdrs, slide, ranges, ranges_count);
     }
 
+    pmm_free(phdrs, (size_t)hdr->ph_num * hdr->phdr_size);
+
     return true;
 }
 
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <lib/guid.h>
+#include <drivers/disk.h>
 #if defined (UEFI)
 #  include <efi.h>
 #  include <crypt/blake2b.h>
@@ -14,6 +15,18 @@
 #define INVALID_TABLE (-2)
 #define END_OF_TABLE  (-3)
 
+#define DEFAULT_VOLUME_CACHE_SLOTS 8
+#define VOLUME_READAHEAD_SIZE 0x80000
+
+struct volume_cache_slot {
+    bool valid;
+    uint64_t block;
+    uint64_t last_used;
+    uint8_t *buf;
+};
+
+struct dentry_cache;
+
 struct volume {
 #if defined (UEFI)
     EFI_HANDLE efi_handle;
@@ -21,6 +34,8 @@ struct volume {
     // Block storage
     EFI_HANDLE efi_part_handle;
     EFI_BLOCK_IO *block_io;
+    // Only set when the firmware provides queued reads for this drive
+    EFI_BLOCK_IO2_PROTOCOL *block_io2;
 
     // PXE
     EFI_PXE_BASE_CODE_PROTOCOL *pxe_base_code;
@@ -29,9 +44,17 @@ struct volume {
     uint8_t unique_sector_b2b[BLAKE2B_OUT_BYTES];
 #elif defined (BIOS)
     int drive;
+    bool edd_flat_addr;
+
+    bool xfer_size_tuned;
+    size_t xfer_best_size;
+    uint64_t xfer_best_cost;
+    uint64_t xfer_tune_ticks;
+    size_t xfer_tune_samples;
 #endif
 
     size_t fastest_xfer_size;
+    size_t max_xfer_size;
 
     int index;
 
@@ -43,14 +66,52 @@ struct volume {
     struct volume *backing_dev;
 
     int max_partition;
-
-    int cache_status;
-    uint8_t *cache;
-    uint64_t cached_block;
+    bool parts_scanned;
+
+    // Where the volume sits in volume_index, kept up to date as partitions
+    // are inserted before it
+    size_t index_pos;
+
+    // Block cache, only present on the whole-disk volume and shared with
+    // every partition backed by it.
+    size_t cache_slot_count;
+    struct volume_cache_slot *cache_slots;
+    size_t cache_block_size;
+    uint64_t cache_ticks;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+
+    // Read-ahead window, filled with a single large read once sequential
+    // access is detected. Also only present on the whole-disk volume.
+    uint8_t *readahead_buf;
+    uint64_t readahead_block;
+    size_t readahead_count;
+    size_t readahead_window;
+    uint64_t readahead_next;
+    size_t readahead_streak;
+    uint64_t direct_reads;
+
+    // On drives with queued reads, the window after the current one is read
+    // in the background while the current one is used.
+    uint8_t *prefetch_buf;
+    struct disk_request prefetch_req;
+    uint64_t prefetch_block;
+    size_t prefetch_count;
 
     uint64_t first_sect;
     uint64_t sect_count;
 
+    // Filesystem found on the volume and its driver context, both only
+    // valid once fs_probed is set
+    bool fs_probed;
+    int fs_type;
+    void *fs_ctx;
+
+    // Path component lookups already resolved on this volume, see fs/file.h
+    struct dentry_cache *dentry_cache;
+
+    // guid and fslabel are only valid after volume_probe_ids()
+    bool ids_probed;
     bool guid_valid;
     struct guid guid;
     bool part_guid_valid;
@@ -64,6 +125,17 @@ bool is_valid_mbr(struct volume *volume);
 extern struct volume **volume_index;
 extern size_t volume_index_i;
 
+void volume_index_add(struct volume *volume);
+void volume_index_scan_all(void);
+
+// Returning to the menu rewinds the memory map to what it was when the menu
+// first came up. volume_index_save() records the volumes known at that point,
+// volume_index_rewind() brings the index back to them and drops what was
+// found out about them since.
+void volume_index_save(void);
+void volume_index_rewind(void);
+void volume_probe_ids(struct volume *volume);
+
 bool gpt_get_guid(struct guid *guid, struct volume *volume);
 uint32_t mbr_get_id(struct volume *volume);
 
@@ -78,6 +150,51 @@ struct volume *volume_get_by_bios_drive(int drive);
 
 bool volume_read(struct volume *part, void *buffer, uint64_t loc, uint64_t count);
 
+// A volume read started with volume_read_submit(). The buffer may still be
+// being written to until volume_read_wait() has returned, which has to be
+// called once submitting succeeded.
+struct volume_read_req {
+    struct volume *volume;
+    void *buffer;
+    uint64_t loc;
+    uint64_t count;
+    uint64_t progress;
+
+    // Whole blocks being read straight into the buffer
+    void *direct_buf;
+    uint64_t direct_lba;
+    uint64_t direct_sectors;
+    uint64_t direct_submitted;
+    uint64_t direct_done;
+    bool direct_failed;
+    size_t direct_head, direct_tail;
+    struct disk_request direct_reqs[DISK_MAX_INFLIGHT];
+};
+
+bool volume_read_submit(struct volume *part, struct volume_read_req *req,
+                        void *buffer, uint64_t loc, uint64_t count);
+bool volume_read_wait(struct volume_read_req *req);
+
+// Lets filesystems keep the reads of several extents of a file in flight.
+// Failures are reported by volume_queue_wait(), which waits for everything
+// that was queued.
+#define VOLUME_QUEUE_DEPTH 2
+
+struct volume_read_queue {
+    struct volume_read_req reqs[VOLUME_QUEUE_DEPTH];
+    size_t head, tail;
+    bool ok;
+};
+
+void volume_queue_init(struct volume_read_queue *queue);
+void volume_queue_read(struct volume_read_queue *queue, struct volume *part,
+                       void *buffer, uint64_t loc, uint64_t count);
+bool volume_queue_wait(struct volume_read_queue *queue);
+
+void volume_cache_set_slots(size_t slots);
+void volume_cache_quiesce(void);
+void volume_cache_print_stats(const char *when);
+
 #define volume_iterate_parts(_VOLUME_, _BODY_) do {   \
     struct volume *_VOLUME = _VOLUME_;   \
     if (_VOLUME->pxe) { \
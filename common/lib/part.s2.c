@@ -11,66 +11,359 @@
 #include <mm/pmm.h>
 #include <fs/file.h>
 
-enum {
-    CACHE_NOT_READY = 0,
-    CACHE_READY
-};
+static size_t volume_cache_slots = DEFAULT_VOLUME_CACHE_SLOTS;
 
-static bool cache_block(struct volume *volume, uint64_t block) {
-    if (volume->cache_status == CACHE_READY && block == volume->cached_block)
-        return true;
+static struct volume *cache_owner(struct volume *volume) {
+    while (volume->backing_dev != NULL) {
+        volume = volume->backing_dev;
+    }
 
-    volume->cache_status = CACHE_NOT_READY;
+    return volume;
+}
 
-    if (volume->cache == NULL)
-        volume->cache =
-            ext_mem_alloc(volume->fastest_xfer_size * volume->sector_size);
+static void prefetch_cancel(struct volume *disk) {
+    if (disk->prefetch_count != 0) {
+        disk_complete(&disk->prefetch_req);
+        disk->prefetch_count = 0;
+    }
+}
 
-    if (volume->first_sect % (volume->sector_size / 512)) {
-        return false;
+static void cache_flush(struct volume *disk) {
+    prefetch_cancel(disk);
+    if (disk->prefetch_buf != NULL) {
+        pmm_free(disk->prefetch_buf, VOLUME_READAHEAD_SIZE);
+        disk->prefetch_buf = NULL;
+    }
+
+    if (disk->readahead_buf != NULL) {
+        pmm_free(disk->readahead_buf, VOLUME_READAHEAD_SIZE);
+        disk->readahead_buf = NULL;
+    }
+    disk->readahead_count = 0;
+    disk->readahead_window = 0;
+
+    if (disk->cache_slots == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < disk->cache_slot_count; i++) {
+        if (disk->cache_slots[i].buf != NULL) {
+            pmm_free(disk->cache_slots[i].buf, disk->cache_block_size);
+        }
+    }
+
+    pmm_free(disk->cache_slots,
+             disk->cache_slot_count * sizeof(struct volume_cache_slot));
+
+    disk->cache_slots = NULL;
+    disk->cache_slot_count = 0;
+}
+
+// Like cache_flush(), but without giving the buffers back: after a return to
+// the menu they are either already free again or from before the menu came up.
+static void cache_forget(struct volume *disk) {
+    prefetch_cancel(disk);
+    disk->prefetch_buf = NULL;
+
+    disk->readahead_buf = NULL;
+    disk->readahead_count = 0;
+    disk->readahead_window = 0;
+
+    disk->cache_slots = NULL;
+    disk->cache_slot_count = 0;
+}
+
+static size_t readahead_next_window(struct volume *disk) {
+    size_t max_window = VOLUME_READAHEAD_SIZE / disk->cache_block_size;
+
+    if (disk->readahead_window == 0) {
+        return 2;
+    }
+
+    return disk->readahead_window * 2 < max_window ? disk->readahead_window * 2 : max_window;
+}
+
+// Queue the read of the window following the current one, so that it
+// arrives while the current one is copied out and parsed. Only done on
+// drives where the read really happens in the background, elsewhere it
+// would just make the current fill twice as long.
+static void prefetch_next(struct volume *disk) {
+    if (!disk_can_queue(disk)) {
+        return;
+    }
+
+    if (disk->prefetch_buf == NULL) {
+        disk->prefetch_buf = ext_mem_alloc(VOLUME_READAHEAD_SIZE);
+    }
+
+    disk->prefetch_block = disk->readahead_block + disk->readahead_count;
+    disk->prefetch_count = readahead_next_window(disk);
+
+    if (disk_read_sectors_async(disk, &disk->prefetch_req, disk->prefetch_buf,
+                                disk->prefetch_block * disk->fastest_xfer_size,
+                                disk->prefetch_count * disk->fastest_xfer_size) != DISK_SUCCESS) {
+        disk->prefetch_count = 0;
+    }
+}
+
+// Once a few blocks in a row have been requested in order, the next miss
+// fills the read-ahead window with one large read starting at the missed
+// block. The window doubles with every consecutive fill, up to
+// VOLUME_READAHEAD_SIZE.
+static uint8_t *readahead_block(struct volume *disk, uint64_t block) {
+    size_t max_window = VOLUME_READAHEAD_SIZE / disk->cache_block_size;
+
+    if (max_window < 2 || disk->readahead_streak < 2) {
+        return NULL;
+    }
+
+    if (disk->readahead_buf == NULL) {
+        disk->readahead_buf = ext_mem_alloc(VOLUME_READAHEAD_SIZE);
+    }
+
+    // The block may already be on its way
+    if (disk->prefetch_count != 0
+     && block >= disk->prefetch_block && block - disk->prefetch_block < disk->prefetch_count) {
+        size_t count = disk->prefetch_count;
+        disk->prefetch_count = 0;
+
+        if (disk_complete(&disk->prefetch_req) == DISK_SUCCESS) {
+            uint8_t *buf = disk->readahead_buf;
+            disk->readahead_buf = disk->prefetch_buf;
+            disk->prefetch_buf = buf;
+
+            disk->readahead_block = disk->prefetch_block;
+            disk->readahead_count = count;
+            disk->readahead_window = count;
+
+            prefetch_next(disk);
+
+            return disk->readahead_buf
+                 + (block - disk->readahead_block) * disk->cache_block_size;
+        }
+    }
+
+    prefetch_cancel(disk);
+
+    disk->readahead_window = readahead_next_window(disk);
+
+    disk->readahead_count = 0;
+
+    if (disk_read_sectors(disk, disk->readahead_buf,
+                          block * disk->fastest_xfer_size,
+                          disk->readahead_window * disk->fastest_xfer_size) != DISK_SUCCESS) {
+        // Most likely ran past the end of the disk, let the slots deal with it
+        disk->readahead_window = 0;
+        return NULL;
     }
 
-    uint64_t first_sect = volume->first_sect / (volume->sector_size / 512);
+    disk->readahead_block = block;
+    disk->readahead_count = disk->readahead_window;
 
-    uint64_t xfer_size = volume->fastest_xfer_size;
+    prefetch_next(disk);
+
+    return disk->readahead_buf;
+}
+
+// Blocks are indexed from the start of the disk, not of the partition, so
+// that all partitions of a disk can share the same cache slots.
+static uint8_t *cache_block(struct volume *volume, uint64_t block) {
+    struct volume *disk = cache_owner(volume);
+
+    // The transfer size, and with it the block size, can change at runtime
+    size_t block_size = disk->fastest_xfer_size * disk->sector_size;
+    if (disk->cache_slots != NULL && disk->cache_block_size != block_size) {
+        cache_flush(disk);
+    }
+
+    if (disk->cache_slots == NULL) {
+        disk->cache_slot_count = volume_cache_slots;
+        disk->cache_slots =
+            ext_mem_alloc(disk->cache_slot_count * sizeof(struct volume_cache_slot));
+        disk->cache_block_size = block_size;
+    }
+
+    if (block == disk->readahead_next) {
+        disk->readahead_streak++;
+    } else if (block + 1 != disk->readahead_next) {
+        disk->readahead_streak = 0;
+        disk->readahead_window = 0;
+    }
+    disk->readahead_next = block + 1;
+
+    if (block >= disk->readahead_block
+     && block - disk->readahead_block < disk->readahead_count) {
+        disk->cache_hits++;
+        return disk->readahead_buf
+             + (block - disk->readahead_block) * disk->cache_block_size;
+    }
+
+    // Invalid slots have a last_used of 0, so they are picked first.
+    struct volume_cache_slot *victim = &disk->cache_slots[0];
+
+    for (size_t i = 0; i < disk->cache_slot_count; i++) {
+        struct volume_cache_slot *slot = &disk->cache_slots[i];
+
+        if (slot->valid && slot->block == block) {
+            slot->last_used = ++disk->cache_ticks;
+            disk->cache_hits++;
+            return slot->buf;
+        }
+
+        if (slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+
+    disk->cache_misses++;
+
+    uint8_t *window = readahead_block(disk, block);
+    if (window != NULL) {
+        return window;
+    }
+
+    if (victim->buf == NULL)
+        victim->buf = ext_mem_alloc(disk->cache_block_size);
+
+    victim->valid = false;
+    victim->last_used = 0;
+
+    uint64_t xfer_size = disk->fastest_xfer_size;
 
     for (;;) {
-        int ret = disk_read_sectors(volume, volume->cache,
-                           first_sect + block * volume->fastest_xfer_size,
+        int ret = disk_read_sectors(disk, victim->buf,
+                           block * disk->fastest_xfer_size,
                            xfer_size);
 
         switch (ret) {
             case DISK_NO_MEDIA:
-                return false;
+                return NULL;
             case DISK_SUCCESS:
                 goto disk_success;
         }
 
         xfer_size--;
         if (xfer_size == 0) {
-            return false;
+            return NULL;
         }
     }
 
 disk_success:
-    volume->cache_status = CACHE_READY;
-    volume->cached_block = block;
+    victim->valid = true;
+    victim->block = block;
+    victim->last_used = ++disk->cache_ticks;
+
+    return victim->buf;
+}
+
+static bool can_read_direct(struct volume *disk, void *buf) {
+    if (disk->max_xfer_size < disk->fastest_xfer_size) {
+        return false;
+    }
+
+#if defined (UEFI)
+    uint32_t io_align = disk->block_io->Media->IoAlign;
+    if (io_align > 1 && (uintptr_t)buf % io_align != 0) {
+        return false;
+    }
+#elif defined (BIOS)
+    (void)buf;
+#endif
 
     return true;
 }
 
-bool volume_read(struct volume *volume, void *buffer, uint64_t loc, uint64_t count) {
-    if (volume->pxe) {
-        panic(false, "Attempted volume_read() on pxe");
+// Queue transfers of the run of whole blocks being read straight into the
+// caller's buffer, until DISK_MAX_INFLIGHT of them are in flight.
+static void read_direct_submit(struct volume *disk, struct volume_read_req *req) {
+    while (!req->direct_failed && req->direct_tail - req->direct_head < DISK_MAX_INFLIGHT
+        && req->direct_submitted < req->direct_sectors) {
+        uint64_t chunk = req->direct_sectors - req->direct_submitted;
+        if (chunk > disk->max_xfer_size)
+            chunk = disk->max_xfer_size;
+
+        if (disk_read_sectors_async(disk, &req->direct_reqs[req->direct_tail % DISK_MAX_INFLIGHT],
+                                    req->direct_buf + req->direct_submitted * disk->sector_size,
+                                    req->direct_lba + req->direct_submitted, chunk) != DISK_SUCCESS) {
+            req->direct_failed = true;
+            break;
+        }
+
+        req->direct_submitted += chunk;
+        req->direct_tail++;
+    }
+}
+
+// Wait for the rest of the run, keeping the queue full. Returns the number of
+// bytes read without error from the start of the run.
+static uint64_t read_direct_wait(struct volume *disk, struct volume_read_req *req) {
+    for (;;) {
+        read_direct_submit(disk, req);
+
+        if (req->direct_head == req->direct_tail)
+            break;
+
+        // Requests are waited for in submission order, so everything that
+        // succeeded before the first failure is usable.
+        struct disk_request *dreq = &req->direct_reqs[req->direct_head++ % DISK_MAX_INFLIGHT];
+        if (disk_complete(dreq) != DISK_SUCCESS) {
+            req->direct_failed = true;
+        } else if (!req->direct_failed) {
+            disk->direct_reads++;
+            req->direct_done += dreq->count;
+        }
     }
 
-    uint64_t block_size = volume->fastest_xfer_size * volume->sector_size;
+    req->direct_sectors = 0;
+
+    return req->direct_done * disk->sector_size;
+}
+
+static void read_direct_start(struct volume *disk, struct volume_read_req *req,
+                              void *buf, uint64_t lba, uint64_t sectors) {
+    req->direct_buf = buf;
+    req->direct_lba = lba;
+    req->direct_sectors = sectors;
+    req->direct_submitted = 0;
+    req->direct_done = 0;
+    req->direct_failed = false;
+    req->direct_head = 0;
+    req->direct_tail = 0;
+
+    read_direct_submit(disk, req);
+}
+
+// Synchronously read count bytes at loc, counted from the start of the disk.
+static bool read_span(struct volume *volume, void *buffer, uint64_t loc, uint64_t count) {
+    struct volume *disk = cache_owner(volume);
+
+    uint64_t block_size = disk->fastest_xfer_size * volume->sector_size;
 
     uint64_t progress = 0;
     while (progress < count) {
         uint64_t block = (loc + progress) / block_size;
 
-        if (!cache_block(volume, block))
+        // Spans of whole blocks are read straight into the caller's buffer,
+        // only the unaligned head and tail go through the cache.
+        if ((loc + progress) % block_size == 0 && count - progress >= block_size
+         && can_read_direct(disk, buffer + progress)) {
+            uint64_t sectors = ((count - progress) / block_size) * disk->fastest_xfer_size;
+
+            struct volume_read_req req;
+            read_direct_start(disk, &req, buffer + progress,
+                              (loc + progress) / volume->sector_size, sectors);
+
+            uint64_t done = read_direct_wait(disk, &req);
+            if (done != 0) {
+                progress += done;
+                continue;
+            }
+
+            // Let the cached path deal with short reads at the end of the disk
+        }
+
+        uint8_t *cache = cache_block(volume, block);
+        if (cache == NULL)
             return false;
 
         uint64_t chunk = count - progress;
@@ -78,13 +371,168 @@ bool volume_read(struct volume *volume, void *buffer, uint64_t loc, uint64_t cou
         if (chunk > block_size - offset)
             chunk = block_size - offset;
 
-        memcpy(buffer + progress, &volume->cache[offset], chunk);
+        memcpy(buffer + progress, &cache[offset], chunk);
         progress += chunk;
     }
 
     return true;
 }
 
+// The unaligned head of the range is read from the cache before returning.
+// The whole blocks after it are queued to be read straight into the buffer,
+// and the tail is left to volume_read_wait(), so that the caller can get on
+// with other work while the bulk of the data is being transferred.
+bool volume_read_submit(struct volume *volume, struct volume_read_req *req,
+                        void *buffer, uint64_t loc, uint64_t count) {
+    if (volume->pxe) {
+        panic(false, "Attempted volume_read() on pxe");
+    }
+
+    if (volume->first_sect % (volume->sector_size / 512)) {
+        return false;
+    }
+
+    struct volume *disk = cache_owner(volume);
+
+#if defined (BIOS)
+    disk_tune_xfer_size(disk);
+#endif
+
+    uint64_t block_size = disk->fastest_xfer_size * volume->sector_size;
+
+    loc += volume->first_sect * 512;
+
+    req->volume = volume;
+    req->buffer = buffer;
+    req->loc = loc;
+    req->count = count;
+    req->direct_sectors = 0;
+
+    uint64_t head = (block_size - loc % block_size) % block_size;
+    if (head > count)
+        head = count;
+
+    if (!read_span(volume, buffer, loc, head)) {
+        return false;
+    }
+
+    req->progress = head;
+
+    if (count - head >= block_size && can_read_direct(disk, buffer + head)) {
+        read_direct_start(disk, req, buffer + head, (loc + head) / volume->sector_size,
+                          ((count - head) / block_size) * disk->fastest_xfer_size);
+    }
+
+    return true;
+}
+
+bool volume_read_wait(struct volume_read_req *req) {
+    if (req->direct_sectors != 0) {
+        req->progress += read_direct_wait(cache_owner(req->volume), req);
+    }
+
+    // The tail, and anything the queued transfers did not manage to read
+    return read_span(req->volume, req->buffer + req->progress,
+                     req->loc + req->progress, req->count - req->progress);
+}
+
+bool volume_read(struct volume *volume, void *buffer, uint64_t loc, uint64_t count) {
+    struct volume_read_req req;
+
+    if (!volume_read_submit(volume, &req, buffer, loc, count)) {
+        return false;
+    }
+
+    return volume_read_wait(&req);
+}
+
+void volume_queue_init(struct volume_read_queue *queue) {
+    queue->head = 0;
+    queue->tail = 0;
+    queue->ok = true;
+}
+
+// Once VOLUME_QUEUE_DEPTH reads are in flight, the oldest one is waited for
+// before the next one is submitted.
+void volume_queue_read(struct volume_read_queue *queue, struct volume *volume,
+                       void *buffer, uint64_t loc, uint64_t count) {
+    if (queue->tail - queue->head == VOLUME_QUEUE_DEPTH) {
+        if (!volume_read_wait(&queue->reqs[queue->head++ % VOLUME_QUEUE_DEPTH])) {
+            queue->ok = false;
+        }
+    }
+
+    if (!volume_read_submit(volume, &queue->reqs[queue->tail % VOLUME_QUEUE_DEPTH],
+                            buffer, loc, count)) {
+        queue->ok = false;
+        return;
+    }
+
+    queue->tail++;
+}
+
+bool volume_queue_wait(struct volume_read_queue *queue) {
+    while (queue->head != queue->tail) {
+        if (!volume_read_wait(&queue->reqs[queue->head++ % VOLUME_QUEUE_DEPTH])) {
+            queue->ok = false;
+        }
+    }
+
+    bool ok = queue->ok;
+    queue->ok = true;
+    return ok;
+}
+
+void volume_cache_set_slots(size_t slots) {
+    if (slots == 0) {
+        slots = 1;
+    }
+
+    if (slots == volume_cache_slots) {
+        return;
+    }
+
+    volume_cache_slots = slots;
+
+    // Drop the existing caches, they get reallocated with the new size on
+    // the next read.
+    for (size_t i = 0; i < volume_index_i; i++) {
+        if (volume_index[i]->backing_dev == NULL) {
+            cache_flush(volume_index[i]);
+        }
+    }
+}
+
+// Waits for the reads queued in the background on every disk. Nothing may be
+// left in flight once a boot entry hands memory over or exits boot services.
+void volume_cache_quiesce(void) {
+    for (size_t i = 0; i < volume_index_i; i++) {
+        if (volume_index[i]->backing_dev == NULL) {
+            prefetch_cancel(volume_index[i]);
+        }
+    }
+}
+
+void volume_cache_print_stats(const char *when) {
+    for (size_t i = 0; i < volume_index_i; i++) {
+        struct volume *disk = volume_index[i];
+
+        if (disk->backing_dev != NULL) {
+            continue;
+        }
+
+        if (disk->cache_hits != 0 || disk->cache_misses != 0 || disk->direct_reads != 0) {
+            printv("disk: %s: %s drive %u: %U cache hits, %U cache misses, %U direct reads\n",
+                   when, disk->is_optical ? "optical" : "hard", disk->index,
+                   disk->cache_hits, disk->cache_misses, disk->direct_reads);
+        }
+
+        disk->cache_hits = 0;
+        disk->cache_misses = 0;
+        disk->direct_reads = 0;
+    }
+}
+
 struct gpt_table_header {
     // the head
     char     signature[8];
@@ -213,22 +661,6 @@ static int gpt_get_part(struct volume *ret, struct volume *volume, int partition
     ret->sect_count  = ((entry.ending_lba - entry.starting_lba) + 1) * (lb_size / 512);
     ret->backing_dev = volume;
 
-    struct guid guid;
-    if (!fs_get_guid(&guid, ret)) {
-        ret->guid_valid = false;
-    } else {
-        ret->guid_valid = true;
-        ret->guid = guid;
-    }
-
-    char *fslabel = fs_get_label(ret);
-    if (fslabel == NULL) {
-        ret->fslabel_valid = false;
-    } else {
-        ret->fslabel_valid = true;
-        ret->fslabel = fslabel;
-    }
-
     ret->part_guid_valid = true;
     ret->part_guid = entry.unique_partition_guid;
 
@@ -335,22 +767,6 @@ static int mbr_get_logical_part(struct volume *ret, struct volume *extended_part
     ret->sect_count  = entry.sect_count;
     ret->backing_dev = extended_part->backing_dev;
 
-    struct guid guid;
-    if (!fs_get_guid(&guid, ret)) {
-        ret->guid_valid = false;
-    } else {
-        ret->guid_valid = true;
-        ret->guid = guid;
-    }
-
-    char *fslabel = fs_get_label(ret);
-    if (fslabel == NULL) {
-        ret->fslabel_valid = false;
-    } else {
-        ret->fslabel_valid = true;
-        ret->fslabel = fslabel;
-    }
-
     ret->part_guid_valid = false;
 
     return 0;
@@ -417,22 +833,6 @@ static int mbr_get_part(struct volume *ret, struct volume *volume, int partition
     ret->sect_count  = entry.sect_count;
     ret->backing_dev = volume;
 
-    struct guid guid;
-    if (!fs_get_guid(&guid, ret)) {
-        ret->guid_valid = false;
-    } else {
-        ret->guid_valid = true;
-        ret->guid = guid;
-    }
-
-    char *fslabel = fs_get_label(ret);
-    if (fslabel == NULL) {
-        ret->fslabel_valid = false;
-    } else {
-        ret->fslabel_valid = true;
-        ret->fslabel = fslabel;
-    }
-
     ret->part_guid_valid = false;
 
     return 0;
@@ -454,43 +854,409 @@ int part_get(struct volume *part, struct volume *volume, int partition) {
 
 struct volume **volume_index = NULL;
 size_t volume_index_i = 0;
+static size_t volume_index_size = 0;
 
-struct volume *volume_get_by_guid(struct guid *guid) {
-    for (size_t i = 0; i < volume_index_i; i++) {
-        if (volume_index[i]->guid_valid
-         && memcmp(&volume_index[i]->guid, guid, 16) == 0) {
-            return volume_index[i];
-        }
-        if (volume_index[i]->part_guid_valid
-         && memcmp(&volume_index[i]->part_guid, guid, 16) == 0) {
-            return volume_index[i];
+// Every volume before this position in volume_index has had its partitions
+// scanned and its GUIDs and label probed
+static size_t volume_index_probed_upto = 0;
+
+// Open addressing hash tables mapping a key (coordinates, GUID, or label)
+// to a volume. Entries are never removed.
+struct volume_map_entry {
+    uint64_t hash;
+    struct volume *volume;
+};
+
+struct volume_map {
+    struct volume_map_entry *entries;
+    size_t size;
+    size_t count;
+};
+
+typedef bool (*volume_map_match_t)(struct volume *volume, const void *key);
+
+static struct volume_map coord_map, guid_map, fslabel_map;
+
+static uint64_t volume_map_hash(const void *key, size_t len) {
+    const uint8_t *p = key;
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+static struct volume_map_entry *volume_map_lookup(struct volume_map *map, uint64_t hash,
+                                                   volume_map_match_t match, const void *key) {
+    if (map->size == 0) {
+        return NULL;
+    }
+
+    for (size_t i = hash & (map->size - 1); map->entries[i].volume != NULL;
+         i = (i + 1) & (map->size - 1)) {
+        if (map->entries[i].hash == hash && match(map->entries[i].volume, key)) {
+            return &map->entries[i];
         }
     }
 
     return NULL;
 }
 
-struct volume *volume_get_by_fslabel(char *fslabel) {
+static struct volume *volume_map_find(struct volume_map *map, uint64_t hash,
+                                      volume_map_match_t match, const void *key) {
+    struct volume_map_entry *entry = volume_map_lookup(map, hash, match, key);
+
+    return entry != NULL ? entry->volume : NULL;
+}
+
+// Volumes that are not in the index sort after all that are
+static size_t volume_index_pos(struct volume *volume) {
+    size_t pos = volume->index_pos;
+    if (pos < volume_index_i && volume_index[pos] == volume) {
+        return pos;
+    }
+    return volume_index_i;
+}
+
+static void volume_map_put(struct volume_map *map, uint64_t hash, struct volume *volume) {
+    size_t i = hash & (map->size - 1);
+    while (map->entries[i].volume != NULL) {
+        i = (i + 1) & (map->size - 1);
+    }
+
+    map->entries[i].hash = hash;
+    map->entries[i].volume = volume;
+    map->count++;
+}
+
+// If the key is already present, the volume that comes first in
+// volume_index is kept, just like a linear search of the index would find.
+// Volumes are probed lazily and in no particular order, so this is not
+// necessarily the one inserted first.
+static void volume_map_insert(struct volume_map *map, uint64_t hash, struct volume *volume,
+                              volume_map_match_t match, const void *key) {
+    struct volume_map_entry *entry = volume_map_lookup(map, hash, match, key);
+    if (entry != NULL) {
+        if (entry->volume != volume
+         && volume_index_pos(volume) < volume_index_pos(entry->volume)) {
+            entry->volume = volume;
+        }
+        return;
+    }
+
+    // Keep the load factor under 3/4
+    if ((map->count + 1) * 4 > map->size * 3) {
+        struct volume_map old = *map;
+
+        map->size = old.size == 0 ? 64 : old.size * 2;
+        map->count = 0;
+        map->entries = ext_mem_alloc(map->size * sizeof(struct volume_map_entry));
+
+        for (size_t i = 0; i < old.size; i++) {
+            if (old.entries[i].volume != NULL) {
+                volume_map_put(map, old.entries[i].hash, old.entries[i].volume);
+            }
+        }
+
+        if (old.entries != NULL) {
+            pmm_free(old.entries, old.size * sizeof(struct volume_map_entry));
+        }
+    }
+
+    volume_map_put(map, hash, volume);
+}
+
+static uint64_t coord_key(bool optical, int drive, int partition) {
+    return ((uint64_t)optical << 63) | ((uint64_t)(uint32_t)drive << 32) | (uint32_t)partition;
+}
+
+static bool coord_match(struct volume *volume, const void *key) {
+    return coord_key(volume->is_optical, volume->index, volume->partition) == *(const uint64_t *)key;
+}
+
+static bool guid_match(struct volume *volume, const void *key) {
+    return (volume->guid_valid && memcmp(&volume->guid, key, 16) == 0)
+        || (volume->part_guid_valid && memcmp(&volume->part_guid, key, 16) == 0);
+}
+
+static bool fslabel_match(struct volume *volume, const void *key) {
+    return volume->fslabel_valid && strcmp(volume->fslabel, key) == 0;
+}
+
+static void volume_index_insert(size_t pos, struct volume *volume) {
+    if (volume_index_i == volume_index_size) {
+        size_t new_size = volume_index_size == 0 ? 64 : volume_index_size * 2;
+        struct volume **new_index = ext_mem_alloc(new_size * sizeof(struct volume *));
+
+        if (volume_index != NULL) {
+            memcpy(new_index, volume_index, volume_index_i * sizeof(struct volume *));
+            pmm_free(volume_index, volume_index_size * sizeof(struct volume *));
+        }
+
+        volume_index = new_index;
+        volume_index_size = new_size;
+    }
+
+    for (size_t i = volume_index_i; i > pos; i--) {
+        volume_index[i] = volume_index[i - 1];
+        volume_index[i]->index_pos = i;
+    }
+
+    volume_index[pos] = volume;
+    volume->index_pos = pos;
+    volume_index_i++;
+
+    if (pos < volume_index_probed_upto) {
+        volume_index_probed_upto = pos;
+    }
+
+    uint64_t coord = coord_key(volume->is_optical, volume->index, volume->partition);
+    volume_map_insert(&coord_map, volume_map_hash(&coord, sizeof(coord)),
+                      volume, coord_match, &coord);
+
+    if (volume->part_guid_valid) {
+        volume_map_insert(&guid_map, volume_map_hash(&volume->part_guid, 16),
+                          volume, guid_match, &volume->part_guid);
+    }
+}
+
+void volume_index_add(struct volume *volume) {
+    volume_index_insert(volume_index_i, volume);
+}
+
+// Partitions are only looked for the first time something asks for them.
+// They are inserted right after their drive so that volume_index keeps the
+// same order as if everything had been enumerated upfront.
+static void volume_scan_parts(struct volume *volume) {
+    if (volume->parts_scanned) {
+        return;
+    }
+
+    volume->parts_scanned = true;
+
+    size_t pos = volume_index_pos(volume) + 1;
+
+    for (int part = 0; ; part++) {
+        struct volume _p = {0};
+
+        int ret = part_get(&_p, volume, part);
+
+        if (ret == END_OF_TABLE || ret == INVALID_TABLE)
+            break;
+        if (ret == NO_PARTITION)
+            continue;
+
+        struct volume *p = ext_mem_alloc(sizeof(struct volume));
+        memcpy(p, &_p, sizeof(struct volume));
+
+        volume_index_insert(pos++, p);
+
+        volume->max_partition++;
+    }
+}
+
+static bool volume_index_scanned = false;
+
+void volume_index_scan_all(void) {
+    if (volume_index_scanned) {
+        return;
+    }
+
+    volume_index_scanned = true;
+
+    // volume_index grows while scanning, but partitions never need scanning
     for (size_t i = 0; i < volume_index_i; i++) {
-        if (volume_index[i]->fslabel_valid
-         && strcmp(volume_index[i]->fslabel, fslabel) == 0) {
-            return volume_index[i];
+        if (volume_index[i]->backing_dev == NULL && !volume_index[i]->pxe) {
+            volume_scan_parts(volume_index[i]);
         }
     }
+}
 
-    return NULL;
+static bool volume_index_probed = false;
+
+static void volume_index_probe_all(void) {
+    if (volume_index_probed) {
+        return;
+    }
+
+    volume_index_probed = true;
+
+    volume_index_scan_all();
+
+    for (size_t i = 0; i < volume_index_i; i++) {
+        volume_probe_ids(volume_index[i]);
+    }
+}
+
+void volume_probe_ids(struct volume *volume) {
+    if (volume->ids_probed || volume->pxe) {
+        return;
+    }
+
+    volume->ids_probed = true;
+
+    if (volume->backing_dev == NULL) {
+        volume->guid_valid = gpt_get_guid(&volume->guid, volume);
+    } else {
+        volume->guid_valid = fs_get_guid(&volume->guid, volume);
+
+        volume->fslabel = fs_get_label(volume);
+        volume->fslabel_valid = volume->fslabel != NULL;
+    }
+
+    if (volume->guid_valid) {
+        volume_map_insert(&guid_map, volume_map_hash(&volume->guid, 16),
+                          volume, guid_match, &volume->guid);
+    }
+
+    if (volume->fslabel_valid) {
+        volume_map_insert(&fslabel_map, volume_map_hash(volume->fslabel, strlen(volume->fslabel)),
+                          volume, fslabel_match, volume->fslabel);
+    }
+}
+
+// A volume found in a map only wins if nothing before it in volume_index
+// has the same GUID or label, so everything before it gets probed first.
+// Scanning a drive inserts its partitions right after it, which moves the
+// volume further down while this runs.
+static void volume_index_probe_before(struct volume *volume) {
+    while (volume_index_probed_upto < volume_index_pos(volume)) {
+        struct volume *v = volume_index[volume_index_probed_upto];
+
+        if (v->backing_dev == NULL && !v->pxe) {
+            volume_scan_parts(v);
+        }
+
+        volume_probe_ids(v);
+
+        volume_index_probed_upto++;
+    }
+}
+
+struct volume *volume_get_by_guid(struct guid *guid) {
+    uint64_t hash = volume_map_hash(guid, 16);
+
+    struct volume *ret = volume_map_find(&guid_map, hash, guid_match, guid);
+    if (ret != NULL) {
+        volume_index_probe_before(ret);
+        return volume_map_find(&guid_map, hash, guid_match, guid);
+    }
+
+    volume_index_probe_all();
+
+    return volume_map_find(&guid_map, hash, guid_match, guid);
+}
+
+struct volume *volume_get_by_fslabel(char *fslabel) {
+    uint64_t hash = volume_map_hash(fslabel, strlen(fslabel));
+
+    struct volume *ret = volume_map_find(&fslabel_map, hash, fslabel_match, fslabel);
+    if (ret != NULL) {
+        volume_index_probe_before(ret);
+        return volume_map_find(&fslabel_map, hash, fslabel_match, fslabel);
+    }
+
+    volume_index_probe_all();
+
+    return volume_map_find(&fslabel_map, hash, fslabel_match, fslabel);
 }
 
 struct volume *volume_get_by_coord(bool optical, int drive, int partition) {
-    for (size_t i = 0; i < volume_index_i; i++) {
-        if (volume_index[i]->index == drive
-         && volume_index[i]->is_optical == optical
-         && volume_index[i]->partition == partition) {
-            return volume_index[i];
+    uint64_t coord = coord_key(optical, drive, 0);
+
+    struct volume *disk = volume_map_find(&coord_map, volume_map_hash(&coord, sizeof(coord)),
+                                          coord_match, &coord);
+    if (disk == NULL) {
+        return NULL;
+    }
+
+    // Always scan, callers iterating partitions rely on max_partition
+    volume_scan_parts(disk);
+
+    if (partition == 0) {
+        return disk;
+    }
+
+    coord = coord_key(optical, drive, partition);
+
+    return volume_map_find(&coord_map, volume_map_hash(&coord, sizeof(coord)),
+                           coord_match, &coord);
+}
+
+struct saved_volume {
+    struct volume *volume;
+    bool parts_scanned;
+    int max_partition;
+};
+
+static struct saved_volume *saved_volumes;
+static size_t saved_volume_count;
+
+void volume_index_save(void) {
+    saved_volume_count = volume_index_i;
+    if (saved_volume_count == 0) {
+        return;
+    }
+
+    saved_volumes = ext_mem_alloc(saved_volume_count * sizeof(struct saved_volume));
+
+    for (size_t i = 0; i < saved_volume_count; i++) {
+        saved_volumes[i].volume = volume_index[i];
+        saved_volumes[i].parts_scanned = volume_index[i]->parts_scanned;
+        saved_volumes[i].max_partition = volume_index[i]->max_partition;
+    }
+}
+
+// The index and the lookup maps may have been reallocated, or had partitions
+// inserted into them, in memory that is free again now, so they are built
+// anew. Partitions scanned since are found again when asked for.
+void volume_index_rewind(void) {
+    // A failed entry may have left a read queued into a buffer that is free
+    // again now
+    for (size_t i = 0; i < saved_volume_count; i++) {
+        if (saved_volumes[i].volume->backing_dev == NULL) {
+            cache_forget(saved_volumes[i].volume);
         }
     }
 
-    return NULL;
+    volume_index = NULL;
+    volume_index_i = 0;
+    volume_index_size = 0;
+
+    coord_map = (struct volume_map){0};
+    guid_map = (struct volume_map){0};
+    fslabel_map = (struct volume_map){0};
+
+    volume_index_probed = false;
+    volume_index_probed_upto = 0;
+
+    for (size_t i = 0; i < saved_volume_count; i++) {
+        struct volume *volume = saved_volumes[i].volume;
+
+        volume->parts_scanned = saved_volumes[i].parts_scanned;
+        volume->max_partition = saved_volumes[i].max_partition;
+
+        // Filesystem contexts built since hold memory that is free again,
+        // and ones from before may have been changed to point into it
+        volume->fs_probed = false;
+        volume->fs_type = FS_NONE;
+        volume->fs_ctx = NULL;
+
+        // Cached lookups go with the contexts, ISO9660 ones point right
+        // into its directories
+        volume->dentry_cache = NULL;
+
+        // The label may have been read into memory that is gone
+        volume->ids_probed = false;
+        volume->guid_valid = false;
+        volume->fslabel_valid = false;
+        volume->fslabel = NULL;
+
+        volume_index_add(volume);
+    }
 }
 
 #if defined (BIOS)
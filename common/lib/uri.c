@@ -238,8 +238,7 @@ struct file_handle *uri_open(char *uri) {
 
     if (hash != NULL && ret != NULL) {
         uint8_t out_buf[BLAKE2B_OUT_BYTES];
-        void *file_buf = freadall(ret, MEMMAP_BOOTLOADER_RECLAIMABLE);
-        blake2b(out_buf, file_buf, ret->size);
+        freadall_blake2b(ret, MEMMAP_BOOTLOADER_RECLAIMABLE, out_buf);
         uint8_t hash_buf[BLAKE2B_OUT_BYTES];
 
         for (size_t i = 0; i < sizeof(hash_buf); i++) {
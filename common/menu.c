@@ -13,6 +13,7 @@
 #include <lib/getchar.h>
 #include <lib/uri.h>
 #include <mm/pmm.h>
+#include <drivers/disk.h>
 #include <drivers/vbe.h>
 #include <drivers/vga_textmode.h>
 #include <protos/linux.h>
@@ -615,6 +616,7 @@ skip_line:
 
 static struct memmap_entry *rewound_memmap = NULL;
 static size_t rewound_memmap_entries = 0;
+static bool rewound_memmap_ordered;
 static no_unwind uint8_t *rewound_data;
 #if defined (BIOS)
 static no_unwind uint8_t *rewound_s2_data;
@@ -720,7 +722,13 @@ noreturn void _menu(bool first_run) {
 #endif
         memcpy(memmap, rewound_memmap, rewound_memmap_entries * sizeof(struct memmap_entry));
         memmap_entries = rewound_memmap_entries;
+        memmap_ordered = rewound_memmap_ordered;
+
+        pmm_rewind_slabs();
+        volume_index_rewind();
     } else {
+        volume_index_save();
+
         rewound_data = ext_mem_alloc(data_size);
 #if defined (BIOS)
         rewound_s2_data = ext_mem_alloc(s2_data_size);
@@ -730,6 +738,7 @@ noreturn void _menu(bool first_run) {
         rewound_memmap = ext_mem_alloc((memmap_entries + 16) * sizeof(struct memmap_entry));
         memcpy(rewound_memmap, memmap, memmap_entries * sizeof(struct memmap_entry));
         rewound_memmap_entries = memmap_entries;
+        rewound_memmap_ordered = memmap_ordered;
         memcpy(rewound_data, data_begin, data_size);
 #if defined (BIOS)
         memcpy(rewound_s2_data, s2_data_begin, s2_data_size);
@@ -760,6 +769,18 @@ noreturn void _menu(bool first_run) {
     char *verbose_str = config_get_value(NULL, 0, "VERBOSE");
     verbose = verbose_str != NULL && strcmp(verbose_str, "yes") == 0;
 
+    char *disk_cache_size_str = config_get_value(NULL, 0, "DISK_CACHE_SIZE");
+    if (disk_cache_size_str != NULL) {
+        volume_cache_set_slots(strtoui(disk_cache_size_str, NULL, 10));
+    }
+
+#if defined (BIOS)
+    char *disk_xfer_size_str = config_get_value(NULL, 0, "DISK_XFER_SIZE");
+    if (disk_xfer_size_str != NULL) {
+        disk_set_xfer_size(strtoui(disk_xfer_size_str, NULL, 10));
+    }
+#endif
+
     char *serial_str = config_get_value(NULL, 0, "SERIAL");
     serial = serial_str != NULL && strcmp(serial_str, "yes") == 0;
 
@@ -1170,6 +1191,8 @@ timeout_aborted:
 }
 
 noreturn void boot(char *config) {
+    volume_cache_print_stats("before boot entry");
+
     char *cmdline = config_get_value(config, 0, "KERNEL_CMDLINE");
     if (!cmdline) {
         cmdline = config_get_value(config, 0, "CMDLINE");
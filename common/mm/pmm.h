@@ -42,6 +42,7 @@ extern struct memmap_entry *untouched_memmap;
 extern size_t untouched_memmap_entries;
 #endif
 
+extern bool memmap_ordered;
 extern bool allocations_disallowed;
 
 void init_memmap(void);
@@ -61,6 +62,7 @@ void *ext_mem_alloc_type_aligned_mode(size_t count, uint32_t type, size_t alignm
 void *conv_mem_alloc(size_t count);
 
 void pmm_free(void *ptr, size_t length);
+void pmm_rewind_slabs(void);
 
 #if defined (UEFI)
 void pmm_release_uefi_mem(void);
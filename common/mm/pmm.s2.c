@@ -38,8 +38,6 @@ void *conv_mem_alloc(size_t count) {
             memset(ret, 0, count);
             base += count;
 
-            sanitise_entries(memmap, &memmap_entries, false);
-
             return ret;
         }
 
@@ -64,6 +62,12 @@ struct memmap_entry *untouched_memmap;
 size_t untouched_memmap_entries = 0;
 #endif
 
+// Whether memmap is sorted with no overlapping or empty entries. Worked out
+// by sanitise_entries() and kept by memmap_carve().
+bool memmap_ordered = false;
+
+static bool memmap_is_ordered(struct memmap_entry *m, size_t count);
+
 static const char *memmap_type(uint32_t type) {
     switch (type) {
         case MEMMAP_USABLE:
@@ -225,6 +229,10 @@ del_mm1:
     }
 
     *_count = count;
+
+    if (m == memmap) {
+        memmap_ordered = memmap_is_ordered(m, count);
+    }
 }
 
 #if defined (UEFI)
@@ -546,10 +554,167 @@ struct memmap_entry *get_raw_memmap(size_t *entry_count) {
 }
 #endif
 
+// Small bootloader reclaimable allocations are served from slabs instead of
+// each taking (and splitting) a page of the memory map. A slab is a page
+// holding objects of a single power of two size, with its header at the
+// start; slab pages come from arenas taken from the memory map a few pages
+// at a time. Objects are aligned to their size and never start a page, which
+// is how pmm_free() tells them apart from page allocations.
+#define SLAB_MIN_SHIFT 4
+#define SLAB_MAX_SHIFT 10
+#define SLAB_MAX_SIZE ((size_t)1 << SLAB_MAX_SHIFT)
+#define SLAB_CLASSES (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAGIC 0x51ab51ab
+#define SLAB_ARENA_PAGES 16
+
+struct slab {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t used;
+    uint32_t bump;      // offset of the first object never handed out
+    uint32_t generation;
+    void *free_list;
+    struct slab *prev;
+    struct slab *next;
+};
+
+// Slabs with room left, per size class
+static struct slab *slab_partial[SLAB_CLASSES];
+// Arena pages not holding a slab
+static void *slab_free_pages;
+// Bumped every time the slabs are abandoned, see pmm_rewind_slabs()
+static no_unwind uint32_t slab_generation;
+
+static bool slab_full(struct slab *slab) {
+    return slab->free_list == NULL && slab->bump + slab->size > PAGE_SIZE;
+}
+
+static void slab_link(struct slab *slab, size_t class) {
+    slab->prev = NULL;
+    slab->next = slab_partial[class];
+    if (slab->next != NULL)
+        slab->next->prev = slab;
+    slab_partial[class] = slab;
+}
+
+static void slab_unlink(struct slab *slab, size_t class) {
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        slab_partial[class] = slab->next;
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+    slab->prev = slab->next = NULL;
+}
+
+static struct slab *slab_new(size_t class) {
+    if (slab_free_pages == NULL) {
+        uint8_t *arena = ext_mem_alloc_type_aligned(SLAB_ARENA_PAGES * PAGE_SIZE,
+                                                    MEMMAP_BOOTLOADER_RECLAIMABLE, PAGE_SIZE);
+        for (size_t i = 0; i < SLAB_ARENA_PAGES; i++) {
+            void **page = (void **)(arena + i * PAGE_SIZE);
+            *page = slab_free_pages;
+            slab_free_pages = page;
+        }
+    }
+
+    struct slab *slab = slab_free_pages;
+    slab_free_pages = *(void **)slab;
+
+    slab->magic = SLAB_MAGIC;
+    slab->size = (uint32_t)1 << (class + SLAB_MIN_SHIFT);
+    slab->used = 0;
+    slab->bump = ALIGN_UP(sizeof(struct slab), slab->size);
+    slab->generation = slab_generation;
+    slab->free_list = NULL;
+    slab_link(slab, class);
+
+    return slab;
+}
+
+static void *slab_alloc(size_t count) {
+    size_t class = 0;
+    while (((size_t)1 << (class + SLAB_MIN_SHIFT)) < count)
+        class++;
+
+    // Only slabs with room are linked, but bump allocating past the end of
+    // the page would hand out someone else's memory
+    struct slab *slab = slab_partial[class];
+    while (slab != NULL && slab_full(slab)) {
+        slab_unlink(slab, class);
+        slab = slab_partial[class];
+    }
+    if (slab == NULL)
+        slab = slab_new(class);
+
+    void *ret;
+    if (slab->free_list != NULL) {
+        ret = slab->free_list;
+        slab->free_list = *(void **)ret;
+    } else {
+        ret = (uint8_t *)slab + slab->bump;
+        slab->bump += slab->size;
+    }
+    slab->used++;
+
+    if (slab_full(slab))
+        slab_unlink(slab, class);
+
+    memset(ret, 0, slab->size);
+    return ret;
+}
+
+static bool slab_free(void *ptr) {
+    if (((uintptr_t)ptr & (PAGE_SIZE - 1)) == 0)
+        return false;
+
+    struct slab *slab = (struct slab *)ALIGN_DOWN((uintptr_t)ptr, PAGE_SIZE);
+    if (slab->magic != SLAB_MAGIC)
+        return false;
+
+    // Abandoned slabs are left alone, like any memory from before the menu
+    // came up
+    if (slab->generation != slab_generation)
+        return true;
+
+    size_t class = __builtin_ctz(slab->size) - SLAB_MIN_SHIFT;
+
+    if (slab_full(slab))
+        slab_link(slab, class);
+
+    *(void **)ptr = slab->free_list;
+    slab->free_list = ptr;
+    slab->used--;
+
+    // Keep one empty slab per class around, give the others back to the arena
+    if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        slab_unlink(slab, class);
+        slab->magic = 0;
+        *(void **)slab = slab_free_pages;
+        slab_free_pages = slab;
+    }
+
+    return true;
+}
+
+// Returning to the menu restores the slab lists along with the rest of .data
+// and .bss, but not the headers and free lists kept inside the slab pages,
+// which may have changed since or be in memory that is free again. So every
+// slab is abandoned: objects already in them stay where they are, new ones
+// come from new arenas.
+void pmm_rewind_slabs(void) {
+    for (size_t i = 0; i < SLAB_CLASSES; i++)
+        slab_partial[i] = NULL;
+    slab_free_pages = NULL;
+    slab_generation++;
+}
+
 void pmm_free(void *ptr, size_t count) {
     count = ALIGN_UP(count, 4096);
     if (allocations_disallowed)
         panic(false, "Memory allocations disallowed");
+    if (slab_free(ptr))
+        return;
     memmap_alloc_range((uintptr_t)ptr, count, MEMMAP_USABLE, 0, false, false, true);
 }
 
@@ -558,9 +723,17 @@ void *ext_mem_alloc(size_t count) {
 }
 
 void *ext_mem_alloc_type(size_t count, uint32_t type) {
+    if (type == MEMMAP_BOOTLOADER_RECLAIMABLE && count != 0 && count <= SLAB_MAX_SIZE) {
+        if (allocations_disallowed)
+            panic(false, "Memory allocations disallowed");
+        return slab_alloc(count);
+    }
+
     return ext_mem_alloc_type_aligned(count, type, 4096);
 }
 
+// Allocations asking for an alignment of their own never come from the slabs.
+
 void *ext_mem_alloc_type_aligned(size_t count, uint32_t type, size_t alignment) {
     return ext_mem_alloc_type_aligned_mode(count, type, alignment, false);
 }
@@ -619,8 +792,6 @@ void *ext_mem_alloc_type_aligned_mode(size_t count, uint32_t type, size_t alignm
         }
 #endif
 
-        sanitise_entries(memmap, &memmap_entries, false);
-
         return ret;
     }
 
@@ -724,6 +895,141 @@ static bool pmm_new_entry(struct memmap_entry *m, size_t *_count,
     return true;
 }
 
+// Once sanitised, a memory map is normally sorted by base with no two entries
+// overlapping. Firmware may hand over overlapping or empty reserved entries
+// though, and those maps keep going through pmm_new_entry() and
+// sanitise_entries(). For memmap itself the answer is kept in memmap_ordered,
+// other maps are only allocated from a handful of times and get checked.
+static bool memmap_is_ordered(struct memmap_entry *m, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (m[i].length == 0)
+            return false;
+        if (i > 0 && m[i].base < m[i - 1].base + m[i - 1].length)
+            return false;
+    }
+
+    return true;
+}
+
+static bool memmap_mergeable(struct memmap_entry *a, struct memmap_entry *b) {
+    return (a->type == MEMMAP_USABLE || a->type == MEMMAP_BOOTLOADER_RECLAIMABLE)
+        && a->type == b->type
+        && a->base + a->length == b->base;
+}
+
+static void memmap_remove(struct memmap_entry *m, size_t *count, size_t i) {
+    memmove(&m[i], &m[i + 1], (*count - i - 1) * sizeof(struct memmap_entry));
+    (*count)--;
+}
+
+// Number of entries starting at or below base.
+static size_t memmap_find(struct memmap_entry *m, size_t count, uint64_t base) {
+    size_t lo = 0, hi = count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m[mid].base <= base)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Lays [base, base + length) over an ordered map as one entry of the given
+// type. Only the entries the range touches get trimmed, split or dropped, and
+// only the new entry's neighbours can coalesce with it, so the map stays in
+// the same shape sanitise_entries() would leave it in without rescanning and
+// resorting all of it.
+static void memmap_carve(struct memmap_entry *m, size_t *_count,
+                         uint64_t base, uint64_t length, uint32_t type) {
+    size_t count = *_count;
+    uint64_t top = base + length;
+
+    // Entries from lo up to hi overlap the range
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (m[mid].base + m[mid].length > base)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    hi = count;
+    for (size_t l = lo; l < hi; ) {
+        size_t mid = l + (hi - l) / 2;
+        if (m[mid].base >= top)
+            hi = mid;
+        else
+            l = mid + 1;
+    }
+
+    struct memmap_entry pieces[3];
+    size_t piece_count = 0;
+
+    if (lo < hi && m[lo].base < base) {
+        pieces[piece_count].base = m[lo].base;
+        pieces[piece_count].length = base - m[lo].base;
+        pieces[piece_count].type = m[lo].type;
+        piece_count++;
+    }
+
+    size_t k = lo + piece_count;
+    pieces[piece_count].base = base;
+    pieces[piece_count].length = length;
+    pieces[piece_count].type = type;
+    piece_count++;
+
+    if (lo < hi && m[hi - 1].base + m[hi - 1].length > top) {
+        pieces[piece_count].base = top;
+        pieces[piece_count].length = m[hi - 1].base + m[hi - 1].length - top;
+        pieces[piece_count].type = m[hi - 1].type;
+        piece_count++;
+    }
+
+    if (count - (hi - lo) + piece_count > memmap_max_entries)
+        panic(false, "Memory map exhausted.");
+
+    memmove(&m[lo + piece_count], &m[hi], (count - hi) * sizeof(struct memmap_entry));
+    for (size_t i = 0; i < piece_count; i++) {
+        m[lo + i].base = pieces[i].base;
+        m[lo + i].length = pieces[i].length;
+        m[lo + i].type = pieces[i].type;
+        m[lo + i].unused = 0;
+    }
+    count = count - (hi - lo) + piece_count;
+
+    if (k + 1 < count && memmap_mergeable(&m[k], &m[k + 1])) {
+        m[k].length += m[k + 1].length;
+        memmap_remove(m, &count, k + 1);
+    }
+    if (k > 0 && memmap_mergeable(&m[k - 1], &m[k])) {
+        m[k - 1].length += m[k].length;
+        memmap_remove(m, &count, k);
+    }
+
+    // Usable memory below 0x1000 is never handed out, these can only be at
+    // the very start of the map.
+    for (size_t i = 0; !sanitiser_keep_first_page && i < count && m[i].base < 0x1000; ) {
+        if (m[i].type != MEMMAP_USABLE) {
+            i++;
+            continue;
+        }
+
+        if (m[i].base + m[i].length <= 0x1000) {
+            memmap_remove(m, &count, i);
+            continue;
+        }
+
+        m[i].length -= 0x1000 - m[i].base;
+        m[i].base = 0x1000;
+        i++;
+    }
+
+    *_count = count;
+}
+
 bool memmap_alloc_range_in(struct memmap_entry *m, size_t *_count,
                            uint64_t base, uint64_t length, uint32_t type, uint32_t overlay_type, bool do_panic, bool simulation, bool new_entry) {
     size_t count = *_count;
@@ -737,6 +1043,28 @@ bool memmap_alloc_range_in(struct memmap_entry *m, size_t *_count,
 
     uint64_t top = base + length;
 
+    if (m == memmap ? memmap_ordered : memmap_is_ordered(m, count)) {
+        // Only the last entry starting at or below base can hold the range
+        size_t i = memmap_find(m, count, base) - 1;
+
+        bool fits = i < count
+                 && (overlay_type == 0 || m[i].type == overlay_type)
+                 && base < m[i].base + m[i].length
+                 && top <= m[i].base + m[i].length;
+
+        if (fits && simulation)
+            return true;
+
+        if (!fits && !new_entry) {
+            if (do_panic)
+                panic(false, "Memory allocation failure.");
+            return false;
+        }
+
+        memmap_carve(m, _count, base, length, type);
+        return true;
+    }
+
     for (size_t i = 0; i < count; i++) {
         if (overlay_type != 0 && m[i].type != overlay_type)
             continue;
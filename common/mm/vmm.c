@@ -20,9 +20,48 @@ static uint64_t page_sizes[5] = {
     0x1000000000000,
 };
 
+// Page tables are handed out from one contiguous, zeroed pool that
+// map_range() sizes before it starts mapping, instead of one allocation per
+// table. Each map_range() call has a pool of its own, as the 1GiB page
+// emulation on x86 calls it again from inside map_page(). Without a pool, or
+// once it runs dry, tables are allocated one by one.
+struct table_pool {
+    pt_entry_t *next;
+    size_t count;
+};
+
+static void release_tables(struct table_pool *pool) {
+    if (pool->count > 0)
+        pmm_free(pool->next, pool->count * PT_SIZE);
+
+    pool->count = 0;
+}
+
+static void reserve_tables(struct table_pool *pool, size_t count) {
+    pool->next = NULL;
+    pool->count = 0;
+
+    if (count == 0)
+        return;
+
+    pool->next = ext_mem_alloc(count * PT_SIZE);
+    pool->count = count;
+}
+
+static pt_entry_t *alloc_table(struct table_pool *pool) {
+    if (pool == NULL || pool->count == 0)
+        return ext_mem_alloc(PT_SIZE);
+
+    pt_entry_t *ret = pool->next;
+    pool->next += PT_SIZE / sizeof(pt_entry_t);
+    pool->count--;
+    return ret;
+}
+
 static pt_entry_t *get_next_level(pagemap_t pagemap, pt_entry_t *current_level,
                                   uint64_t virt, enum page_size desired_sz,
-                                  size_t level_idx, size_t entry);
+                                  size_t level_idx, size_t entry,
+                                  struct table_pool *pool);
 
 #if defined (__x86_64__) || defined (__i386__)
 
@@ -36,17 +75,14 @@ static pt_entry_t *get_next_level(pagemap_t pagemap, pt_entry_t *current_level,
 #define PT_TABLE_FLAGS   (PT_FLAG_VALID | PT_FLAG_WRITE | PT_FLAG_USER)
 #define PT_IS_TABLE(x) (((x) & (PT_FLAG_VALID | PT_FLAG_LARGE)) == PT_FLAG_VALID)
 #define PT_IS_LARGE(x) (((x) & (PT_FLAG_VALID | PT_FLAG_LARGE)) == (PT_FLAG_VALID | PT_FLAG_LARGE))
-#define PT_TO_VMM_FLAGS(x) ((x) & (PT_FLAG_WRITE | PT_FLAG_NX))
+#define PT_TO_VMM_FLAGS(x) ((x) & (PT_FLAG_WRITE | PT_FLAG_NX | VMM_FLAG_FB))
 
 #define pte_new(addr, flags)    ((pt_entry_t)(addr) | (flags))
 #define pte_addr(pte)           ((pte) & PT_PADDR_MASK)
+// Large pages keep their PAT bit where 4KiB pages have an address bit
+#define pte_large_addr(pte)     ((pte) & PT_PADDR_MASK & ~((uint64_t)1 << 12))
 
-pagemap_t new_pagemap(int paging_mode) {
-    pagemap_t pagemap;
-    pagemap.levels    = paging_mode == PAGING_MODE_X86_64_5LVL ? 5 : 4;
-    pagemap.top_level = ext_mem_alloc(PT_SIZE);
-    return pagemap;
-}
+static bool pat_supported = false;
 
 static bool is_1gib_page_supported(void) {
     // Cache the cpuid result :^)
@@ -66,7 +102,49 @@ static bool is_1gib_page_supported(void) {
     return CACHE;
 }
 
-void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+pagemap_t new_pagemap(int paging_mode) {
+    pagemap_t pagemap;
+    pagemap.levels    = paging_mode == PAGING_MODE_X86_64_5LVL ? 5 : 4;
+    pagemap.top_level = ext_mem_alloc(PT_SIZE);
+
+    // Query CPU features once here rather than on every mapping
+    uint32_t eax, ebx, ecx, edx;
+    if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 16))) {
+        pat_supported = true;
+    }
+    is_1gib_page_supported();
+
+    return pagemap;
+}
+
+static enum page_size largest_page_size(pagemap_t pagemap) {
+    (void)pagemap;
+    return is_1gib_page_supported() ? Size1GiB : Size2MiB;
+}
+
+static pt_entry_t new_entry(uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+    flags |= PT_FLAG_VALID; // Always present
+    if ((flags & VMM_FLAG_FB) && !pat_supported) {
+        flags &= ~(uint64_t)VMM_FLAG_FB;
+    }
+
+    if (pg_size != Size4KiB) {
+        return (pt_entry_t)(phys_addr | flags | PT_FLAG_LARGE);
+    }
+
+    // PML1 wants PAT bit at 7 instead of 12
+    if (flags & ((uint64_t)1 << 12)) {
+        flags &= ~((uint64_t)1 << 12);
+        flags |= ((uint64_t)1 << 7);
+    }
+
+    return (pt_entry_t)(phys_addr | flags);
+}
+
+// Walks down to the entry mapping virt_addr at the level for pg_size,
+// creating or splitting tables on the way.
+static pt_entry_t *get_entry(pagemap_t pagemap, uint64_t virt_addr, enum page_size pg_size,
+                              struct table_pool *pool) {
     // Calculate the indices in the various tables using the virtual address
     size_t pml5_entry = (virt_addr & ((uint64_t)0x1ff << 48)) >> 48;
     size_t pml4_entry = (virt_addr & ((uint64_t)0x1ff << 39)) >> 39;
@@ -76,20 +154,6 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
     pt_entry_t *pml5, *pml4, *pml3, *pml2, *pml1;
 
-    static bool pat_supported = false, pat_supported_got = false;
-    if (!pat_supported_got) {
-        uint32_t eax, ebx, ecx, edx;
-        if (cpuid(1, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 16))) {
-            pat_supported = true;
-        }
-        pat_supported_got = true;
-    }
-
-    flags |= PT_FLAG_VALID; // Always present
-    if ((flags & VMM_FLAG_FB) && !pat_supported) {
-        flags &= ~(uint64_t)VMM_FLAG_FB;
-    }
-
     // Paging levels
     switch (pagemap.levels) {
         case 5:
@@ -103,41 +167,34 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
     }
 
 level5:
-    pml4 = get_next_level(pagemap, pml5, virt_addr, pg_size, 4, pml5_entry);
+    pml4 = get_next_level(pagemap, pml5, virt_addr, pg_size, 4, pml5_entry, pool);
 level4:
-    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry);
+    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry, pool);
 
     if (pg_size == Size1GiB) {
-        // Check if 1GiB pages are available.
-        if (is_1gib_page_supported()) {
-            pml3[pml3_entry] = (pt_entry_t)(phys_addr | flags | PT_FLAG_LARGE);
-        } else {
-            // If 1GiB pages are not supported then emulate it by splitting them into
-            // 2MiB pages.
-            for (uint64_t i = 0; i < 0x40000000; i += 0x200000) {
-                map_page(pagemap, virt_addr + i, phys_addr + i, flags, Size2MiB);
-            }
-        }
-
-        return;
+        return &pml3[pml3_entry];
     }
 
-    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry);
+    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry, pool);
 
     if (pg_size == Size2MiB) {
-        pml2[pml2_entry] = (pt_entry_t)(phys_addr | flags | PT_FLAG_LARGE);
-        return;
+        return &pml2[pml2_entry];
     }
 
-    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry);
+    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry, pool);
 
-    // PML1 wants PAT bit at 7 instead of 12
-    if (flags & ((uint64_t)1 << 12)) {
-        flags &= ~((uint64_t)1 << 12);
-        flags |= ((uint64_t)1 << 7);
+    return &pml1[pml1_entry];
+}
+
+void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+    if (pg_size == Size1GiB && !is_1gib_page_supported()) {
+        // If 1GiB pages are not supported then emulate it by splitting them into
+        // 2MiB pages.
+        map_range(pagemap, virt_addr, phys_addr, 0x40000000, flags, Size2MiB);
+        return;
     }
 
-    pml1[pml1_entry] = (pt_entry_t)(phys_addr | flags);
+    *get_entry(pagemap, virt_addr, pg_size, NULL) = new_entry(phys_addr, flags, pg_size);
 }
 
 #elif defined (__aarch64__)
@@ -179,6 +236,7 @@ void vmm_assert_4k_pages(void) {
 
 #define pte_new(addr, flags)    ((pt_entry_t)(addr) | (flags))
 #define pte_addr(pte)           ((pte) & PT_PADDR_MASK)
+#define pte_large_addr(pte)     pte_addr(pte)
 
 static uint64_t pt_to_vmm_flags_internal(pt_entry_t entry) {
     uint64_t flags = 0;
@@ -201,7 +259,30 @@ pagemap_t new_pagemap(int paging_mode) {
     return pagemap;
 }
 
-void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+static enum page_size largest_page_size(pagemap_t pagemap) {
+    (void)pagemap;
+    return Size1GiB;
+}
+
+static pt_entry_t new_entry(uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+    uint64_t real_flags = PT_FLAG_VALID | PT_FLAG_INNER_SH | PT_FLAG_ACCESS | PT_FLAG_WB;
+    if (!(flags & VMM_FLAG_WRITE))
+        real_flags |= PT_FLAG_READONLY;
+    if (flags & VMM_FLAG_NOEXEC)
+        real_flags |= PT_FLAG_XN;
+    if (flags & VMM_FLAG_FB)
+        real_flags |= PT_FLAG_FB;
+
+    if (pg_size != Size4KiB)
+        return (pt_entry_t)(phys_addr | real_flags | PT_FLAG_BLOCK);
+
+    return (pt_entry_t)(phys_addr | real_flags | PT_FLAG_4K_PAGE);
+}
+
+// Walks down to the entry mapping virt_addr at the level for pg_size,
+// creating or splitting tables on the way.
+static pt_entry_t *get_entry(pagemap_t pagemap, uint64_t virt_addr, enum page_size pg_size,
+                              struct table_pool *pool) {
     // Calculate the indices in the various tables using the virtual address
     size_t pml5_entry = (virt_addr & ((uint64_t)0xf << 48)) >> 48;
     size_t pml4_entry = (virt_addr & ((uint64_t)0x1ff << 39)) >> 39;
@@ -213,14 +294,6 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
     bool is_higher_half = virt_addr & ((uint64_t)1 << 63);
 
-    uint64_t real_flags = PT_FLAG_VALID | PT_FLAG_INNER_SH | PT_FLAG_ACCESS | PT_FLAG_WB;
-    if (!(flags & VMM_FLAG_WRITE))
-        real_flags |= PT_FLAG_READONLY;
-    if (flags & VMM_FLAG_NOEXEC)
-        real_flags |= PT_FLAG_XN;
-    if (flags & VMM_FLAG_FB)
-        real_flags |= PT_FLAG_FB;
-
     // Paging levels
     switch (pagemap.levels) {
         case 5:
@@ -234,25 +307,27 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
     }
 
 level5:
-    pml4 = get_next_level(pagemap, pml5, virt_addr, pg_size, 4, pml5_entry);
+    pml4 = get_next_level(pagemap, pml5, virt_addr, pg_size, 4, pml5_entry, pool);
 level4:
-    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry);
+    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry, pool);
 
     if (pg_size == Size1GiB) {
-        pml3[pml3_entry] = (pt_entry_t)(phys_addr | real_flags | PT_FLAG_BLOCK);
-        return;
+        return &pml3[pml3_entry];
     }
 
-    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry);
+    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry, pool);
 
     if (pg_size == Size2MiB) {
-        pml2[pml2_entry] = (pt_entry_t)(phys_addr | real_flags | PT_FLAG_BLOCK);
-        return;
+        return &pml2[pml2_entry];
     }
 
-    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry);
+    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry, pool);
 
-    pml1[pml1_entry] = (pt_entry_t)(phys_addr | real_flags | PT_FLAG_4K_PAGE);
+    return &pml1[pml1_entry];
+}
+
+void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+    *get_entry(pagemap, virt_addr, pg_size, NULL) = new_entry(phys_addr, flags, pg_size);
 }
 
 #elif defined (__riscv)
@@ -276,6 +351,7 @@ level4:
 
 #define pte_new(addr, flags)    (((pt_entry_t)(addr) >> 2) | (flags))
 #define pte_addr(pte)           (((pte) & PT_PADDR_MASK) << 2)
+#define pte_large_addr(pte)     pte_addr(pte)
 
 static uint64_t pt_to_vmm_flags_internal(pt_entry_t entry) {
     uint64_t flags = 0;
@@ -368,10 +444,12 @@ pagemap_t new_pagemap(int paging_mode) {
     return pagemap;
 }
 
-void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size page_size) {
-    // Truncate the requested page size to the maximum supported.
-    if (page_size > pagemap.max_page_size)
-        page_size = pagemap.max_page_size;
+static enum page_size largest_page_size(pagemap_t pagemap) {
+    return pagemap.max_page_size;
+}
+
+static pt_entry_t new_entry(uint64_t phys_addr, uint64_t flags, enum page_size page_size) {
+    (void)page_size;
 
     // Convert VMM_FLAG_* into PT_FLAG_*.
     // Set the ACCESSED and DIRTY flags to avoid faults.
@@ -383,6 +461,13 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
     if (flags & VMM_FLAG_FB)
         ptflags |= pbmt_nc;
 
+    return pte_new(phys_addr, ptflags);
+}
+
+// Walks down to the entry mapping virt_addr at the level for page_size,
+// creating or splitting tables on the way.
+static pt_entry_t *get_entry(pagemap_t pagemap, uint64_t virt_addr, enum page_size page_size,
+                              struct table_pool *pool) {
     // Start at the highest level.
     // The values of `enum page_size` map to the level index at which that size is mapped.
     int level = pagemap.max_page_size;
@@ -392,15 +477,22 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
         // Stop when we reach the level for the requested page size.
         if (level == (int)page_size) {
-            table[index] = pte_new(phys_addr, ptflags);
-            break;
+            return &table[index];
         }
 
-        table = get_next_level(pagemap, table, virt_addr, page_size, level, index);
+        table = get_next_level(pagemap, table, virt_addr, page_size, level, index, pool);
         level--;
     }
 }
 
+void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size page_size) {
+    // Truncate the requested page size to the maximum supported.
+    if (page_size > pagemap.max_page_size)
+        page_size = pagemap.max_page_size;
+
+    *get_entry(pagemap, virt_addr, page_size, NULL) = new_entry(phys_addr, flags, page_size);
+}
+
 #elif defined (__loongarch64)
 
 #define INVALID_PAGE    0
@@ -415,7 +507,6 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 #define PT_FLAG_HGLOBAL ((uint64_t)1 << 12)
 #define PT_FLAG_NX      ((uint64_t)1 << 62)
 #define PT_PADDR_MASK   ((uint64_t)0x0000FFFFFFFFF000)
-#define PT_PADDR_HMASK  ((uint64_t)0x0000FFFFFF000000)
 
 #define PT_TABLE_FLAGS      0
 #define PT_IS_TABLE(x)      ((level_idx > 0) && (((x) & PT_FLAG_VALID) == 0) && ((x) != INVALID_PAGE))
@@ -424,12 +515,9 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
 #define pte_new(addr, flags)    (pt_entry_t)((addr) | (flags))
 
-static inline uint64_t pte_addr(uint64_t pte) {
-    if (PT_IS_LARGE(pte)) {
-        return pte & PT_PADDR_HMASK;
-    }
-    return pte & PT_PADDR_MASK;
-}
+#define pte_addr(pte)           ((pte) & PT_PADDR_MASK)
+// Huge pages keep their global bit where 4KiB pages have an address bit
+#define pte_large_addr(pte)     ((pte) & PT_PADDR_MASK & ~PT_FLAG_HGLOBAL)
 
 static uint64_t pt_to_vmm_flags_internal(pt_entry_t entry) {
     uint64_t flags = 0;
@@ -452,16 +540,12 @@ pagemap_t new_pagemap(int paging_mode) {
     return pagemap;
 }
 
-void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
-    size_t pml4_entry = (virt_addr & ((uint64_t)0x1ff << 39)) >> 39;
-    size_t pml3_entry = (virt_addr & ((uint64_t)0x1ff << 30)) >> 30;
-    size_t pml2_entry = (virt_addr & ((uint64_t)0x1ff << 21)) >> 21;
-    size_t pml1_entry = (virt_addr & ((uint64_t)0x1ff << 12)) >> 12;
-
-    pt_entry_t *pml4, *pml3, *pml2, *pml1;
-
-    bool is_higher_half = virt_addr & ((uint64_t)1 << 63);
+static enum page_size largest_page_size(pagemap_t pagemap) {
+    (void)pagemap;
+    return Size1GiB;
+}
 
+static pt_entry_t new_entry(uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
     uint64_t real_flags = PT_FLAG_VALID | PT_FLAG_GLOBAL;
     if (flags & VMM_FLAG_WRITE)
         real_flags |= PT_FLAG_DIRTY | PT_FLAG_WRITE;
@@ -472,25 +556,46 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
     else
         real_flags |= PT_FLAG_MAT_CC;
 
+    if (pg_size != Size4KiB)
+        return pte_new(phys_addr, real_flags | PT_FLAG_HGLOBAL | PT_FLAG_HUGE);
+
+    return pte_new(phys_addr, real_flags);
+}
+
+// Walks down to the entry mapping virt_addr at the level for pg_size,
+// creating or splitting tables on the way.
+static pt_entry_t *get_entry(pagemap_t pagemap, uint64_t virt_addr, enum page_size pg_size,
+                              struct table_pool *pool) {
+    size_t pml4_entry = (virt_addr & ((uint64_t)0x1ff << 39)) >> 39;
+    size_t pml3_entry = (virt_addr & ((uint64_t)0x1ff << 30)) >> 30;
+    size_t pml2_entry = (virt_addr & ((uint64_t)0x1ff << 21)) >> 21;
+    size_t pml1_entry = (virt_addr & ((uint64_t)0x1ff << 12)) >> 12;
+
+    pt_entry_t *pml4, *pml3, *pml2, *pml1;
+
+    bool is_higher_half = virt_addr & ((uint64_t)1 << 63);
+
     pml4 = pagemap.pgd[is_higher_half];
 
-    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry);
+    pml3 = get_next_level(pagemap, pml4, virt_addr, pg_size, 3, pml4_entry, pool);
 
     if (pg_size == Size1GiB) {
-        pml3[pml3_entry] = pte_new(phys_addr, real_flags | PT_FLAG_HGLOBAL | PT_FLAG_HUGE);
-        return;
+        return &pml3[pml3_entry];
     }
 
-    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry);
+    pml2 = get_next_level(pagemap, pml3, virt_addr, pg_size, 2, pml3_entry, pool);
 
     if (pg_size == Size2MiB) {
-        pml2[pml2_entry] = pte_new(phys_addr, real_flags | PT_FLAG_HGLOBAL | PT_FLAG_HUGE);
-        return;
+        return &pml2[pml2_entry];
     }
 
-    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry);
+    pml1 = get_next_level(pagemap, pml2, virt_addr, pg_size, 1, pml2_entry, pool);
+
+    return &pml1[pml1_entry];
+}
 
-    pml1[pml1_entry] = pte_new(phys_addr, real_flags);
+void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags, enum page_size pg_size) {
+    *get_entry(pagemap, virt_addr, pg_size, NULL) = new_entry(phys_addr, flags, pg_size);
 }
 
 #else
@@ -499,7 +604,8 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
 static pt_entry_t *get_next_level(pagemap_t pagemap, pt_entry_t *current_level,
                                   uint64_t virt, enum page_size desired_sz,
-                                  size_t level_idx, size_t entry) {
+                                  size_t level_idx, size_t entry,
+                                  struct table_pool *pool) {
     pt_entry_t *ret;
 
     if (PT_IS_TABLE(current_level[entry])) {
@@ -521,14 +627,14 @@ static pt_entry_t *get_next_level(pagemap_t pagemap, pt_entry_t *current_level,
 
             // Save all the information from the old entry at this level
             uint64_t old_flags = PT_TO_VMM_FLAGS(current_level[entry]);
-            uint64_t old_phys = pte_addr(current_level[entry]);
+            uint64_t old_phys = pte_large_addr(current_level[entry]);
             uint64_t old_virt = virt & ~(old_page_size - 1);
 
             if (old_phys & (old_page_size - 1))
                 panic(false, "Unexpected page table entry address in get_next_level");
 
             // Allocate a table for the next level
-            ret = ext_mem_alloc(PT_SIZE);
+            ret = alloc_table(pool);
             current_level[entry] = pte_new((size_t)ret, PT_TABLE_FLAGS);
 
             // Recreate the old mapping with smaller pages
@@ -537,10 +643,95 @@ static pt_entry_t *get_next_level(pagemap_t pagemap, pt_entry_t *current_level,
             }
         } else {
             // Allocate a table for the next level
-            ret = ext_mem_alloc(PT_SIZE);
+            ret = alloc_table(pool);
             current_level[entry] = pte_new((size_t)ret, PT_TABLE_FLAGS);
         }
     }
 
     return ret;
 }
+
+// Largest page that both addresses are aligned to and that does not reach
+// past the end of the range.
+static enum page_size range_page_size(uint64_t virt_addr, uint64_t phys_addr, uint64_t length, enum page_size max_page_size) {
+    enum page_size pg_size = max_page_size;
+
+    while (pg_size > Size4KiB) {
+        uint64_t size = page_sizes[pg_size];
+
+        if (((virt_addr | phys_addr) & (size - 1)) == 0 && length >= size)
+            break;
+
+        pg_size--;
+    }
+
+    return pg_size;
+}
+
+void map_range(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t length, uint64_t flags, enum page_size max_page_size) {
+    uint64_t offset = virt_addr & (PT_SIZE - 1);
+
+    virt_addr -= offset;
+    phys_addr -= offset;
+    length = ALIGN_UP(length + offset, PT_SIZE);
+
+    if (max_page_size > Size1GiB)
+        max_page_size = Size1GiB;
+    if (max_page_size > largest_page_size(pagemap))
+        max_page_size = largest_page_size(pagemap);
+
+    // Walk the range once without mapping anything to find out how many
+    // tables up to the level holding 1GiB pages it needs at most, so they can
+    // all come out of a single allocation. Tables that already exist make this
+    // an overestimate, whatever is left over is given back at the end.
+    size_t tables = 0;
+    uint64_t last_table[Size1GiB + 1] = { (uint64_t)-1, (uint64_t)-1, (uint64_t)-1 };
+
+    uint64_t virt = virt_addr, phys = phys_addr, left = length;
+    while (left > 0) {
+        enum page_size pg_size = range_page_size(virt, phys, left, max_page_size);
+
+        for (int level = pg_size; level <= Size1GiB; level++) {
+            uint64_t table = virt >> (12 + 9 * (level + 1));
+            if (table != last_table[level]) {
+                last_table[level] = table;
+                tables++;
+            }
+        }
+
+        virt += page_sizes[pg_size];
+        phys += page_sizes[pg_size];
+        left -= page_sizes[pg_size];
+    }
+
+    struct table_pool pool;
+    reserve_tables(&pool, tables);
+
+    // Consecutive pages of the same size sit next to each other in the same
+    // table until the index wraps, so only walk the tables again when that
+    // happens or the page size changes.
+    pt_entry_t *entry = NULL;
+    enum page_size entry_size = Size4KiB;
+
+    // Track what is left rather than the end address, the range may well end
+    // right at the top of the address space.
+    while (length > 0) {
+        enum page_size pg_size = range_page_size(virt_addr, phys_addr, length, max_page_size);
+
+        if (entry != NULL && pg_size == entry_size
+         && ((virt_addr >> (12 + 9 * pg_size)) & 0x1ff) != 0) {
+            entry++;
+        } else {
+            entry = get_entry(pagemap, virt_addr, pg_size, &pool);
+            entry_size = pg_size;
+        }
+
+        *entry = new_entry(phys_addr, flags, pg_size);
+
+        virt_addr += page_sizes[pg_size];
+        phys_addr += page_sizes[pg_size];
+        length -= page_sizes[pg_size];
+    }
+
+    release_tables(&pool);
+}
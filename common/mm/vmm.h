@@ -162,4 +162,9 @@ void map_page(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_
 
 int vmm_max_paging_mode(void);
 
+// Maps every page of the length bytes at virt_addr to phys_addr, using the
+// largest pages up to max_page_size that the alignment of both addresses and
+// the size of the range allow.
+void map_range(pagemap_t pagemap, uint64_t virt_addr, uint64_t phys_addr, uint64_t length, uint64_t flags, enum page_size max_page_size);
+
 #endif
@@ -195,6 +195,8 @@ void bios_chainload_volume(struct volume *p) {
         return;
     }
 
+    volume_cache_quiesce();
+
     spinup(p->drive, buf);
 }
 
@@ -215,7 +217,7 @@ noreturn void chainload(char *config, char *cmdline) {
 noreturn void efi_chainload_file(char *config, char *cmdline, struct file_handle *image) {
     EFI_STATUS status;
 
-    EFI_HANDLE efi_part_handle = image->efi_part_handle;
+    EFI_HANDLE efi_part_handle = image->pxe ? NULL : disk_efi_part_handle(image->vol);
 
     void *ptr = freadall(image, MEMMAP_RESERVED);
     size_t image_size = image->size;
@@ -226,6 +228,8 @@ noreturn void efi_chainload_file(char *config, char *cmdline, struct file_handle
 
     fclose(image);
 
+    volume_cache_quiesce();
+
     term_notready();
 
     size_t req_width = 0, req_height = 0, req_bpp = 0;
@@ -36,6 +36,10 @@
 
 #define MAX_REQUESTS 128
 
+// Requests are kept in an open addressed hash table keyed by the request ID,
+// twice as large as the maximum request count so that probes stay short.
+#define REQUESTS_TABLE_SIZE (MAX_REQUESTS * 2)
+
 #define MEMMAP_MAX 1024
 
 static int paging_mode;
@@ -75,9 +79,7 @@ static uint64_t get_hhdm_span_top(int base_revision) {
 static pagemap_t build_identity_map(void) {
     pagemap_t pagemap = new_pagemap(paging_mode);
 
-    for (uint64_t i = 0; i < 0x100000000; i += 0x40000000) {
-        map_page(pagemap, i, i, VMM_FLAG_WRITE, Size1GiB);
-    }
+    map_range(pagemap, 0, 0, 0x100000000, VMM_FLAG_WRITE, Size1GiB);
 
 
     size_t _memmap_entries = memmap_entries;
@@ -109,10 +111,7 @@ static pagemap_t build_identity_map(void) {
         uint64_t aligned_top    = ALIGN_UP(top, 0x40000000);
         uint64_t aligned_length = aligned_top - aligned_base;
 
-        for (uint64_t j = 0; j < aligned_length; j += 0x40000000) {
-            uint64_t page = aligned_base + j;
-            map_page(pagemap, page, page, VMM_FLAG_WRITE, Size1GiB);
-        }
+        map_range(pagemap, aligned_base, aligned_base, aligned_length, VMM_FLAG_WRITE, Size1GiB);
     }
 
     return pagemap;
@@ -157,33 +156,16 @@ static pagemap_t build_pagemap(int base_revision,
             (ranges[i].permissions & ELF_PF_X ? 0 : (nx ? VMM_FLAG_NOEXEC : 0)) |
             (ranges[i].permissions & ELF_PF_W ? VMM_FLAG_WRITE : 0);
 
-        for (uint64_t j = 0; j < ranges[i].length; j += 0x1000) {
-            map_page(pagemap, virt + j, phys + j, pf, Size4KiB);
-        }
+        map_range(pagemap, virt, phys, ranges[i].length, pf, Size1GiB);
     }
 
     // Map 0x1000->4GiB range to identity if base revision == 0
     if (base_revision == 0) {
-        // Sub 2MiB mappings
-        for (uint64_t i = 0x1000; i < 0x200000; i += 0x1000) {
-            map_page(pagemap, i, i, VMM_FLAG_WRITE, Size4KiB);
-        }
-
-        // Map 2MiB to 4GiB
-        for (uint64_t i = 0x200000; i < 0x40000000; i += 0x200000) {
-            map_page(pagemap, i, i, VMM_FLAG_WRITE, Size2MiB);
-        }
-
-        // Map the rest
-        for (uint64_t i = 0x40000000; i < 0x100000000; i += 0x40000000) {
-            map_page(pagemap, i, i, VMM_FLAG_WRITE, Size1GiB);
-        }
+        map_range(pagemap, 0x1000, 0x1000, 0x100000000 - 0x1000, VMM_FLAG_WRITE, Size1GiB);
     }
 
     // Map 0->4GiB range to HHDM
-    for (uint64_t i = 0; i < 0x100000000; i += 0x40000000) {
-        map_page(pagemap, direct_map_offset + i, i, VMM_FLAG_WRITE, Size1GiB);
-    }
+    map_range(pagemap, direct_map_offset, 0, 0x100000000, VMM_FLAG_WRITE, Size1GiB);
 
     size_t _memmap_entries = memmap_entries;
     struct memmap_entry *_memmap =
@@ -215,13 +197,10 @@ static pagemap_t build_pagemap(int base_revision,
         uint64_t aligned_top    = ALIGN_UP(top, 0x40000000);
         uint64_t aligned_length = aligned_top - aligned_base;
 
-        for (uint64_t j = 0; j < aligned_length; j += 0x40000000) {
-            uint64_t page = aligned_base + j;
-            if (base_revision == 0) {
-                map_page(pagemap, page, page, VMM_FLAG_WRITE, Size1GiB);
-            }
-            map_page(pagemap, direct_map_offset + page, page, VMM_FLAG_WRITE, Size1GiB);
+        if (base_revision == 0) {
+            map_range(pagemap, aligned_base, aligned_base, aligned_length, VMM_FLAG_WRITE, Size1GiB);
         }
+        map_range(pagemap, direct_map_offset + aligned_base, aligned_base, aligned_length, VMM_FLAG_WRITE, Size1GiB);
     }
 
     // Map the framebuffer with appropriate permissions
@@ -238,21 +217,16 @@ static pagemap_t build_pagemap(int base_revision,
         uint64_t aligned_top    = ALIGN_UP(top, 0x1000);
         uint64_t aligned_length = aligned_top - aligned_base;
 
-        for (uint64_t j = 0; j < aligned_length; j += 0x1000) {
-            uint64_t page = aligned_base + j;
-            if (base_revision == 0) {
-                map_page(pagemap, page, page, VMM_FLAG_WRITE | VMM_FLAG_FB, Size4KiB);
-            }
-            map_page(pagemap, direct_map_offset + page, page, VMM_FLAG_WRITE | VMM_FLAG_FB, Size4KiB);
+        if (base_revision == 0) {
+            map_range(pagemap, aligned_base, aligned_base, aligned_length, VMM_FLAG_WRITE | VMM_FLAG_FB, Size1GiB);
         }
+        map_range(pagemap, direct_map_offset + aligned_base, aligned_base, aligned_length, VMM_FLAG_WRITE | VMM_FLAG_FB, Size1GiB);
     }
 
     // XXX we do this as a quick and dirty way to switch to the higher half
 #if defined (__x86_64__) || defined (__i386__)
     if (base_revision >= 1) {
-        for (uint64_t i = 0; i < 0x100000000; i += 0x40000000) {
-            map_page(pagemap, i, i, VMM_FLAG_WRITE, Size1GiB);
-        }
+        map_range(pagemap, 0, 0, 0x100000000, VMM_FLAG_WRITE, Size1GiB);
     }
 #endif
 
@@ -351,6 +325,8 @@ static struct limine_file get_file(struct file_handle *file, char *cmdline, bool
 
         ret.mbr_disk_id = mbr_get_id(vol);
 
+        volume_probe_ids(vol);
+
         if (vol->guid_valid) {
             memcpy(&ret.part_uuid, &vol->guid, sizeof(struct limine_uuid));
         }
@@ -388,21 +364,41 @@ static struct limine_file get_file(struct file_handle *file, char *cmdline, bool
     return ret;
 }
 
-static void *_get_request(uint64_t id[4]) {
-    for (size_t i = 0; i < requests_count; i++) {
+static void **request_slot(uint64_t id[4]) {
+    // Request IDs are random numbers, so their low bits make a fine hash.
+    size_t i = (size_t)(id[2] ^ id[3]) & (REQUESTS_TABLE_SIZE - 1);
+
+    for (;;) {
         uint64_t *p = requests[i];
 
-        if (p[2] != id[2]) {
-            continue;
+        if (p == NULL || (p[2] == id[2] && p[3] == id[3])) {
+            return &requests[i];
         }
-        if (p[3] != id[3]) {
-            continue;
+
+        i = (i + 1) & (REQUESTS_TABLE_SIZE - 1);
+    }
+}
+
+static void *_get_request(uint64_t id[4]) {
+    return *request_slot(id);
+}
+
+static void add_request(uint64_t *p, bool check_conflicts) {
+    void **slot = request_slot(p);
+
+    if (*slot != NULL) {
+        if (check_conflicts) {
+            panic(true, "limine: Conflict detected for request ID %X %X", p[2], p[3]);
         }
+        return;
+    }
 
-        return p;
+    if (requests_count == MAX_REQUESTS) {
+        panic(true, "limine: Maximum requests exceeded");
     }
 
-    return NULL;
+    *slot = p;
+    requests_count++;
 }
 
 #define get_request(REQ) _get_request((uint64_t[4])REQ)
@@ -441,8 +437,6 @@ noreturn void limine_load(char *config, char *cmdline) {
         k_path[i] = 0;
     }
 
-    uint8_t *kernel = freadall(kernel_file, MEMMAP_BOOTLOADER_RECLAIMABLE);
-
     char *kaslr_s = config_get_value(config, 0, "KASLR");
     bool kaslr = true;
     if (kaslr_s != NULL && strcmp(kaslr_s, "no") == 0)
@@ -456,7 +450,7 @@ noreturn void limine_load(char *config, char *cmdline) {
     uint64_t image_size_before_bss;
     bool is_reloc;
 
-    if (!elf64_load(kernel, &entry_point, &slide,
+    if (!elf64_load(kernel_file, &entry_point, &slide,
                    MEMMAP_KERNEL_AND_MODULES, kaslr,
                    &ranges, &ranges_count,
                    &physical_base, &virtual_base, NULL,
@@ -469,28 +463,59 @@ noreturn void limine_load(char *config, char *cmdline) {
 
     LIMINE_REQUESTS_START_MARKER;
     LIMINE_REQUESTS_END_MARKER;
-
-    // Determine base revision
     LIMINE_BASE_REVISION(0);
+    uint64_t common_magic[2] = { LIMINE_COMMON_MAGIC };
+
+    // Find the base revision and the requests in a single sweep over the
+    // image. The requests found are only used if there is no .limine_reqs
+    // section to take them from, so they are just collected here.
     int base_revision = 0;
     uint64_t *base_rev_p2_ptr = NULL;
-    for (size_t i = 0; i < ALIGN_DOWN(image_size_before_bss, 8); i += 8) {
-        uint64_t *p = (void *)(uintptr_t)physical_base + i;
+    uint64_t **found_reqs = ext_mem_alloc(MAX_REQUESTS * sizeof(uint64_t *));
+    size_t found_reqs_count = 0;
+    // Set at the first request past MAX_REQUESTS. A separate requests sweep
+    // would have stopped there, so later start markers are ignored for the
+    // requests from then on.
+    bool found_reqs_overflow = false;
+
+    uint64_t *image = (void *)(uintptr_t)physical_base;
+    size_t image_words = image_size_before_bss / 8;
+    for (size_t i = 0; i < image_words; i++) {
+        uint64_t *p = &image[i];
+        uint64_t w = p[0];
+
+        // Almost no word starts any of the tags, rule those out first
+        if (w != common_magic[0] && w != limine_base_revision[0]
+         && w != limine_requests_start_marker[0] && w != limine_requests_end_marker[0]) {
+            continue;
+        }
+
+        if (w == common_magic[0] && p[1] == common_magic[1]) {
+            if (found_reqs_count < MAX_REQUESTS) {
+                found_reqs[found_reqs_count++] = p;
+            } else {
+                found_reqs_overflow = true;
+            }
+            continue;
+        }
 
         // Check if start marker hit
-        if (p[0] == limine_requests_start_marker[0] && p[1] == limine_requests_start_marker[1]
+        if (w == limine_requests_start_marker[0] && p[1] == limine_requests_start_marker[1]
          && p[2] == limine_requests_start_marker[2] && p[3] == limine_requests_start_marker[3]) {
             base_revision = 0;
             base_rev_p2_ptr = NULL;
+            if (!found_reqs_overflow) {
+                found_reqs_count = 0;
+            }
             continue;
         }
 
         // Check if end marker hit
-        if (p[0] == limine_requests_end_marker[0] && p[1] == limine_requests_end_marker[1]) {
+        if (w == limine_requests_end_marker[0] && p[1] == limine_requests_end_marker[1]) {
             break;
         }
 
-        if (p[0] == limine_base_revision[0] && p[1] == limine_base_revision[1]) {
+        if (w == limine_base_revision[0] && p[1] == limine_base_revision[1]) {
             if (base_revision != 0) {
                 panic(true, "limine: Duplicated base revision tag");
             }
@@ -510,52 +535,27 @@ noreturn void limine_load(char *config, char *cmdline) {
 
     // Load requests
     uint64_t *limine_reqs = NULL;
-    requests = ext_mem_alloc(MAX_REQUESTS * sizeof(void *));
+    requests = ext_mem_alloc(REQUESTS_TABLE_SIZE * sizeof(void *));
     requests_count = 0;
-    if (base_revision == 0 && elf64_load_section(kernel, &limine_reqs, ".limine_reqs", 0, slide)) {
+    if (base_revision == 0 && elf64_load_section(kernel_file, &limine_reqs, ".limine_reqs", 0, slide)) {
         for (size_t i = 0; ; i++) {
             if (limine_reqs[i] == 0) {
                 break;
             }
-            requests[i] = (void *)(uintptr_t)((limine_reqs[i] - virtual_base) + physical_base);
-            requests_count++;
+            add_request((void *)(uintptr_t)((limine_reqs[i] - virtual_base) + physical_base), false);
         }
     } else {
-        uint64_t common_magic[2] = { LIMINE_COMMON_MAGIC };
-        for (size_t i = 0; i < ALIGN_DOWN(image_size_before_bss, 8); i += 8) {
-            uint64_t *p = (void *)(uintptr_t)physical_base + i;
-
-            // Check if start marker hit
-            if (p[0] == limine_requests_start_marker[0] && p[1] == limine_requests_start_marker[1]
-             && p[2] == limine_requests_start_marker[2] && p[3] == limine_requests_start_marker[3]) {
-                requests_count = 0;
-                continue;
-            }
-
-            // Check if end marker hit
-            if (p[0] == limine_requests_end_marker[0] && p[1] == limine_requests_end_marker[1]) {
-                break;
-            }
-
-            if (p[0] != common_magic[0]) {
-                continue;
-            }
-            if (p[1] != common_magic[1]) {
-                continue;
-            }
-
-            if (requests_count == MAX_REQUESTS) {
-                panic(true, "limine: Maximum requests exceeded");
-            }
-
-            // Check for a conflict
-            if (_get_request(p) != NULL) {
-                panic(true, "limine: Conflict detected for request ID %X %X", p[2], p[3]);
-            }
+        for (size_t i = 0; i < found_reqs_count; i++) {
+            add_request(found_reqs[i], true);
+        }
 
-            requests[requests_count++] = p;
+        // Conflicts among the requests before it are reported first, as
+        // they were found first
+        if (found_reqs_overflow) {
+            panic(true, "limine: Maximum requests exceeded");
         }
     }
+    pmm_free(found_reqs, MAX_REQUESTS * sizeof(uint64_t *));
 
 #if defined (__x86_64__) || defined (__i386__)
     // Check if 64 bit CPU
@@ -837,8 +837,13 @@ FEAT_END
     uint64_t tsz = 64 - (paging_mode_va_bits(paging_mode) - 1);
 #endif
 
-    struct limine_file *kf = ext_mem_alloc(sizeof(struct limine_file));
-    *kf = get_file(kernel_file, cmdline, true);
+    // The kernel was loaded straight from the file, only read all of it in
+    // if it asked to be handed its own file.
+    struct limine_file *kf = NULL;
+    if (get_request(LIMINE_KERNEL_FILE_REQUEST) != NULL) {
+        kf = ext_mem_alloc(sizeof(struct limine_file));
+        *kf = get_file(kernel_file, cmdline, true);
+    }
     fclose(kernel_file);
 
     // Entry point feature
@@ -1200,6 +1205,9 @@ FEAT_END
     struct fb_info *fbs;
     size_t fbs_count;
 
+    volume_cache_print_stats("boot entry");
+    volume_cache_quiesce();
+
     term_notready();
 
     fb_init(&fbs, &fbs_count, req_width, req_height, req_bpp);
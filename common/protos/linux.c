@@ -430,6 +430,9 @@ noreturn void linux_load(char *config, char *cmdline) {
     // Video
     ///////////////////////////////////////
 
+    volume_cache_print_stats("boot entry");
+    volume_cache_quiesce();
+
     term_notready();
 
     struct screen_info *screen_info = &boot_params->screen_info;
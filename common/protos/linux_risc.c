@@ -158,6 +158,9 @@ void *prepare_device_tree_blob(char *config, char *cmdline) {
     struct fb_info *fbs;
     size_t fbs_count;
 
+    volume_cache_print_stats("boot entry");
+    volume_cache_quiesce();
+
     term_notready();
 
     fb_init(&fbs, &fbs_count, req_width, req_height, req_bpp);
@@ -323,6 +323,9 @@ noreturn void multiboot1_load(char *config, char *cmdline) {
     multiboot1_info->bootloader_name = (uint32_t)(size_t)lowmem_bootname - mb1_info_slide;
     multiboot1_info->flags |= (1 << 9);
 
+    volume_cache_print_stats("boot entry");
+    volume_cache_quiesce();
+
     term_notready();
 
     size_t req_width = 0;
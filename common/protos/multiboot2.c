@@ -619,6 +619,9 @@ reloc_fail:
         tag->common.type = MULTIBOOT_TAG_TYPE_FRAMEBUFFER;
         tag->common.size = sizeof(struct multiboot_tag_framebuffer);
 
+        volume_cache_print_stats("boot entry");
+        volume_cache_quiesce();
+
         term_notready();
 
         size_t req_width = 0;
@@ -101,7 +101,8 @@ struct file_handle *tftp_open(struct volume *part, const char *server_addr, cons
     mtu = open.packet_size;
 
     uint8_t *buf = conv_mem_alloc(mtu);
-    handle->fd = ext_mem_alloc(handle->size);
+    // Retyped in the memory map by freadall(), so it needs pages of its own
+    handle->fd = ext_mem_alloc_type_aligned(handle->size, MEMMAP_BOOTLOADER_RECLAIMABLE, 4096);
 
     size_t progress = 0;
     bool slow = false;
@@ -203,7 +204,8 @@ struct file_handle *tftp_open(struct volume *part, const char *server_addr, cons
     memcpy(&handle->path[1], name, name_len);
     handle->path_len = 1 + name_len + 1;
 
-    handle->fd = ext_mem_alloc(handle->size);
+    // Retyped in the memory map by freadall(), so it needs pages of its own
+    handle->fd = ext_mem_alloc_type_aligned(handle->size, MEMMAP_BOOTLOADER_RECLAIMABLE, 4096);
 
     status = part->pxe_base_code->Mtftp(
             part->pxe_base_code,
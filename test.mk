@@ -1,8 +1,13 @@
 .PHONY: test-clean
 test-clean:
 	$(MAKE) -C test -f test.mk clean
+	$(MAKE) -C test/host clean
 	rm -rf test_image test.hdd test.iso
 
+.PHONY: host-test
+host-test:
+	$(MAKE) -C test/host
+
 ovmf-x64:
 	$(MKDIR_P) ovmf-x64
 	curl -Lo ovmf-x64/OVMF_CODE.fd https://github.com/osdev0/edk2-ovmf-nightly/releases/latest/download/ovmf-code-x86_64.fd
@@ -231,6 +236,37 @@ uefi-x86-64-test:
 	rm -rf test_image loopback_dev
 	qemu-system-x86_64 -m 512M -M q35 -drive if=pflash,unit=0,format=raw,file=ovmf-x64/OVMF_CODE.fd,readonly=on -drive if=pflash,unit=1,format=raw,file=ovmf-x64/OVMF_VARS.fd -net none -smp 4   -hda test.hdd -debugcon stdio
 
+# Boots from an NVMe drive, where OVMF provides queued reads, and has Limine
+# check the Blake2b hash of a large random module. The module is written
+# before the rest of the files so that it ends up in a cluster chain with
+# reads that cross several queued transfers.
+.PHONY: uefi-nvme-x86-64-test
+uefi-nvme-x86-64-test:
+	$(MAKE) ovmf-x64
+	$(MAKE) test-clean
+	$(MAKE) test.hdd
+	$(MAKE) limine-uefi-x86-64
+	$(MAKE) -C test -f test.mk TOOLCHAIN_FILE='$(call SHESCAPE,$(BUILDDIR))/toolchain-files/uefi-x86_64-toolchain.mk'
+	rm -rf test_image/
+	mkdir test_image
+	head -c 25165831 /dev/urandom > hashed.bin
+	sudo losetup -Pf --show test.hdd > loopback_dev
+	sudo partprobe `cat loopback_dev`
+	sudo mkfs.fat -F 32 `cat loopback_dev`p1
+	sudo mount `cat loopback_dev`p1 test_image
+	sudo mkdir test_image/boot
+	sudo cp hashed.bin test_image/boot/
+	sudo cp -rv $(BINDIR)/* test_image/boot/
+	sudo cp -rv test/* test_image/boot/
+	printf 'hash_mismatch_panic: yes\ntimeout: 0\n\n/Hashed module\n    protocol: limine\n    kernel_path: boot():/boot/test.elf\n    module_path: boot():/boot/hashed.bin#%s\n' `b2sum hashed.bin | cut -d' ' -f1` | sudo tee test_image/boot/limine.conf
+	sudo $(MKDIR_P) test_image/EFI/BOOT
+	sudo cp $(BINDIR)/BOOTX64.EFI test_image/EFI/BOOT/
+	sync
+	sudo umount test_image/
+	sudo losetup -d `cat loopback_dev`
+	rm -rf test_image loopback_dev hashed.bin
+	qemu-system-x86_64 -m 512M -M q35 -drive if=pflash,unit=0,format=raw,file=ovmf-x64/OVMF_CODE.fd,readonly=on -drive if=pflash,unit=1,format=raw,file=ovmf-x64/OVMF_VARS.fd -net none -smp 4   -drive if=none,id=nvme0,format=raw,file=test.hdd -device nvme,serial=limine,drive=nvme0 -debugcon stdio
+
 .PHONY: uefi-aa64-test
 uefi-aa64-test:
 	$(MAKE) ovmf-aa64
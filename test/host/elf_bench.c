@@ -0,0 +1,199 @@
+// Times elf64_load() on kernel images, with the real memory map allocator
+// underneath and file reads served from memory. Each image is also loaded at
+// two different slides first, and every word of the two copies must either
+// match or differ by exactly the difference between the slides. When the
+// number of words the image has relocations for is given, exactly that many
+// must differ.
+//
+// Built and run on two generated images by `make -C test/host`, or by hand
+// for any x86-64 image:
+//
+//     cc -O2 -DBIOS -fno-builtin -I ../../common -o elf_bench elf_bench.c
+//         ../../common/lib/elf.c ../../common/mm/pmm.s2.c
+//     ./elf_bench kernel.elf [iterations [relocated words]]
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <lib/elf.h>
+#include <lib/libc.h>
+#include <lib/misc.h>
+#include <fs/file.h>
+#include <mm/pmm.h>
+#include <sys/e820.h>
+
+// The bootloader's own headers clash with the C library's
+int printf(const char *fmt, ...);
+int atoi(const char *str);
+noreturn void abort(void);
+int open(const char *path, int flags, ...);
+long read(int fd, void *buf, size_t count);
+int close(int fd);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+
+struct timespec {
+    long tv_sec;
+    long tv_nsec;
+};
+int clock_gettime(int clock, struct timespec *ts);
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+#define MAP_FIXED_NOREPLACE 0x100000
+#define MAP_FAILED ((void *)-1)
+#define CLOCK_MONOTONIC 1
+
+// Where the allocator gets its memory from
+#define ARENA_BASE 0x10000000
+#define ARENA_SIZE (512 << 20)
+
+#define MAX_IMAGE_SIZE (64 << 20)
+
+bool verbose;
+
+char bss_end[1];
+size_t e820_entries;
+struct memmap_entry e820_map[1];
+
+noreturn void panic(bool allow_menu, const char *fmt, ...) {
+    (void)allow_menu;
+    printf("PANIC: %s\n", fmt);
+    abort();
+}
+
+void print(const char *fmt, ...) {
+    (void)fmt;
+}
+
+uint32_t rand32(void) {
+    static uint32_t seed = 12345;
+    seed = seed * 1103515245 + 12345;
+    return seed;
+}
+
+static uint8_t *file_data;
+
+void fread(struct file_handle *fd, void *buf, uint64_t loc, uint64_t count) {
+    (void)fd;
+    memcpy(buf, file_data + loc, count);
+}
+
+struct load {
+    uint64_t entry, slide, physical_base, virtual_base, image_size, image_size_before_bss;
+    struct elf_range *ranges;
+    uint64_t ranges_count;
+    bool is_reloc;
+};
+
+static void load(struct file_handle *fd, struct load *l) {
+    elf64_load(fd, &l->entry, &l->slide, MEMMAP_KERNEL_AND_MODULES, true,
+               &l->ranges, &l->ranges_count, &l->physical_base, &l->virtual_base,
+               &l->image_size, &l->image_size_before_bss, &l->is_reloc);
+}
+
+static void unload(struct load *l) {
+    pmm_free((void *)(uintptr_t)l->physical_base, l->image_size);
+    pmm_free(l->ranges, l->ranges_count * sizeof(struct elf_range));
+}
+
+static bool check_slides(struct file_handle *fd, long expected) {
+    struct load a, b;
+
+    load(fd, &a);
+    do {
+        load(fd, &b);
+        if (b.slide == a.slide)
+            unload(&b);
+    } while (b.slide == a.slide);
+
+    bool ok = a.image_size == b.image_size && a.entry - a.slide == b.entry - b.slide;
+    long relocated = 0;
+
+    for (uint64_t i = 0; ok && i + 8 <= a.image_size; i += 8) {
+        uint64_t x = *(uint64_t *)(uintptr_t)(a.physical_base + i);
+        uint64_t y = *(uint64_t *)(uintptr_t)(b.physical_base + i);
+
+        if (x == y)
+            continue;
+
+        relocated++;
+
+        if (x - y != a.slide - b.slide) {
+            printf("  word at %llx is %llx with slide %llx but %llx with slide %llx\n",
+                   (unsigned long long)i, (unsigned long long)x, (unsigned long long)a.slide,
+                   (unsigned long long)y, (unsigned long long)b.slide);
+            ok = false;
+        }
+    }
+
+    if (ok && expected >= 0 && relocated != expected) {
+        printf("  %ld words relocated, expected %ld\n", relocated, expected);
+        ok = false;
+    }
+
+    unload(&a);
+    unload(&b);
+
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        printf("usage: %s <elf> [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    int iterations = argc > 2 ? atoi(argv[2]) : 20;
+    long expected = argc > 3 ? atoi(argv[3]) : -1;
+
+    if (mmap((void *)ARENA_BASE, ARENA_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == MAP_FAILED) {
+        printf("could not map the allocator's arena\n");
+        return 1;
+    }
+
+    memmap[0].base = ARENA_BASE;
+    memmap[0].length = ARENA_SIZE;
+    memmap[0].type = MEMMAP_USABLE;
+    memmap_entries = 1;
+    memmap_ordered = true;
+    allocations_disallowed = false;
+
+    file_data = ext_mem_alloc(MAX_IMAGE_SIZE);
+
+    int f = open(argv[1], 0);
+    if (f < 0) {
+        printf("could not open %s\n", argv[1]);
+        return 1;
+    }
+    long size = 0;
+    for (long r; (r = read(f, file_data + size, MAX_IMAGE_SIZE - size)) > 0; )
+        size += r;
+    close(f);
+
+    struct file_handle fd = { .size = size };
+
+    if (!check_slides(&fd, expected)) {
+        printf("%s: relocations do not follow the slide\n", argv[1]);
+        return 1;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int i = 0; i < iterations; i++) {
+        struct load l;
+        load(&fd, &l);
+        unload(&l);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+    printf("%s: %.3f ms per load over %d loads, %zu memory map entries\n",
+           argv[1], ms / iterations, iterations, memmap_entries);
+
+    return 0;
+}
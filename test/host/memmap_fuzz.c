@@ -0,0 +1,252 @@
+// Randomised check of memmap_alloc_range() against the rules the rest of the
+// bootloader relies on. Maps are built from random, possibly overlapping
+// entries, sanitised, and then have random ranges allocated out of them.
+// After every allocation:
+//
+//  - memmap_ordered is only set when the map really is ordered,
+//  - an ordered map stays ordered, and running sanitise_entries() over it
+//    again leaves it untouched,
+//  - an allocated range ends up entirely of the requested type, and no
+//    address outside of it changes type,
+//  - failed and simulated allocations leave the map alone.
+//
+// Built and run by `make -C test/host`, or by hand:
+//
+//     cc -O2 -DBIOS -I ../../common memmap_fuzz.c -o memmap_fuzz
+//     ./memmap_fuzz [seeds]
+
+#include <setjmp.h>
+
+#include "../../common/mm/pmm.s2.c"
+
+// The bootloader's own headers clash with stdio.h and stdlib.h
+int printf(const char *fmt, ...);
+long random(void);
+void srandom(unsigned seed);
+int atoi(const char *str);
+
+static jmp_buf panic_jmp;
+
+noreturn void panic(bool allow_menu, const char *fmt, ...) {
+    (void)allow_menu; (void)fmt;
+    longjmp(panic_jmp, 1);
+}
+
+void print(const char *fmt, ...) {
+    (void)fmt;
+}
+
+char bss_end[1];
+size_t e820_entries;
+struct memmap_entry e820_map[1];
+
+static struct memmap_entry before[memmap_max_entries];
+static size_t before_count;
+
+static uint32_t type_at(struct memmap_entry *m, size_t count, uint64_t addr) {
+    for (size_t i = 0; i < count; i++) {
+        if (addr >= m[i].base && addr < m[i].base + m[i].length)
+            return m[i].type;
+    }
+    return 0;
+}
+
+static bool map_equal(struct memmap_entry *a, size_t a_count, struct memmap_entry *b, size_t b_count) {
+    if (a_count != b_count)
+        return false;
+    for (size_t i = 0; i < a_count; i++) {
+        if (a[i].base != b[i].base || a[i].length != b[i].length || a[i].type != b[i].type)
+            return false;
+    }
+    return true;
+}
+
+static void dump(const char *what, struct memmap_entry *m, size_t count) {
+    printf("  %s:", what);
+    for (size_t i = 0; i < count; i++)
+        printf(" %llx+%llx:%x", (unsigned long long)m[i].base, (unsigned long long)m[i].length, m[i].type);
+    printf("\n");
+}
+
+static uint64_t random_addr(void) {
+    switch (random() % 3) {
+        case 0: return (random() % 64) * 0x1000;
+        case 1: return (random() % 4096) * 0x100;
+        default: return random() % 0x40000;
+    }
+}
+
+// Every address where the type of memory can change, in either map
+static bool check_outside(uint64_t base, uint64_t top) {
+    for (int pass = 0; pass < 2; pass++) {
+        struct memmap_entry *m = pass ? memmap : before;
+        size_t count = pass ? memmap_entries : before_count;
+
+        for (size_t i = 0; i < count; i++) {
+            uint64_t points[] = { m[i].base, m[i].base - 1, m[i].base + m[i].length, m[i].base + m[i].length - 1 };
+
+            for (size_t j = 0; j < sizeof(points) / sizeof(points[0]); j++) {
+                uint64_t p = points[j];
+                if (p >= base && p < top)
+                    continue;
+
+                uint32_t was = type_at(before, before_count, p);
+                uint32_t is = type_at(memmap, memmap_entries, p);
+
+                // Usable memory in the first page is dropped whenever the
+                // map is touched
+                if (p < 0x1000 && !sanitiser_keep_first_page && was == MEMMAP_USABLE && is == 0)
+                    continue;
+
+                if (was != is) {
+                    printf("  type at %llx changed from %x to %x\n", (unsigned long long)p, was, is);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool check_inside(uint64_t base, uint64_t top, uint32_t type) {
+    uint64_t p = base;
+
+    while (p < top) {
+        size_t i;
+        for (i = 0; i < memmap_entries; i++) {
+            if (p >= memmap[i].base && p < memmap[i].base + memmap[i].length)
+                break;
+        }
+
+        if (i == memmap_entries || memmap[i].type != type) {
+            if (p < 0x1000 && !sanitiser_keep_first_page && type == MEMMAP_USABLE) {
+                p = 0x1000;
+                continue;
+            }
+            printf("  %llx is not of type %x\n", (unsigned long long)p, type);
+            return false;
+        }
+
+        p = memmap[i].base + memmap[i].length;
+    }
+
+    return true;
+}
+
+static bool run_seed(unsigned seed) {
+    srandom(seed);
+
+    memmap_entries = 0;
+    sanitiser_keep_first_page = random() % 4 == 0;
+
+    uint64_t b = random() % 2 ? 0 : (random() % 4) * 0x800;
+    int n = 1 + random() % 12;
+    for (int i = 0; i < n; i++) {
+        uint64_t len = random() % 8 == 0 ? 0 : 0x100 * (1 + random() % 64);
+        uint32_t type = random() % 3 ? MEMMAP_USABLE : 1 + random() % 0x1001;
+        if (type > MEMMAP_BAD_MEMORY)
+            type = MEMMAP_BOOTLOADER_RECLAIMABLE;
+        if (len == 0 && type == MEMMAP_USABLE)
+            type = MEMMAP_RESERVED;
+
+        // Entries sometimes overlap the one before
+        if (random() % 3 == 0)
+            b -= b < 0x800 ? b : 0x100 * (random() % 8);
+
+        memmap[memmap_entries].base = b;
+        memmap[memmap_entries].length = len;
+        memmap[memmap_entries].type = type;
+        memmap_entries++;
+
+        b += len + (random() % 3 == 0 ? 0x100 * (random() % 32) : 0);
+    }
+
+    // sanitise_entries() expects at least one entry to survive, as on any
+    // real machine
+    memmap[memmap_entries].base = 0x100000;
+    memmap[memmap_entries].length = 0x1000;
+    memmap[memmap_entries].type = MEMMAP_RESERVED;
+    memmap_entries++;
+
+    if (setjmp(panic_jmp))
+        return true;
+
+    sanitise_entries(memmap, &memmap_entries, false);
+
+    for (int op = 0; op < 64; op++) {
+        uint64_t base = random_addr();
+        uint64_t len = random() % 4 ? 0x100 * (random() % 64) : random() % 0x8000;
+        uint32_t type = random() % 2 ? MEMMAP_BOOTLOADER_RECLAIMABLE : 1 + random() % MEMMAP_BAD_MEMORY;
+        uint32_t overlay = random() % 2 ? 0 : 1 + random() % 2;
+        bool simulation = random() % 5 == 0;
+        bool new_entry = random() % 2;
+
+        memcpy(before, memmap, memmap_entries * sizeof(struct memmap_entry));
+        before_count = memmap_entries;
+        bool was_ordered = memmap_ordered;
+
+        if (setjmp(panic_jmp))
+            return true;
+
+        bool ret = memmap_alloc_range(base, len, type, overlay, false, simulation, new_entry);
+
+        bool ok = true;
+
+        if (memmap_ordered && !memmap_is_ordered(memmap, memmap_entries)) {
+            printf("  memmap_ordered set on an unordered map\n");
+            ok = false;
+        }
+
+        if (was_ordered) {
+            if (!memmap_ordered) {
+                printf("  ordered map lost its order\n");
+                ok = false;
+            }
+
+            static struct memmap_entry again[memmap_max_entries];
+            size_t again_count = memmap_entries;
+            memcpy(again, memmap, memmap_entries * sizeof(struct memmap_entry));
+            sanitise_entries(again, &again_count, false);
+            if (!map_equal(again, again_count, memmap, memmap_entries)) {
+                printf("  map changes when sanitised again\n");
+                dump("sanitised", again, again_count);
+                ok = false;
+            }
+
+            if ((!ret || simulation) && !map_equal(before, before_count, memmap, memmap_entries)) {
+                printf("  map changed without an allocation\n");
+                ok = false;
+            }
+
+            if (ret && !simulation && len != 0) {
+                ok = check_inside(base, base + len, type) && ok;
+                ok = check_outside(base, base + len) && ok;
+            }
+        }
+
+        if (!ok) {
+            printf("seed %u op %d: alloc %llx+%llx type %x overlay %x simulation %d new_entry %d -> %d\n",
+                   seed, op, (unsigned long long)base, (unsigned long long)len, type, overlay,
+                   simulation, new_entry, ret);
+            dump("before", before, before_count);
+            dump("after", memmap, memmap_entries);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    unsigned seeds = argc > 1 ? (unsigned)atoi(argv[1]) : 100000;
+    unsigned failures = 0;
+
+    for (unsigned seed = 0; seed < seeds; seed++) {
+        if (!run_seed(seed) && ++failures == 10)
+            break;
+    }
+
+    printf("memmap_fuzz: %u seeds, %u failures\n", seeds, failures);
+    return failures != 0;
+}
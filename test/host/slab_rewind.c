@@ -0,0 +1,205 @@
+// Checks that small allocations stay sound across returns to the menu. The
+// menu snapshot is simulated the way menu.c takes it: the memory map and the
+// allocator's statics are copied when the "menu" first comes up, random
+// allocations and frees follow, then both are copied back and
+// pmm_rewind_slabs() is called. After every rewind:
+//
+//  - new objects lie within a single page, in memory the memory map has
+//    handed out to the bootloader,
+//  - new objects never overlap each other or an object that was live when
+//    the snapshot was taken,
+//  - the objects from before the snapshot still hold what was put in them.
+//
+// Built and run by `make -C test/host`, or by hand:
+//
+//     cc -O2 -DBIOS -I ../../common slab_rewind.c -o slab_rewind
+//     ./slab_rewind [rounds]
+
+#include "../../common/mm/pmm.s2.c"
+
+// The bootloader's own headers clash with stdio.h and stdlib.h
+int printf(const char *fmt, ...);
+long random(void);
+void srandom(unsigned seed);
+int atoi(const char *str);
+noreturn void abort(void);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+
+#define PROT_READ 0x1
+#define PROT_WRITE 0x2
+#define MAP_PRIVATE 0x02
+#define MAP_ANONYMOUS 0x20
+#define MAP_FIXED_NOREPLACE 0x100000
+#define MAP_FAILED ((void *)-1)
+
+// Where the allocator gets its memory from
+#define ARENA_BASE 0x10000000
+#define ARENA_SIZE (64 << 20)
+
+noreturn void panic(bool allow_menu, const char *fmt, ...) {
+    (void)allow_menu;
+    printf("PANIC: %s\n", fmt);
+    abort();
+}
+
+void print(const char *fmt, ...) {
+    (void)fmt;
+}
+
+char bss_end[1];
+size_t e820_entries;
+struct memmap_entry e820_map[1];
+
+#define MAX_OBJECTS 4096
+
+struct object {
+    uint8_t *ptr;
+    size_t size;
+    uint8_t fill;
+};
+
+// Live when the snapshot was taken
+static struct object before[MAX_OBJECTS];
+static size_t before_count;
+
+// Allocated since the snapshot or the last rewind
+static struct object after[MAX_OBJECTS];
+static size_t after_count;
+
+static struct memmap_entry saved_memmap[memmap_max_entries];
+static size_t saved_memmap_entries;
+static bool saved_memmap_ordered;
+static struct slab *saved_slab_partial[SLAB_CLASSES];
+static void *saved_slab_free_pages;
+
+static int failures;
+
+static void fail(const char *what, int round) {
+    if (failures++ < 10)
+        printf("round %d: %s\n", round, what);
+}
+
+static size_t random_size(void) {
+    return 1 + random() % SLAB_MAX_SIZE;
+}
+
+static struct object new_object(size_t size) {
+    struct object o = { ext_mem_alloc(size), size, (uint8_t)(1 + random() % 255) };
+    memset(o.ptr, o.fill, size);
+    return o;
+}
+
+static uint32_t type_at(uint64_t addr) {
+    for (size_t i = 0; i < memmap_entries; i++) {
+        if (addr >= memmap[i].base && addr - memmap[i].base < memmap[i].length)
+            return memmap[i].type;
+    }
+    return 0;
+}
+
+static bool overlap(struct object *a, struct object *b) {
+    return a->ptr < b->ptr + b->size && b->ptr < a->ptr + a->size;
+}
+
+static void check_new(struct object *o, int round) {
+    uintptr_t page = (uintptr_t)o->ptr & ~(uintptr_t)(PAGE_SIZE - 1);
+
+    if ((uintptr_t)o->ptr + o->size > page + PAGE_SIZE)
+        fail("object runs past the end of its page", round);
+    if (type_at(page) != MEMMAP_BOOTLOADER_RECLAIMABLE)
+        fail("object in memory the memory map does not hand out", round);
+
+    for (size_t i = 0; i < before_count; i++) {
+        if (overlap(o, &before[i]))
+            fail("object overlaps one from before the snapshot", round);
+    }
+    for (size_t i = 0; i < after_count; i++) {
+        if (overlap(o, &after[i]))
+            fail("object overlaps another new one", round);
+    }
+}
+
+static void check_before(int round) {
+    for (size_t i = 0; i < before_count; i++) {
+        for (size_t j = 0; j < before[i].size; j++) {
+            if (before[i].ptr[j] != before[i].fill) {
+                fail("object from before the snapshot was overwritten", round);
+                break;
+            }
+        }
+    }
+}
+
+// Random allocations and frees of objects made since the snapshot, filling
+// slabs up and emptying them again
+static void churn(size_t steps) {
+    for (size_t i = 0; i < steps; i++) {
+        if (after_count > 0 && (after_count == MAX_OBJECTS || random() % 3 == 0)) {
+            size_t victim = random() % after_count;
+            pmm_free(after[victim].ptr, after[victim].size);
+            after[victim] = after[--after_count];
+        } else {
+            after[after_count++] = new_object(random_size());
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 200;
+
+    if (mmap((void *)ARENA_BASE, ARENA_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0) == MAP_FAILED) {
+        printf("could not map the allocator's arena\n");
+        return 1;
+    }
+
+    memmap[0].base = ARENA_BASE;
+    memmap[0].length = ARENA_SIZE;
+    memmap[0].type = MEMMAP_USABLE;
+    memmap_entries = 1;
+    memmap_ordered = true;
+    allocations_disallowed = false;
+
+    srandom(1);
+
+    // What was allocated before the menu came up, leaving some slabs partly
+    // used and some arena pages unused
+    before_count = 300;
+    for (size_t i = 0; i < before_count; i++)
+        before[i] = new_object(random_size());
+
+    memcpy(saved_memmap, memmap, memmap_entries * sizeof(struct memmap_entry));
+    saved_memmap_entries = memmap_entries;
+    saved_memmap_ordered = memmap_ordered;
+    memcpy(saved_slab_partial, slab_partial, sizeof(slab_partial));
+    saved_slab_free_pages = slab_free_pages;
+
+    for (int round = 0; round < rounds; round++) {
+        srandom(round + 2);
+
+        after_count = 0;
+        churn(random() % 3000);
+
+        // Back to the menu
+        memcpy(memmap, saved_memmap, saved_memmap_entries * sizeof(struct memmap_entry));
+        memmap_entries = saved_memmap_entries;
+        memmap_ordered = saved_memmap_ordered;
+        memcpy(slab_partial, saved_slab_partial, sizeof(slab_partial));
+        slab_free_pages = saved_slab_free_pages;
+
+        pmm_rewind_slabs();
+
+        after_count = 0;
+        for (size_t i = 0; i < 1000; i++) {
+            struct object o = new_object(random_size());
+            check_new(&o, round);
+            after[after_count++] = o;
+        }
+
+        check_before(round);
+    }
+
+    printf("slab_rewind: %d rounds, %d failures\n", rounds, failures);
+
+    return failures != 0;
+}
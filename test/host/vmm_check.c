@@ -0,0 +1,205 @@
+// Randomised check of map_range() and map_page() against a plain model of
+// what should end up mapped. Every run starts from a 4GiB higher half direct
+// map made of 1GiB pages, then maps random ranges on top of it, some of them
+// overlapping the direct map so that its large pages have to be split. The
+// page tables are walked afterwards and every page in and around the ranges
+// has to translate to the address and flags the most recent mapping asked for.
+//
+// The same file is built for x86-64 and, with the architecture macros swapped
+// over, for LoongArch, whose page table code only ever runs on the host here:
+//
+//     cc -O2 -DBIOS -I ../../common vmm_check.c -o vmm_check_x86_64
+//     cc -O2 -ffreestanding -U__x86_64__ -D__loongarch64 -DBIOS
+//         -I ../../common vmm_check.c -o vmm_check_loongarch64
+//     ./vmm_check_x86_64 [seeds]
+
+#include "../../common/mm/vmm.c"
+
+// The bootloader's own headers clash with stdio.h and stdlib.h
+int printf(const char *fmt, ...);
+int fflush(void *stream);
+noreturn void abort(void);
+long random(void);
+void srandom(unsigned seed);
+int atoi(const char *str);
+int posix_memalign(void **ptr, size_t align, size_t size);
+
+bool verbose;
+
+noreturn void panic(bool allow_menu, const char *fmt, ...) {
+    (void)allow_menu;
+    printf("panic: %s\n", fmt);
+    fflush(NULL);
+    abort();
+}
+
+void print(const char *fmt, ...) {
+    (void)fmt;
+}
+
+void *ext_mem_alloc(size_t count) {
+    void *ret;
+    if (posix_memalign(&ret, PT_SIZE, count) != 0)
+        panic(false, "out of memory");
+    memset(ret, 0, count);
+    return ret;
+}
+
+// Tables are never given back during a run, so leaking them is harmless
+void pmm_free(void *ptr, size_t count) {
+    (void)ptr; (void)count;
+}
+
+#define NOT_MAPPED ((uint64_t)-1)
+
+// Returns the physical address virt translates to and the VMM_FLAG_* bits of
+// the page, or NOT_MAPPED.
+static uint64_t translate(pagemap_t pagemap, uint64_t virt, uint64_t *flags) {
+#if defined (__x86_64__)
+    pt_entry_t *table = pagemap.top_level;
+#elif defined (__loongarch64)
+    pt_entry_t *table = pagemap.pgd[virt >> 63];
+#endif
+
+    for (int level = 3; level >= 0; level--) {
+        pt_entry_t pte = table[(virt >> (12 + 9 * level)) & 0x1ff];
+        uint64_t size = page_sizes[level];
+
+#if defined (__x86_64__)
+        if (!(pte & PT_FLAG_VALID))
+            return NOT_MAPPED;
+
+        if (level > 0 && !(pte & PT_FLAG_LARGE)) {
+            table = (pt_entry_t *)(size_t)pte_addr(pte);
+            continue;
+        }
+
+        // The PAT bit sits at bit 7 in 4KiB pages and at bit 12 otherwise
+        uint64_t pat = level == 0 ? (pte >> 7) & 1 : (pte >> 12) & 1;
+        *flags = (pte & (VMM_FLAG_WRITE | VMM_FLAG_NOEXEC | ((uint64_t)1 << 3)))
+               | (pat << 12);
+#elif defined (__loongarch64)
+        if (pte == INVALID_PAGE)
+            return NOT_MAPPED;
+
+        if (level > 0 && !(pte & PT_FLAG_VALID)) {
+            table = (pt_entry_t *)(size_t)pte_addr(pte);
+            continue;
+        }
+
+        if (level > 0 && !PT_IS_LARGE(pte))
+            return NOT_MAPPED;
+
+        *flags = PT_TO_VMM_FLAGS(pte);
+#endif
+
+        // Flag bits below the page size are not part of the address
+        return (pte & PT_PADDR_MASK & ~(size - 1)) + (virt & (size - 1));
+    }
+
+    return NOT_MAPPED;
+}
+
+#define MAX_RANGES 6
+#define DIRECT_MAP_SIZE ((uint64_t)0x100000000)
+#define MARGIN ((uint64_t)0x400000)
+
+struct range {
+    uint64_t virt, phys, length, flags;
+};
+
+static struct range ranges[MAX_RANGES];
+static size_t range_count;
+
+// What virt should translate to, the last mapping covering it wins
+static uint64_t expected(uint64_t direct_map, uint64_t virt, uint64_t *flags) {
+    for (size_t i = range_count; i-- > 0; ) {
+        if (virt - ranges[i].virt < ranges[i].length) {
+            *flags = ranges[i].flags;
+            return ranges[i].phys + (virt - ranges[i].virt);
+        }
+    }
+
+    if (virt - direct_map < DIRECT_MAP_SIZE) {
+        *flags = VMM_FLAG_WRITE;
+        return virt - direct_map;
+    }
+
+    return NOT_MAPPED;
+}
+
+int main(int argc, char **argv) {
+    int seeds = argc > 1 ? atoi(argv[1]) : 200;
+    int fails = 0;
+    uint64_t pages_checked = 0;
+
+    uint64_t direct_map = paging_mode_higher_half(PAGING_MODE_MIN);
+
+    for (int seed = 0; seed < seeds; seed++) {
+        srandom(seed);
+
+        pagemap_t pagemap = new_pagemap(PAGING_MODE_MIN);
+
+        for (uint64_t i = 0; i < DIRECT_MAP_SIZE; i += 0x40000000) {
+            map_page(pagemap, direct_map + i, i, VMM_FLAG_WRITE, Size1GiB);
+        }
+
+        range_count = 1 + random() % MAX_RANGES;
+        uint64_t base = 0x40000000 * (random() % 4);
+
+        for (size_t i = 0; i < range_count; i++) {
+            // Mostly page size aligned addresses, with the odd small alignment
+            uint64_t align = (uint64_t)0x1000 << (random() % 3 ? 9 * (random() % 3) : random() % 20);
+            uint64_t offset = (random() % 64) * align;
+            uint64_t length = (random() % 3 ? 0x1000 * (random() % 4000) : 0x200000 * (random() % 700))
+                            + 0x1000 * (random() % 4);
+
+            uint64_t virt = random() % 2 ? direct_map : 0xffffffff00000000 - 0x100000000 * i;
+            virt += base + offset;
+            uint64_t phys = base + offset;
+            if (random() % 4 == 0)
+                phys += 0x1000 * (random() % 3);
+
+            uint64_t flags = (random() % 2 ? VMM_FLAG_WRITE : 0)
+                           | (random() % 2 ? VMM_FLAG_NOEXEC : 0)
+                           | (random() % 3 == 0 ? VMM_FLAG_FB : 0);
+
+            ranges[i] = (struct range){ virt, phys, length, flags };
+
+            if (random() % 8 == 0) {
+                for (uint64_t j = 0; j < length; j += 0x1000)
+                    map_page(pagemap, virt + j, phys + j, flags, Size4KiB);
+            } else {
+                map_range(pagemap, virt, phys, length, flags, Size1GiB);
+            }
+        }
+
+        for (size_t i = 0; i < range_count; i++) {
+            for (uint64_t j = -MARGIN; j != ranges[i].length + MARGIN; j += 0x1000) {
+                uint64_t virt = ranges[i].virt + j;
+                uint64_t got_flags = 0, want_flags = 0;
+                uint64_t got = translate(pagemap, virt, &got_flags);
+                uint64_t want = expected(direct_map, virt, &want_flags);
+
+                if (got == NOT_MAPPED)
+                    got_flags = 0;
+                if (want == NOT_MAPPED)
+                    want_flags = 0;
+
+                pages_checked++;
+
+                if (got != want || got_flags != want_flags) {
+                    if (fails++ < 10) {
+                        printf("seed %d: %lx maps to %lx flags %lx, expected %lx flags %lx\n",
+                               seed, virt, got, got_flags, want, want_flags);
+                    }
+                }
+            }
+        }
+    }
+
+    printf("vmm_check: %d seeds, %lu pages checked, %d mismatches\n",
+           seeds, pages_checked, fails);
+
+    return fails != 0;
+}